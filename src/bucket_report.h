@@ -0,0 +1,78 @@
+#ifndef _bucket_report_h
+#define _bucket_report_h
+
+/*!
+  @file bucket_report.h
+  @brief Bucket occupancy reporting for the TBB kmer hash containers.
+
+  For a kmer-keyed concurrent_unordered_map or multimap we tabulate how the
+  entries are spread over the container's buckets, and for comparison how
+  they would be spread over the same number of buckets by the original
+  byte-at-a-time kmer hash.
+*/
+
+#include "kmer_data.h"
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+/*! @brief The kmer hash used before keys were packed: (h * 17) ^ residue over the kmer string. */
+template <int K, typename Alphabet>
+inline size_t legacy_kmer_hash(const Kmer<K, Alphabet> &k)
+{
+    size_t h = 0;
+    for (int i = 0; i < K; i++)
+	h = (h * 17) ^ (unsigned int) Alphabet::table.residue[k.code_at(i)];
+    return h;
+}
+
+inline void write_bucket_occupancy(std::ostream &os, const std::string &label, const std::vector<uint32_t> &counts)
+{
+    const int n_bins = 6;
+    size_t hist[n_bins] = { 0 };
+    size_t nonempty = 0, total = 0;
+    uint32_t max_count = 0;
+    for (auto c: counts)
+    {
+	total += c;
+	if (c > 0)
+	    nonempty++;
+	if (c > max_count)
+	    max_count = c;
+	hist[c < 4 ? c : (c < 8 ? 4 : 5)]++;
+    }
+    double mean = nonempty ? double(total) / double(nonempty) : 0.0;
+    os << "  " << std::left << std::setw(8) << label << std::right
+       << " nonempty=" << nonempty
+       << " mean_nonempty=" << std::fixed << std::setprecision(2) << mean
+       << " max=" << max_count
+       << " hist[0,1,2,3,4-7,8+]=";
+    for (int i = 0; i < n_bins; i++)
+	os << (i ? "," : "") << hist[i];
+    os << "\n";
+    os.unsetf(std::ios::floatfield);
+}
+
+/*! @brief Report bucket occupancy of a kmer-keyed TBB unordered container.
+
+  Walks the container (not safe against concurrent insertion) and counts
+  entries per bucket under the container's hash and under legacy_kmer_hash().
+*/
+template <typename Map>
+void report_bucket_occupancy(std::ostream &os, const std::string &name, const Map &map)
+{
+    size_t n_buckets = map.unsafe_bucket_count();
+    std::vector<uint32_t> current(n_buckets), legacy(n_buckets);
+    for (auto &ent: map)
+    {
+	current[map.unsafe_bucket(ent.first)]++;
+	legacy[legacy_kmer_hash(ent.first) % n_buckets]++;
+    }
+    os << "bucket occupancy for " << name << ": " << map.size() << " entries in " << n_buckets << " buckets\n";
+    write_bucket_occupancy(os, "kmer", current);
+    write_bucket_occupancy(os, "legacy", legacy);
+}
+
+#endif // _bucket_report_h
@@ -0,0 +1,98 @@
+#include "build_checkpoint.h"
+
+#include <boost/filesystem/fstream.hpp>
+
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+static const char CheckpointMagic[4] = { 'K', 'C', 'K', 'P' };
+static const uint32_t CheckpointVersion = 1;
+
+void InputDigest::add(const void *data, size_t len)
+{
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < len; i++)
+    {
+	value_ ^= p[i];
+	value_ *= 0x100000001b3ULL;
+    }
+}
+
+void InputDigest::add_file(const fs::path &file)
+{
+    if (!fs::is_regular_file(file))
+    {
+	add(file.string());
+	return;
+    }
+    fs::path name = fs::canonical(file);
+    add(name.string());
+    add(static_cast<uint64_t>(fs::file_size(name)));
+    add(static_cast<uint64_t>(fs::last_write_time(name)));
+}
+
+BuildCheckpoint::BuildCheckpoint(const fs::path &dir, uint64_t input_digest, bool resume)
+    : dir_(dir)
+    , input_digest_(input_digest)
+    , completed_(BuildPhase::None)
+{
+    fs::create_directories(dir_);
+
+    if (!resume)
+    {
+	fs::remove(file("state"));
+	return;
+    }
+
+    fs::ifstream in(file("state"), std::ios::binary);
+    char magic[4];
+    uint32_t version, phase;
+    uint64_t digest;
+    if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, CheckpointMagic, sizeof(magic)) != 0 ||
+	!in.read(reinterpret_cast<char *>(&version), sizeof(version)) || version != CheckpointVersion ||
+	!in.read(reinterpret_cast<char *>(&digest), sizeof(digest)) ||
+	!in.read(reinterpret_cast<char *>(&phase), sizeof(phase)))
+    {
+	std::cerr << "no checkpoint in " << dir_ << "; starting a new build\n";
+	return;
+    }
+    if (digest != input_digest_)
+    {
+	std::cerr << "build inputs have changed since the checkpoint in " << dir_ << "; starting a new build\n";
+	return;
+    }
+    completed_ = static_cast<BuildPhase>(phase);
+    std::cerr << "resuming build after phase " << phase << "\n";
+}
+
+void BuildCheckpoint::complete(BuildPhase phase)
+{
+    fs::path tmp = file("state.tmp");
+    fs::ofstream out(tmp, std::ios::binary);
+    uint32_t p = static_cast<uint32_t>(phase);
+    out.write(CheckpointMagic, sizeof(CheckpointMagic));
+    out.write(reinterpret_cast<const char *>(&CheckpointVersion), sizeof(CheckpointVersion));
+    out.write(reinterpret_cast<const char *>(&input_digest_), sizeof(input_digest_));
+    out.write(reinterpret_cast<const char *>(&p), sizeof(p));
+    out.close();
+    if (!out)
+	throw std::runtime_error("error writing checkpoint " + tmp.string());
+    fs::rename(tmp, file("state"));
+    completed_ = phase;
+}
+
+void BuildCheckpoint::copy_file(const fs::path &from, const fs::path &to)
+{
+    fs::ifstream in(from, std::ios::binary);
+    if (!in)
+	throw std::runtime_error("cannot read " + from.string());
+    fs::path tmp = to;
+    tmp += ".tmp";
+    fs::ofstream out(tmp, std::ios::binary);
+    out << in.rdbuf();
+    out.close();
+    if (!out)
+	throw std::runtime_error("error writing " + tmp.string());
+    fs::rename(tmp, to);
+}
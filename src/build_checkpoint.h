@@ -0,0 +1,86 @@
+#ifndef _build_checkpoint_h
+#define _build_checkpoint_h
+
+/*!
+  @file build_checkpoint.h
+  @brief Phase checkpoints for kmers-build-signatures.
+
+  A checkpoint directory holds the state of a signature build at its
+  phase boundaries, so a build that fails can be resumed with --resume
+  from the last completed phase:
+
+  - FunctionsLoaded: the function assignments and kept function index
+    (file "functions") and the function.index file;
+  - KmersExtracted: the kmer contribution of each fasta file, written as
+    each file completes (see kmer_contribution.h);
+  - KmersProcessed: the kept kmers (file "kept_kmers").
+
+  The "state" file records the last completed phase and a digest of the
+  build inputs: the parameters and the name, size and modification time
+  of each input file. A checkpoint whose digest does not match the
+  current inputs is discarded. Contributions additionally verify the
+  checksum of their source.
+*/
+
+#include <boost/filesystem.hpp>
+
+#include <cstdint>
+#include <string>
+
+namespace fs = boost::filesystem;
+
+enum class BuildPhase : uint32_t
+{
+    None = 0,
+    FunctionsLoaded = 1,
+    KmersExtracted = 2,
+    KmersProcessed = 3
+};
+
+/*! @brief 64-bit FNV-1a digest of build inputs. */
+class InputDigest
+{
+public:
+    InputDigest() : value_(0xcbf29ce484222325ULL) {}
+
+    void add(const void *data, size_t len);
+    void add(const std::string &s) { add(s.data(), s.size()); add(uint64_t(s.size())); }
+    void add(uint64_t v) { add(&v, sizeof(v)); }
+
+    /*! Add the canonical name, size and modification time of file, or its name if it is not a file. */
+    void add_file(const fs::path &file);
+
+    uint64_t value() const { return value_; }
+
+private:
+    uint64_t value_;
+};
+
+class BuildCheckpoint
+{
+public:
+    /*! Open the checkpoint in dir for a build with the given input digest.
+
+      Unless resume is set, or if the recorded inputs differ, the build
+      starts over from BuildPhase::None.
+    */
+    BuildCheckpoint(const fs::path &dir, uint64_t input_digest, bool resume);
+
+    /*! The last phase completed by the checkpointed build. */
+    BuildPhase completed() const { return completed_; }
+
+    /*! Record that phase is complete; its state files must already be written. */
+    void complete(BuildPhase phase);
+
+    fs::path file(const std::string &name) const { return dir_ / name; }
+
+    /*! Copy file from to to, replacing to. */
+    static void copy_file(const fs::path &from, const fs::path &to);
+
+private:
+    fs::path dir_;
+    uint64_t input_digest_;
+    BuildPhase completed_;
+};
+
+#endif // _build_checkpoint_h
@@ -0,0 +1,283 @@
+#include "build_stats.h"
+
+#include <boost/filesystem/fstream.hpp>
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+
+static void process_usage(double &user_cpu, double &sys_cpu, long &peak_rss_kb)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    user_cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6;
+    sys_cpu = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+    peak_rss_kb = ru.ru_maxrss;
+}
+
+/*! Peak RSS in kB since the high-water mark was last reset, or 0 if it cannot be read. */
+static long rss_high_water_mark()
+{
+    std::ifstream in("/proc/self/status");
+    std::string line;
+    while (std::getline(in, line))
+    {
+	if (line.compare(0, 6, "VmHWM:") == 0)
+	    return std::strtol(line.c_str() + 6, nullptr, 10);
+    }
+    return 0;
+}
+
+/*! Reset the RSS high-water mark to the current RSS. */
+static bool reset_rss_high_water_mark()
+{
+    std::ofstream out("/proc/self/clear_refs");
+    out << "5";
+    out.close();
+    return static_cast<bool>(out);
+}
+
+static std::string json_string(const std::string &s)
+{
+    std::string out = "\"";
+    for (char c: s)
+    {
+	if (c == '"' || c == '\\')
+	{
+	    out += '\\';
+	    out += c;
+	}
+	else if (static_cast<unsigned char>(c) < 0x20)
+	{
+	    char buf[8];
+	    std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+	    out += buf;
+	}
+	else
+	    out += c;
+    }
+    return out + "\"";
+}
+
+BuildStats::BuildStats()
+    : start_(std::chrono::steady_clock::now())
+    , reset_peak_(reset_rss_high_water_mark())
+    , process_peak_rss_kb_(0)
+    , signo_(0)
+    , stop_(false)
+{
+}
+
+BuildStats::~BuildStats()
+{
+    if (signal_thread_.joinable())
+    {
+	stop_ = true;
+	pthread_kill(signal_thread_.native_handle(), signo_);
+	signal_thread_.join();
+    }
+}
+
+/*!
+  Read the peak RSS since the last reset into the process peak and the
+  peak of every running phase; lock_ must be held.
+*/
+long BuildStats::sample_peak_rss()
+{
+    long peak = rss_high_water_mark();
+    if (peak == 0)
+    {
+	double user_cpu, sys_cpu;
+	process_usage(user_cpu, sys_cpu, peak);
+    }
+    process_peak_rss_kb_ = std::max(process_peak_rss_kb_, peak);
+    for (auto &rec: phases_)
+    {
+	if (rec.running)
+	    rec.peak_rss_kb = std::max(rec.peak_rss_kb, peak);
+    }
+    return peak;
+}
+
+BuildStats::Phase BuildStats::phase(const std::string &name)
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    sample_peak_rss();
+    if (reset_peak_)
+	reset_rss_high_water_mark();
+    phases_.emplace_back();
+    PhaseRecord &rec = phases_.back();
+    rec.name = name;
+    rec.start = std::chrono::steady_clock::now();
+    long rss;
+    process_usage(rec.start_user_cpu, rec.start_sys_cpu, rss);
+    rec.running = true;
+    rec.wall_seconds = rec.user_cpu_seconds = rec.sys_cpu_seconds = 0.0;
+    rec.peak_rss_kb = 0;
+    return Phase(*this, rec);
+}
+
+void BuildStats::end_phase(PhaseRecord &rec)
+{
+    double user_cpu, sys_cpu;
+    long rss;
+    process_usage(user_cpu, sys_cpu, rss);
+
+    std::lock_guard<std::mutex> guard(lock_);
+    sample_peak_rss();
+    rec.running = false;
+    rec.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - rec.start).count();
+    rec.user_cpu_seconds = user_cpu - rec.start_user_cpu;
+    rec.sys_cpu_seconds = sys_cpu - rec.start_sys_cpu;
+}
+
+void BuildStats::Phase::count(const std::string &name, uint64_t n)
+{
+    std::lock_guard<std::mutex> guard(stats_->lock_);
+    rec_->counts.emplace_back(name, n);
+}
+
+void BuildStats::Phase::size(const std::string &name, uint64_t n)
+{
+    std::lock_guard<std::mutex> guard(stats_->lock_);
+    rec_->sizes.emplace_back(name, n);
+}
+
+void BuildStats::Phase::end()
+{
+    if (stats_)
+	stats_->end_phase(*rec_);
+    stats_ = nullptr;
+}
+
+void BuildStats::watch_counter(const std::string &name, const std::atomic<uint64_t> &counter)
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    counters_.emplace_back(name, &counter);
+}
+
+/*!
+  The signal is taken synchronously with sigwait() in a dedicated
+  thread, so the progress is written outside of a signal handler.
+*/
+void BuildStats::watch_signal(int signo)
+{
+    signo_ = signo;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, signo);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+    signal_thread_ = std::thread([this, set] {
+	int sig;
+	while (sigwait(&set, &sig) == 0 && !stop_)
+	    write_progress(std::cerr);
+    });
+}
+
+void BuildStats::write_progress(std::ostream &os)
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    auto now = std::chrono::steady_clock::now();
+    double user_cpu, sys_cpu;
+    long rss;
+    process_usage(user_cpu, sys_cpu, rss);
+    sample_peak_rss();
+
+    os << "progress: " << std::fixed << std::setprecision(1)
+       << std::chrono::duration<double>(now - start_).count() << "s elapsed, "
+       << user_cpu + sys_cpu << "s cpu, peak rss " << process_peak_rss_kb_ / 1024 << " MB\n";
+    for (auto &rec: phases_)
+    {
+	if (rec.running)
+	    os << "progress: in " << rec.name << " for " << std::chrono::duration<double>(now - rec.start).count() << "s\n";
+    }
+    for (auto &c: counters_)
+	os << "progress: " << c.first << " " << c.second->load() << "\n";
+    os << std::defaultfloat << std::flush;
+}
+
+/*!
+  The file is written as
+
+    { "wall_seconds": ..., "cpu_seconds": ..., "peak_rss_kb": ...,
+      "phases": [ { "name": ..., "wall_seconds": ..., "user_cpu_seconds": ...,
+                    "sys_cpu_seconds": ..., "peak_rss_kb": ...,
+                    "counts": { name: n, ... },
+                    "rates": { name_per_second: r, ... },
+                    "sizes": { name: n, ... } }, ... ] }
+
+  Phases still running are reported up to now.
+*/
+void BuildStats::write_json(const fs::path &file)
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    auto now = std::chrono::steady_clock::now();
+    double user_cpu, sys_cpu;
+    long rss;
+    process_usage(user_cpu, sys_cpu, rss);
+    sample_peak_rss();
+
+    fs::ofstream out(file);
+    if (!out)
+	throw std::runtime_error("cannot write build statistics " + file.string());
+
+    out << std::setprecision(6);
+    out << "{\n";
+    out << "  \"wall_seconds\": " << std::chrono::duration<double>(now - start_).count() << ",\n";
+    out << "  \"cpu_seconds\": " << user_cpu + sys_cpu << ",\n";
+    out << "  \"peak_rss_kb\": " << process_peak_rss_kb_ << ",\n";
+    out << "  \"phases\": [";
+    const char *sep = "\n";
+    for (auto &rec: phases_)
+    {
+	double wall = rec.wall_seconds, user = rec.user_cpu_seconds, sys = rec.sys_cpu_seconds;
+	if (rec.running)
+	{
+	    wall = std::chrono::duration<double>(now - rec.start).count();
+	    user = user_cpu - rec.start_user_cpu;
+	    sys = sys_cpu - rec.start_sys_cpu;
+	}
+
+	out << sep << "    {\n";
+	sep = ",\n";
+	out << "      \"name\": " << json_string(rec.name) << ",\n";
+	out << "      \"wall_seconds\": " << wall << ",\n";
+	out << "      \"user_cpu_seconds\": " << user << ",\n";
+	out << "      \"sys_cpu_seconds\": " << sys << ",\n";
+	out << "      \"peak_rss_kb\": " << rec.peak_rss_kb;
+
+	auto write_map = [&out](const char *key, const std::vector<std::pair<std::string, uint64_t>> &values,
+				const char *suffix, double divisor) {
+	    out << ",\n      " << json_string(key) << ": {";
+	    const char *vsep = " ";
+	    for (auto &v: values)
+	    {
+		out << vsep << json_string(v.first + suffix) << ": ";
+		if (divisor > 0.0)
+		    out << double(v.second) / divisor;
+		else
+		    out << v.second;
+		vsep = ", ";
+	    }
+	    out << " }";
+	};
+	write_map("counts", rec.counts, "", 0.0);
+	if (wall > 0.0)
+	    write_map("rates", rec.counts, "_per_second", wall);
+	write_map("sizes", rec.sizes, "", 0.0);
+	out << "\n    }";
+    }
+    out << "\n  ]\n}\n";
+    out.close();
+    if (!out)
+	throw std::runtime_error("error writing build statistics " + file.string());
+}
@@ -0,0 +1,118 @@
+#ifndef _build_stats_h
+#define _build_stats_h
+
+/*!
+  @file build_stats.h
+  @brief Per-phase instrumentation for kmers-build-signatures.
+
+  A BuildStats collects, for each named phase of the build, the wall
+  time, the process CPU time (user and system) and the peak resident set
+  size while the phase ran, plus counts of the work done (reported with
+  their rate per wall second) and sizes of the main containers. Phases
+  may overlap, as the table writers run alongside recall; the CPU time
+  and peak RSS of a phase are the whole process's while it ran.
+
+  The peak RSS of a phase comes from the kernel's high-water mark
+  (VmHWM), which is reset to the current RSS at the start of each phase
+  by writing 5 to /proc/self/clear_refs. The mark is first read into
+  every running phase, so an enclosing phase keeps the peak it reached
+  before. Where the mark cannot be reset, each phase reports the
+  process's peak so far.
+
+  write_json() writes the collected phases. watch_signal() starts a
+  thread that prints the running phases and the registered live
+  counters to stderr each time the process receives the signal.
+*/
+
+#include <boost/filesystem.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace fs = boost::filesystem;
+
+class BuildStats
+{
+public:
+    struct PhaseRecord
+    {
+	std::string name;
+	std::chrono::steady_clock::time_point start;
+	double start_user_cpu;
+	double start_sys_cpu;
+	bool running;
+	double wall_seconds;
+	double user_cpu_seconds;
+	double sys_cpu_seconds;
+	long peak_rss_kb;
+	std::vector<std::pair<std::string, uint64_t>> counts;
+	std::vector<std::pair<std::string, uint64_t>> sizes;
+    };
+
+    /*! @brief A running phase; ends when end() is called or it is destroyed. */
+    class Phase
+    {
+    public:
+	Phase(BuildStats &stats, PhaseRecord &rec) : stats_(&stats), rec_(&rec) {}
+	Phase(Phase &&other) : stats_(other.stats_), rec_(other.rec_) { other.stats_ = nullptr; }
+	Phase(const Phase &) = delete;
+	~Phase() { end(); }
+
+	/*! Record n units of work, reported with their rate. */
+	void count(const std::string &name, uint64_t n);
+
+	/*! Record the size of a container. */
+	void size(const std::string &name, uint64_t n);
+
+	void end();
+
+    private:
+	BuildStats *stats_;
+	PhaseRecord *rec_;
+    };
+
+    BuildStats();
+    ~BuildStats();
+
+    /*! Start timing phase name. */
+    Phase phase(const std::string &name);
+
+    /*! Include counter in the progress printed by watch_signal(). */
+    void watch_counter(const std::string &name, const std::atomic<uint64_t> &counter);
+
+    /*! Print the progress of the build to stderr on each signo.
+
+      The signal is blocked in the calling thread and the threads it
+      starts later, so this must be called before any other threads are
+      started.
+    */
+    void watch_signal(int signo);
+
+    void write_progress(std::ostream &os);
+    void write_json(const fs::path &file);
+
+private:
+    void end_phase(PhaseRecord &rec);
+    long sample_peak_rss();
+
+    std::mutex lock_;
+    std::chrono::steady_clock::time_point start_;
+    std::list<PhaseRecord> phases_;
+    bool reset_peak_;
+    long process_peak_rss_kb_;
+    std::vector<std::pair<std::string, const std::atomic<uint64_t> *>> counters_;
+
+    int signo_;
+    std::atomic<bool> stop_;
+    std::thread signal_thread_;
+};
+
+#endif // _build_stats_h
@@ -5,6 +5,8 @@
 
 #include "operators.h"
 #include "fasta_parser.h"
+#include "translation.h"
+#include "tbb_pipeline.h"
 
 #include <boost/math/statistics/univariate_statistics.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -18,6 +20,7 @@
 
 #include <tbb/concurrent_vector.h>
 #include <tbb/concurrent_map.h>
+#include <tbb/task_arena.h>
 #include "seq_id_map.h"
 
 class KmerCall
@@ -56,12 +59,61 @@ inline std::ostream &operator<<(std::ostream &os, const KmerCall &c)
     return os;
 }
 
+/*! @brief Tally of signature kmer hits by function for a sequencing read.
+
+  A read (or read pair) hits only a handful of functions, so the counts
+  are kept in a small vector rather than a map.
+*/
+class ReadHits
+{
+public:
+    void clear() { counts_.clear(); }
+
+    void add(FunctionIndex fi) {
+	for (auto &c: counts_)
+	{
+	    if (c.first == fi)
+	    {
+		c.second++;
+		return;
+	    }
+	}
+	counts_.emplace_back(fi, 1);
+    }
+
+    /*! The function with the most hits if it has at least min_hits and
+      more than any other function; UndefinedFunction otherwise. */
+    FunctionIndex best(int min_hits, int &count) const {
+	FunctionIndex best = UndefinedFunction;
+	int best_count = 0, next_count = 0;
+	for (auto &c: counts_)
+	{
+	    if (c.second > best_count)
+	    {
+		next_count = best_count;
+		best_count = c.second;
+		best = c.first;
+	    }
+	    else if (c.second > next_count)
+		next_count = c.second;
+	}
+	count = best_count;
+	if (best_count < min_hits || best_count == next_count)
+	    return UndefinedFunction;
+	return best;
+    }
+
+private:
+    std::vector<std::pair<FunctionIndex, int>> counts_;
+};
 
 template <class KmerDb>
 class FunctionCaller
 {
 public:
-    
+    static constexpr int KmerSize = KmerDb::KmerSize;
+    using KmerAlphabet = typename KmerDb::KmerAlphabet;
+
     FunctionCaller(KmerDb &db, const fs::path &function_index_file,
 		   int min_hits = 5, int max_gap = 200);
 
@@ -73,17 +125,63 @@ public:
     template <typename HitCB, typename CallCB>
     void process_fasta_stream(std::istream &istr, HitCB &hit_cb, CallCB &call_cb);
 
+    template <typename HitCB, typename CallCB>
+    void process_fasta_file(const fs::path &file, HitCB &hit_cb, CallCB &call_cb);
+
     template <typename HitCB, typename CallCB>
     void process_fasta_stream_parallel(std::istream &istr, HitCB &hit_cb, CallCB &call_cb
 				       ,SeqIdMap &idmap
 	);
 
+    template <typename HitCB, typename CallCB>
+    void process_fasta_file_parallel(const fs::path &file, HitCB &hit_cb, CallCB &call_cb
+				     ,SeqIdMap &idmap
+	);
+
+    /*! Process the sequences in a list of fasta files.
+
+      Large files are split at record boundaries (see FastaChunks) and the
+      pieces of all the files are processed concurrently. Each sequence of
+      a piece is handed to seq_cb(Output &out, id, seq), which typically
+      calls process_sequence() or process_contig() and writes the calls
+      into out, a fresh Output for each piece; output_cb(std::shared_ptr<Output>)
+      is invoked for the pieces in file order.
+    */
+    template <typename Output, typename PathList, typename SeqCB, typename OutputCB>
+    void process_fasta_files_chunked(const PathList &files, SeqCB &seq_cb, OutputCB &output_cb,
+				     size_t chunk_size = FastaChunks::DefaultChunkSize);
+
+    template <typename HitCB, typename CallCB>
+    void process_sequence(std::string_view id, std::string_view seq, HitCB &hit_cb, CallCB &call_cb);
+
+    /*! Call functions on a nucleotide contig.
+
+      The contig is translated in six frames and each stretch between stop
+      codons that can hold min_hits kmers is called as a protein. A call is
+      reported as region_cb(id, left, right, strand, func, func_index, score),
+      where left <= right are the 1-based contig coordinates of the bases
+      covered by the kmer hits for the called function and strand is '+'
+      or '-'.
+    */
+    template <typename HitCB, typename RegionCB>
+    void process_contig(std::string_view id, std::string_view seq, HitCB &hit_cb, RegionCB &region_cb);
+
+    /*! Add the signature kmer hits of a nucleotide read to hits.
+
+      The read is translated in six frames and every kmer between stop
+      codons is looked up. Reads are too short for the hit grouping and
+      length checks of process_sequence(); the caller assigns the read
+      from the tally (see ReadHits::best()).
+    */
     template <typename HitCB>
-    void process_aa_seq(const std::string &id, const std::string &seq,
+    void tally_read_hits(std::string_view id, std::string_view seq, ReadHits &hits, HitCB &hit_cb);
+
+    template <typename HitCB>
+    void process_aa_seq(std::string_view id, std::string_view seq,
 			std::shared_ptr<std::vector<KmerCall>> calls,
 			HitCB hit_cb);
 
-    void find_best_call(const std::string &id, std::vector<KmerCall> &calls, FunctionIndex &function_index,
+    void find_best_call(std::string_view id, std::vector<KmerCall> &calls, FunctionIndex &function_index,
 			std::string &function, float &score, float &score_offset);
 
 
@@ -120,18 +218,31 @@ public:
 
     void ignore_hypothetical(bool x) { ignore_hypothetical_ = x; }
 
+    /*! Read fasta files from this cache when it holds them. */
+    void set_sequence_cache(const KseqCache *cache) { seq_cache_ = cache; }
+
 
 private:
 
+    template <typename Input, typename HitCB, typename CallCB>
+    void process_fasta(Input &input, HitCB &hit_cb, CallCB &call_cb);
+
+    template <typename Input, typename HitCB, typename CallCB>
+    void process_fasta_parallel(Input &input, HitCB &hit_cb, CallCB &call_cb, SeqIdMap &idmap);
+
     KmerDb &kmer_db_;
 
     bool order_constraint_;
     int min_hits_;
     int max_gap_;
     bool ignore_hypothetical_;
+    const KseqCache *seq_cache_;
 
     std::vector<std::string> function_index_;
     std::string undefined_function_;
+
+    /*! Index of hypothetical protein, or -1 if the function index lacks it. */
+    long hypo_index_;
     
 };
 
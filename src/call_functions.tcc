@@ -32,7 +32,7 @@ public:
     int count() { return static_cast<int>(hits_.size()); }
     auto clear() { return hits_.clear(); }
     hit& last_hit() { return hits_.back(); }
-    void process(const std::string &id, double seqlen, FunctionIndex &current_fI,
+    void process(std::string_view id, double seqlen, FunctionIndex &current_fI,
 		 std::shared_ptr<std::vector<KmerCall>> calls) {
 
 	int fI_count = 0;
@@ -115,7 +115,9 @@ FunctionCaller<KmerDb>::FunctionCaller(KmerDb &kmer_db, const fs::path &function
     order_constraint_(false),
     min_hits_(min_hits),
     max_gap_(max_gap),
-    ignore_hypothetical_(false)
+    ignore_hypothetical_(false),
+    seq_cache_(nullptr),
+    hypo_index_(-1)
 {
     read_function_index(function_index_file);
 }
@@ -145,19 +147,28 @@ void FunctionCaller<KmerDb>::read_function_index(const fs::path &function_index_
 	
 	function_index_[id] = parts[1];
     }
+
+    auto it = std::find(function_index_.begin(), function_index_.end(), "hypothetical protein");
+    hypo_index_ = it == function_index_.end() ? -1 : it - function_index_.begin();
 }
 
 struct Sequence
 {
     std::string id;
     std::string seq;
-    Sequence(const std::string &i, const std::string &s) : id(i), seq(s) {}
+    Sequence(std::string_view i, std::string_view s) : id(i), seq(s) {}
 };
 
+/*!
+  @brief Call functions for the proteins in a fasta stream or file.
+
+  The whole input is parsed first; the sequences are then called in parallel.
+  A file is mapped (or decompressed in the background) rather than streamed.
+*/
 template <class KmerDb>
-template <typename HitCB, typename CallCB>
-void FunctionCaller<KmerDb>::process_fasta_stream_parallel(std::istream &istr, HitCB &hit_cb, CallCB &call_cb
-							   ,SeqIdMap &idmap
+template <typename Input, typename HitCB, typename CallCB>
+void FunctionCaller<KmerDb>::process_fasta_parallel(Input &input, HitCB &hit_cb, CallCB &call_cb
+						    ,SeqIdMap &idmap
     )
 {
 
@@ -166,44 +177,19 @@ void FunctionCaller<KmerDb>::process_fasta_stream_parallel(std::istream &istr, H
 	
 	tbb::concurrent_vector<Sequence> seqs;
     
-	parser.set_callback([this, &seqs, &idmap ](const std::string &id, const std::string &seq) {
+	parser.parse(input, [&seqs, &idmap](std::string_view id, std::string_view def, std::string_view seq) {
 
 	    if (id.empty())
-		return 0;
-	    // if (seq.length() > 50)
-	    {
-		int idx = idmap.lookup_id(id);
-
-		seqs.emplace_back(id, seq);
-	    }
-	    return 1;
+		return;
+	    idmap.lookup_id(id);
+	    seqs.emplace_back(id, seq);
 	});
-	parser.parse(istr);
-	parser.parse_complete();
 
 	tbb::parallel_for(seqs.range(), [this, &hit_cb, &call_cb](auto r) {
 
-	    for (auto entry: r)
+	    for (auto &entry: r)
 	    {
-		std::string &id = entry.id;
-		std::string &seq = entry.seq;
-		
-		double slen = static_cast<double>(seq.length());
-		auto calls = std::make_shared<std::vector<KmerCall>>();
-		
-		// std::cerr << "stream " << id << " " << seq << "\n";
-		process_aa_seq(id, seq, calls, hit_cb);
-		for (auto c: *calls)
-		{
-		    // std::cout << c << "\n";
-		}
-		FunctionIndex fi;
-		std::string func;
-		float score;
-		float offset;
-		find_best_call(id, *calls, fi, func, score, offset);
-		call_cb(id, func, fi, score, seq.size());
-		// std::cout << id << "\t" << func << "\t" << fi << "\t" << score << "\n";
+		process_sequence(entry.id, entry.seq, hit_cb, call_cb);
 	    }
 	});;
 
@@ -216,37 +202,41 @@ void FunctionCaller<KmerDb>::process_fasta_stream_parallel(std::istream &istr, H
 
 template <class KmerDb>
 template <typename HitCB, typename CallCB>
-void FunctionCaller<KmerDb>::process_fasta_stream(std::istream &istr, HitCB &hit_cb, CallCB &call_cb)
+void FunctionCaller<KmerDb>::process_fasta_stream_parallel(std::istream &istr, HitCB &hit_cb, CallCB &call_cb
+							   ,SeqIdMap &idmap
+    )
+{
+    process_fasta_parallel(istr, hit_cb, call_cb, idmap);
+}
+
+template <class KmerDb>
+template <typename HitCB, typename CallCB>
+void FunctionCaller<KmerDb>::process_fasta_file_parallel(const fs::path &file, HitCB &hit_cb, CallCB &call_cb
+							 ,SeqIdMap &idmap
+    )
+{
+    const KseqFile *cached = seq_cache_ ? seq_cache_->find(file) : nullptr;
+    if (cached)
+	process_fasta_parallel(*cached, hit_cb, call_cb, idmap);
+    else
+	process_fasta_parallel(file, hit_cb, call_cb, idmap);
+}
+
+/*!
+  @brief Call functions for the proteins in a fasta stream or file, in input order.
+*/
+template <class KmerDb>
+template <typename Input, typename HitCB, typename CallCB>
+void FunctionCaller<KmerDb>::process_fasta(Input &input, HitCB &hit_cb, CallCB &call_cb)
 {
 
     try {
 	FastaParser parser;
     
-	parser.set_callback([this, &hit_cb, &call_cb](const std::string &id, const std::string &seq) {
-
-	    if (id.empty())
-		return 0;
-	    double slen = static_cast<double>(seq.length());
-	    auto calls = std::make_shared<std::vector<KmerCall>>();
-
-	    // std::cerr << "stream " << id << " " << seq << "\n";
-	    process_aa_seq(id, seq, calls, hit_cb);
-	    for (auto c: *calls)
-	    {
-		// std::cout << c << "\n";
-	    }
-	    FunctionIndex fi;
-	    std::string func;
-	    float score;
-	    float offset;
-	    find_best_call(id, *calls, fi, func, score, offset);
-	    call_cb(id, func, fi, score, seq.size());
-	    // std::cout << id << "\t" << func << "\t" << fi << "\t" << score << "\n";
-	    return 0;
+	parser.parse(input, [this, &hit_cb, &call_cb](std::string_view id, std::string_view def, std::string_view seq) {
+	    if (!id.empty())
+		process_sequence(id, seq, hit_cb, call_cb);
 	});
-
-	parser.parse(istr);
-	parser.parse_complete();
     }
     catch (std::runtime_error &x)
     {
@@ -254,11 +244,172 @@ void FunctionCaller<KmerDb>::process_fasta_stream(std::istream &istr, HitCB &hit
     }
 }
 
+template <class KmerDb>
+template <typename HitCB, typename CallCB>
+void FunctionCaller<KmerDb>::process_fasta_stream(std::istream &istr, HitCB &hit_cb, CallCB &call_cb)
+{
+    process_fasta(istr, hit_cb, call_cb);
+}
 
+template <class KmerDb>
+template <typename HitCB, typename CallCB>
+void FunctionCaller<KmerDb>::process_fasta_file(const fs::path &file, HitCB &hit_cb, CallCB &call_cb)
+{
+    const KseqFile *cached = seq_cache_ ? seq_cache_->find(file) : nullptr;
+    if (cached)
+	process_fasta(*cached, hit_cb, call_cb);
+    else
+	process_fasta(file, hit_cb, call_cb);
+}
+
+template <class KmerDb>
+template <typename Output, typename PathList, typename SeqCB, typename OutputCB>
+void FunctionCaller<KmerDb>::process_fasta_files_chunked(const PathList &files, SeqCB &seq_cb,
+							 OutputCB &output_cb, size_t chunk_size)
+{
+    struct Piece
+    {
+	std::shared_ptr<FastaChunks> chunks;
+	size_t index;
+	std::shared_ptr<Output> output;
+    };
+
+    auto next_file = files.begin();
+    std::shared_ptr<FastaChunks> cur;
+    size_t next_chunk = 0;
+
+    /*
+     * The input stage hands out the pieces of one file after another;
+     * the mapping of a file is released when its last piece is done.
+     */
+    size_t n_tokens = 2 * tbb::this_task_arena::max_concurrency();
+    tbb::parallel_pipeline(n_tokens,
+			   tbb::make_filter<void, Piece>(TBB_FILTER_MODE::serial_in_order, [&](tbb::flow_control &fc) -> Piece {
+			       while (!cur || next_chunk == cur->size())
+			       {
+				   if (next_file == files.end())
+				   {
+				       fc.stop();
+				       return Piece();
+				   }
+				   cur.reset();
+				   next_chunk = 0;
+				   try {
+				       cur = std::make_shared<FastaChunks>(*next_file, chunk_size, seq_cache_);
+				   }
+				   catch (std::exception &x)
+				   {
+				       std::cerr << "caught " << x.what() << "\n";
+				   }
+				   ++next_file;
+			       }
+			       return Piece { cur, next_chunk++, std::make_shared<Output>() };
+			   }) &
+			   tbb::make_filter<Piece, Piece>(TBB_FILTER_MODE::parallel, [&seq_cb](Piece piece) -> Piece {
+			       Output &out = *piece.output;
+			       try {
+				   FastaParser parser;
+				   piece.chunks->parse(parser, piece.index, [&seq_cb, &out](std::string_view id, std::string_view def, std::string_view seq) {
+				       if (!id.empty())
+					   seq_cb(out, id, seq);
+				   });
+			       }
+			       catch (std::runtime_error &x)
+			       {
+				   std::cerr<< "caught " << x.what() << "\n";
+			       }
+			       piece.chunks.reset();
+			       return piece;
+			   }) &
+			   tbb::make_filter<Piece, void>(TBB_FILTER_MODE::serial_in_order, [&output_cb](Piece piece) {
+			       output_cb(piece.output);
+			   }));
+}
+
+template <class KmerDb>
+template <typename HitCB, typename CallCB>
+void FunctionCaller<KmerDb>::process_sequence(std::string_view id, std::string_view seq, HitCB &hit_cb, CallCB &call_cb)
+{
+    auto calls = std::make_shared<std::vector<KmerCall>>();
+
+    // std::cerr << "stream " << id << " " << seq << "\n";
+    process_aa_seq(id, seq, calls, hit_cb);
+    FunctionIndex fi;
+    std::string func;
+    float score;
+    float offset;
+    find_best_call(id, *calls, fi, func, score, offset);
+    call_cb(id, func, fi, score, seq.size());
+    // std::cout << id << "\t" << func << "\t" << fi << "\t" << score << "\n";
+}
+
+
+
+template <class KmerDb>
+template <typename HitCB, typename RegionCB>
+void FunctionCaller<KmerDb>::process_contig(std::string_view id, std::string_view seq, HitCB &hit_cb, RegionCB &region_cb)
+{
+    size_t min_len = KmerSize + min_hits_ - 1;
+    size_t seq_len = seq.size();
+
+    for_each_frame_segment(seq, min_len, [this, id, seq_len, &hit_cb, &region_cb](int frame, std::string_view aa, size_t first_codon) {
+	auto calls = std::make_shared<std::vector<KmerCall>>();
+	process_aa_seq(id, aa, calls, hit_cb);
+
+	FunctionIndex fi;
+	std::string func;
+	float score;
+	float offset;
+	find_best_call(id, *calls, fi, func, score, offset);
+	if (fi == UndefinedFunction)
+	    return;
+
+	/*
+	 * The called region spans the hits for the chosen function; a
+	 * fusion has no hits of its own and covers the whole stretch.
+	 */
+	size_t start = aa.size(), end = 0;
+	for (auto &c: *calls)
+	{
+	    if (c.function_index == fi)
+	    {
+		start = std::min<size_t>(start, c.start);
+		end = std::max<size_t>(end, c.end);
+	    }
+	}
+	if (start > end)
+	{
+	    start = 0;
+	    end = aa.size() - 1;
+	}
+
+	size_t left, right;
+	frame_codons_to_bases(frame, seq_len, first_codon + start, first_codon + end, left, right);
+	region_cb(id, left + 1, right + 1, frame < 3 ? '+' : '-', func, fi, score);
+    });
+}
 
 template <class KmerDb>
 template <typename HitCB>
-void FunctionCaller<KmerDb>::process_aa_seq(const std::string &idstr, const std::string &seqstr,
+void FunctionCaller<KmerDb>::tally_read_hits(std::string_view id, std::string_view seq, ReadHits &hits, HitCB &hit_cb)
+{
+    for_each_frame_segment(seq, KmerSize, [this, id, &hits, &hit_cb](int frame, std::string_view aa, size_t first_codon) {
+	double seqlen = static_cast<double>(aa.size());
+	for_each_kmer<KmerSize, KmerAlphabet>(aa, [this, id, seqlen, &hits, &hit_cb](const Kmer<KmerSize, KmerAlphabet> &kmer, size_t offset) {
+	    int ec;
+	    kmer_db_.fetch(kmer, [this, id, seqlen, offset, &kmer, &hits, &hit_cb](const StoredKmerData &kdata) {
+		if (ignore_hypothetical_ && kdata.function_index == hypo_index_)
+		    return;
+		hit_cb(id, kmer, offset, seqlen, kdata);
+		hits.add(kdata.function_index);
+	    }, ec);
+	});
+    });
+}
+
+template <class KmerDb>
+template <typename HitCB>
+void FunctionCaller<KmerDb>::process_aa_seq(std::string_view idstr, std::string_view seqstr,
 					    std::shared_ptr<std::vector<KmerCall>> calls,
 					    HitCB hit_cb)
 {
@@ -266,23 +417,16 @@ void FunctionCaller<KmerDb>::process_aa_seq(const std::string &idstr, const std:
     FunctionIndex current_fI = UndefinedFunction;
     double seqlen = static_cast<double>(seqstr.length());
 
-    auto it = std::find(function_index_.begin(), function_index_.end(), "hypothetical protein");
-    if (it == function_index_.end())
-    {
-	std::cerr << "Cannot find hypothetical protein index\n";
-	exit(1);
-    }
-    std::ptrdiff_t hypo_pos = it - function_index_.begin();
-    for_each_kmer<KmerDb::KmerSize>(seqstr, [this, &idstr, &calls, &hit_cb, &hits, &current_fI, seqlen, hypo_pos]
-				    (const std::array<char, KmerDb::KmerSize> &kmer, size_t offset) {
+    for_each_kmer<KmerDb::KmerSize, typename KmerDb::KmerAlphabet>(seqstr, [this, &idstr, &calls, &hit_cb, &hits, &current_fI, seqlen]
+				    (const Kmer<KmerDb::KmerSize, typename KmerDb::KmerAlphabet> &kmer, size_t offset) {
 	// std::cerr << "process " << kmer << "\n";
 	
 	int ec;
-	kmer_db_.fetch(kmer, [this, hit_cb, offset, &idstr, &hits, &calls, &current_fI, &kmer, seqlen, hypo_pos]
+	kmer_db_.fetch(kmer, [this, hit_cb, offset, &idstr, &hits, &calls, &current_fI, &kmer, seqlen]
 		      (const StoredKmerData &kdata) {
 
 
-	    if (ignore_hypothetical_ && kdata.function_index == hypo_pos)
+	    if (ignore_hypothetical_ && kdata.function_index == hypo_index_)
 	    {
 		// std::cerr << "Skipping hypo " << kmer << "\t" << offset << "\t" << kdata.function_index << "\n";
 		return;
@@ -345,7 +489,7 @@ void FunctionCaller<KmerDb>::process_aa_seq(const std::string &idstr, const std:
  * km_process_hits_to_regions | km_pick_best_hit_in_peg
  */
 template <class KmerDb>
-void FunctionCaller<KmerDb>::find_best_call(const std::string &id, std::vector<KmerCall> &calls, FunctionIndex &function_index, std::string &function, float &score, float &score_offset)
+void FunctionCaller<KmerDb>::find_best_call(std::string_view id, std::vector<KmerCall> &calls, FunctionIndex &function_index, std::string &function, float &score, float &score_offset)
 {
     function_index = UndefinedFunction;
     function = "";
@@ -24,14 +24,15 @@
 namespace fs = boost::filesystem;
 namespace ip = boost::interprocess;
 
-template <typename StoredData, int K>
+template <typename StoredData, int K, typename Alphabet = ProteinAlphabet>
 class CmphKmerDb
 {
 public:
     static constexpr int kmer_size = K;
     static constexpr int KmerSize = K;
+    using KmerAlphabet = Alphabet;
     using KData = StoredData;
-    using key_type = Kmer<K>;
+    using key_type = Kmer<K, Alphabet>;
 
     CmphKmerDb(const fs::path &file_base)
 	: file_base_(file_base)
@@ -83,12 +84,11 @@ public:
     }
 
     unsigned int lookup_key(const std::string &key) {
-	unsigned int id = cmph_search(hash_, key.c_str(), key.length());
-	return id;
+	return lookup_key(convert_key(key));
     }
 
-    unsigned int lookup_key(const Kmer<K> key) {
-	unsigned int id = cmph_search(hash_, key.data(), K);
+    unsigned int lookup_key(const key_type &key) {
+	unsigned int id = cmph_search(hash_, key.data(), key.size());
 	return id;
     }
 
@@ -116,7 +116,8 @@ public:
 	key_type ka;
 	if (key.length() != kmer_size)
 	    throw std::runtime_error("Invalid kmer size");
-	std::copy(key.begin(), key.end(), ka.data());
+	if (!encode_kmer(key.data(), ka))
+	    throw std::runtime_error("Invalid kmer " + key);
 	return ka;
     }	
 
@@ -0,0 +1,440 @@
+#include "compressed_input.h"
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "tbb_pipeline.h"
+#include <tbb/task_arena.h>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <system_error>
+#include <errno.h>
+
+namespace ip = boost::interprocess;
+
+static const auto SerialInOrder = TBB_FILTER_MODE::serial_in_order;
+static const auto Parallel = TBB_FILTER_MODE::parallel;
+
+Compression detect_compression(const fs::path &file)
+{
+    unsigned char magic[16] = { 0 };
+    std::ifstream ifstr(file.native(), std::ios::binary);
+    ifstr.read(reinterpret_cast<char *>(magic), sizeof(magic));
+    size_t n = ifstr.gcount();
+
+    if (n >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+	return Compression::Zstd;
+
+    if (n >= 3 && magic[0] == 0x1f && magic[1] == 0x8b && magic[2] == 8)
+    {
+	/*
+	 * bgzf is gzip with an extra field whose first subfield is 'BC'
+	 * holding the compressed block size.
+	 */
+	if (n >= 16 && (magic[3] & 4) && magic[12] == 'B' && magic[13] == 'C' && magic[14] == 2 && magic[15] == 0)
+	    return Compression::Bgzf;
+	return Compression::Gzip;
+    }
+    return Compression::None;
+}
+
+const char *compression_name(Compression c)
+{
+    switch (c)
+    {
+    case Compression::None:
+	return "none";
+    case Compression::Gzip:
+	return "gzip";
+    case Compression::Bgzf:
+	return "bgzf";
+    case Compression::Zstd:
+	return "zstd";
+    }
+    return "unknown";
+}
+
+fs::path strip_compression_extension(const fs::path &file)
+{
+    std::string ext = file.extension().string();
+    if (ext == ".gz" || ext == ".bgz" || ext == ".zst")
+	return file.parent_path() / file.stem();
+    return file;
+}
+
+DecompressingReader::DecompressingReader(const fs::path &file, Compression compression)
+    : file_(file)
+    , compression_(compression)
+    , cur_pos_(0)
+    , done_(false)
+{
+    queue_.set_capacity(QueueCapacity);
+    thread_ = std::thread([this]() { run(); });
+}
+
+DecompressingReader::~DecompressingReader()
+{
+    /*
+     * If the reader is abandoned before the end of the data, the
+     * decompression thread may be blocked on a full queue; abort()
+     * wakes it with an exception.
+     */
+    queue_.abort();
+    thread_.join();
+}
+
+void DecompressingReader::run()
+{
+    try {
+	switch (compression_)
+	{
+	case Compression::Gzip:
+	    inflate_gzip();
+	    break;
+
+	case Compression::Bgzf:
+	    inflate_bgzf();
+	    break;
+
+	case Compression::Zstd:
+#ifdef HAVE_ZSTD
+	    decompress_zstd();
+	    break;
+#else
+	    throw std::runtime_error(file_.string() + ": zstd input is not supported in this build");
+#endif
+
+	case Compression::None:
+	    throw std::runtime_error(file_.string() + ": not compressed");
+	}
+    }
+    catch (tbb::user_abort &)
+    {
+	return;
+    }
+    catch (...)
+    {
+	error_ = std::current_exception();
+    }
+
+    try {
+	push(Chunk());
+    }
+    catch (tbb::user_abort &)
+    {
+    }
+}
+
+size_t DecompressingReader::read(char *buf, size_t n)
+{
+    size_t copied = 0;
+    while (copied < n && !done_)
+    {
+	if (!cur_ || cur_pos_ == cur_->size())
+	{
+	    queue_.pop(cur_);
+	    cur_pos_ = 0;
+	    if (!cur_)
+	    {
+		done_ = true;
+		if (error_)
+		    std::rethrow_exception(error_);
+		break;
+	    }
+	}
+	size_t k = std::min(n - copied, cur_->size() - cur_pos_);
+	std::memcpy(buf + copied, cur_->data() + cur_pos_, k);
+	cur_pos_ += k;
+	copied += k;
+    }
+    return copied;
+}
+
+/*!
+  Inflate a (possibly multi-member) gzip file sequentially.
+ */
+void DecompressingReader::inflate_gzip()
+{
+    std::ifstream ifstr(file_.native(), std::ios::binary);
+    if (!ifstr)
+	throw std::system_error(errno, std::generic_category(), file_.native());
+
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 32) != Z_OK)
+	throw std::runtime_error("inflateInit2 failed");
+    std::unique_ptr<z_stream, int (*)(z_streamp)> guard(&zs, inflateEnd);
+
+    std::vector<char> inbuf(ChunkSize);
+    Chunk out;
+    auto new_chunk = [&out, &zs]() {
+	out = std::make_shared<std::vector<char>>(ChunkSize);
+	zs.next_out = reinterpret_cast<Bytef *>(out->data());
+	zs.avail_out = static_cast<uInt>(out->size());
+    };
+    new_chunk();
+
+    bool member_complete = false;
+    for (;;)
+    {
+	if (zs.avail_in == 0)
+	{
+	    ifstr.read(inbuf.data(), inbuf.size());
+	    zs.next_in = reinterpret_cast<Bytef *>(inbuf.data());
+	    zs.avail_in = static_cast<uInt>(ifstr.gcount());
+	    if (zs.avail_in == 0)
+		break;
+	}
+	if (member_complete)
+	{
+	    inflateReset(&zs);
+	    member_complete = false;
+	}
+	int rc = inflate(&zs, Z_NO_FLUSH);
+	if (rc == Z_STREAM_END)
+	    member_complete = true;
+	else if (rc != Z_OK && rc != Z_BUF_ERROR)
+	    throw std::runtime_error(file_.string() + ": gzip data error: " + (zs.msg ? zs.msg : "unknown"));
+
+	if (zs.avail_out == 0)
+	{
+	    push(out);
+	    new_chunk();
+	}
+    }
+    if (!member_complete)
+	throw std::runtime_error(file_.string() + ": truncated gzip data");
+
+    out->resize(out->size() - zs.avail_out);
+    if (!out->empty())
+	push(out);
+}
+
+/*!
+  Inflate a single complete gzip member into exactly dst_len bytes.
+ */
+static void inflate_member(const unsigned char *src, size_t src_len, char *dst, size_t dst_len,
+			   const fs::path &file)
+{
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 16) != Z_OK)
+	throw std::runtime_error("inflateInit2 failed");
+    zs.next_in = const_cast<Bytef *>(src);
+    zs.avail_in = static_cast<uInt>(src_len);
+    zs.next_out = reinterpret_cast<Bytef *>(dst);
+    zs.avail_out = static_cast<uInt>(dst_len);
+    int rc = inflate(&zs, Z_FINISH);
+    bool ok = rc == Z_STREAM_END && zs.avail_out == 0;
+    inflateEnd(&zs);
+    if (!ok)
+	throw std::runtime_error(file.string() + ": bgzf block data error");
+}
+
+/*!
+  Inflate a bgzf file. Blocks are grouped into batches of about
+  ChunkSize uncompressed bytes; batches are inflated in parallel
+  and queued in file order.
+ */
+void DecompressingReader::inflate_bgzf()
+{
+    size_t len = fs::file_size(file_);
+    ip::file_mapping mapping(file_.native().c_str(), ip::read_only);
+    ip::mapped_region region(mapping, ip::read_only);
+    const unsigned char *data = static_cast<const unsigned char *>(region.get_address());
+
+    struct Block
+    {
+	size_t offset;
+	size_t size;
+	size_t isize;
+    };
+    struct Batch
+    {
+	std::vector<Block> blocks;
+	size_t out_size = 0;
+    };
+    using BatchPtr = std::shared_ptr<Batch>;
+
+    auto u16 = [](const unsigned char *p) -> size_t { return p[0] | (p[1] << 8); };
+    auto u32 = [](const unsigned char *p) -> size_t {
+	return size_t(p[0]) | (size_t(p[1]) << 8) | (size_t(p[2]) << 16) | (size_t(p[3]) << 24);
+    };
+
+    size_t pos = 0;
+    auto next_block = [&]() -> Block {
+	const unsigned char *p = data + pos;
+	if (len - pos < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || !(p[3] & 4))
+	    throw std::runtime_error(file_.string() + ": invalid bgzf block header");
+	size_t xend = 12 + u16(p + 10);
+	if (xend > len - pos)
+	    throw std::runtime_error(file_.string() + ": truncated bgzf block");
+	size_t bsize = 0;
+	for (size_t x = 12; x + 4 <= xend; x += 4 + u16(p + x + 2))
+	{
+	    if (p[x] == 'B' && p[x + 1] == 'C' && u16(p + x + 2) == 2)
+	    {
+		bsize = u16(p + x + 4) + 1;
+		break;
+	    }
+	}
+	if (bsize == 0 || bsize > len - pos)
+	    throw std::runtime_error(file_.string() + ": invalid bgzf block size");
+	Block b { pos, bsize, u32(p + bsize - 4) };
+	pos += bsize;
+	return b;
+    };
+
+    size_t n_tokens = 2 * tbb::this_task_arena::max_concurrency();
+    tbb::parallel_pipeline(n_tokens,
+			   tbb::make_filter<void, BatchPtr>(SerialInOrder, [&](tbb::flow_control &fc) -> BatchPtr {
+			       if (pos >= len)
+			       {
+				   fc.stop();
+				   return BatchPtr();
+			       }
+			       auto batch = std::make_shared<Batch>();
+			       while (pos < len && batch->out_size < ChunkSize)
+			       {
+				   batch->blocks.push_back(next_block());
+				   batch->out_size += batch->blocks.back().isize;
+			       }
+			       return batch;
+			   }) &
+			   tbb::make_filter<BatchPtr, Chunk>(Parallel, [this, data](BatchPtr batch) -> Chunk {
+			       auto out = std::make_shared<std::vector<char>>(batch->out_size);
+			       size_t o = 0;
+			       for (auto &b: batch->blocks)
+			       {
+				   if (b.isize > 0)
+				       inflate_member(data + b.offset, b.size, out->data() + o, b.isize, file_);
+				   o += b.isize;
+			       }
+			       return out;
+			   }) &
+			   tbb::make_filter<Chunk, void>(SerialInOrder, [this](Chunk chunk) {
+			       if (!chunk->empty())
+				   push(chunk);
+			   }));
+}
+
+#ifdef HAVE_ZSTD
+
+/*!
+  Decompress a zstd file. If it holds several frames that each record
+  their decompressed size (as written by pzstd or zstd -T with
+  --content-size), batches of frames are decompressed in parallel;
+  otherwise the file is decompressed as a stream by this thread.
+ */
+void DecompressingReader::decompress_zstd()
+{
+    const unsigned long long MaxFrameSize = 256 << 20;
+
+    size_t len = fs::file_size(file_);
+    ip::file_mapping mapping(file_.native().c_str(), ip::read_only);
+    ip::mapped_region region(mapping, ip::read_only);
+    const char *data = static_cast<const char *>(region.get_address());
+
+    struct Frame
+    {
+	size_t offset;
+	size_t size;
+	size_t content_size;
+    };
+    std::vector<Frame> frames;
+    bool sized = true;
+    for (size_t pos = 0; pos < len; )
+    {
+	size_t fsize = ZSTD_findFrameCompressedSize(data + pos, len - pos);
+	if (ZSTD_isError(fsize))
+	    throw std::runtime_error(file_.string() + ": zstd error: " + ZSTD_getErrorName(fsize));
+	unsigned long long csize = ZSTD_getFrameContentSize(data + pos, fsize);
+	if (csize == ZSTD_CONTENTSIZE_UNKNOWN || csize == ZSTD_CONTENTSIZE_ERROR || csize > MaxFrameSize)
+	    sized = false;
+	frames.push_back(Frame { pos, fsize, static_cast<size_t>(csize) });
+	pos += fsize;
+    }
+
+    if (sized && frames.size() > 1)
+    {
+	struct Batch
+	{
+	    size_t offset;
+	    size_t size = 0;
+	    size_t out_size = 0;
+	};
+	using BatchPtr = std::shared_ptr<Batch>;
+
+	size_t next = 0;
+	size_t n_tokens = 2 * tbb::this_task_arena::max_concurrency();
+	tbb::parallel_pipeline(n_tokens,
+			       tbb::make_filter<void, BatchPtr>(SerialInOrder, [&](tbb::flow_control &fc) -> BatchPtr {
+				   if (next >= frames.size())
+				   {
+				       fc.stop();
+				       return BatchPtr();
+				   }
+				   auto batch = std::make_shared<Batch>();
+				   batch->offset = frames[next].offset;
+				   while (next < frames.size() && batch->out_size < ChunkSize)
+				   {
+				       batch->size += frames[next].size;
+				       batch->out_size += frames[next].content_size;
+				       next++;
+				   }
+				   return batch;
+			       }) &
+			       tbb::make_filter<BatchPtr, Chunk>(Parallel, [this, data](BatchPtr batch) -> Chunk {
+				   auto out = std::make_shared<std::vector<char>>(batch->out_size);
+				   size_t n = ZSTD_decompress(out->data(), out->size(), data + batch->offset, batch->size);
+				   if (ZSTD_isError(n) || n != batch->out_size)
+				       throw std::runtime_error(file_.string() + ": zstd frame data error");
+				   return out;
+			       }) &
+			       tbb::make_filter<Chunk, void>(SerialInOrder, [this](Chunk chunk) {
+				   if (!chunk->empty())
+				       push(chunk);
+			       }));
+	return;
+    }
+
+    std::unique_ptr<ZSTD_DStream, size_t (*)(ZSTD_DStream *)> ds(ZSTD_createDStream(), ZSTD_freeDStream);
+    ZSTD_initDStream(ds.get());
+    ZSTD_inBuffer in { data, len, 0 };
+
+    /* Return value of the last call that made progress; 0 when a frame is complete. */
+    size_t last = 0;
+    for (;;)
+    {
+	auto out = std::make_shared<std::vector<char>>(ChunkSize);
+	ZSTD_outBuffer ob { out->data(), out->size(), 0 };
+	while (ob.pos < ob.size)
+	{
+	    size_t in_pos = in.pos, out_pos = ob.pos;
+	    size_t rc = ZSTD_decompressStream(ds.get(), &ob, &in);
+	    if (ZSTD_isError(rc))
+		throw std::runtime_error(file_.string() + ": zstd error: " + ZSTD_getErrorName(rc));
+	    if (in.pos == in_pos && ob.pos == out_pos)
+		break;
+	    last = rc;
+	}
+	out->resize(ob.pos);
+	if (!out->empty())
+	    push(out);
+	if (ob.pos < ob.size)
+	{
+	    if (last != 0)
+		throw std::runtime_error(file_.string() + ": truncated zstd data");
+	    break;
+	}
+    }
+}
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef _compressed_input_h
+#define _compressed_input_h
+
+/*!
+  @file compressed_input.h
+  @brief Transparent decompression of input files.
+
+  Input files may be gzip, bgzf (blocked gzip as written by bgzip) or
+  zstd compressed; the format is detected from the leading magic bytes,
+  not the file name. zstd support requires building with HAVE_ZSTD.
+
+  DecompressingReader runs the decompression in a background thread and
+  hands decompressed data to the reader through a bounded queue of
+  buffers. Plain gzip is inherently sequential and is inflated by that
+  thread alone. bgzf blocks and multi-frame zstd files consist of
+  independently compressed pieces; these are decompressed in parallel
+  with a tbb::parallel_pipeline whose final in-order stage queues the
+  output, so data is delivered in file order.
+*/
+
+#include <boost/filesystem.hpp>
+#include <tbb/concurrent_queue.h>
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = boost::filesystem;
+
+enum class Compression
+{
+    None,
+    Gzip,
+    Bgzf,
+    Zstd
+};
+
+/*! Determine the compression of file from its magic bytes. */
+Compression detect_compression(const fs::path &file);
+
+const char *compression_name(Compression c);
+
+/*! Remove a .gz, .bgz or .zst suffix from the file name. */
+fs::path strip_compression_extension(const fs::path &file);
+
+class DecompressingReader
+{
+public:
+    DecompressingReader(const fs::path &file, Compression compression);
+    ~DecompressingReader();
+
+    DecompressingReader(const DecompressingReader &) = delete;
+    DecompressingReader &operator=(const DecompressingReader &) = delete;
+
+    /*! Copy up to n bytes of decompressed data to buf.
+
+      @return the number of bytes copied; 0 at the end of the data.
+      A decompression error is rethrown here as std::runtime_error.
+    */
+    size_t read(char *buf, size_t n);
+
+    static constexpr size_t ChunkSize = 1 << 20;
+    static const int QueueCapacity = 8;
+
+private:
+    using Chunk = std::shared_ptr<std::vector<char>>;
+
+    fs::path file_;
+    Compression compression_;
+
+    /* An empty Chunk marks the end of the data. */
+    tbb::concurrent_bounded_queue<Chunk> queue_;
+    std::thread thread_;
+    std::exception_ptr error_;
+
+    Chunk cur_;
+    size_t cur_pos_;
+    bool done_;
+
+    void run();
+    void push(Chunk chunk) { queue_.push(chunk); }
+
+    void inflate_gzip();
+    void inflate_bgzf();
+#ifdef HAVE_ZSTD
+    void decompress_zstd();
+#endif
+};
+
+#endif // _compressed_input_h
@@ -0,0 +1,195 @@
+#ifndef _direct_kmer_db_h
+#define _direct_kmer_db_h
+
+/**
+ * Kmer database using a dense on-disk mapped array indexed directly by kmer.
+ *
+ * When the kmer key space (alphabet size ^ K) is small - short kmers, or a
+ * reduced alphabet - every possible kmer gets a slot in <base>.direct at
+ * Kmer::dense_index(), so a lookup is a single load from the mapped file with
+ * no hash evaluation. The file is created sparse and the slots of kmers that
+ * are not signatures stay zero. A kept kmer never stores an all-zero value
+ * (its mean protein length is at least K), so a zero slot marks a miss.
+ *
+ * Presents the same interface as CmphKmerDb.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <boost/filesystem.hpp>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <errno.h>
+#include <sys/mman.h>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "kmer_data.h"
+#include "cmph_kmer.h"
+#include "frozen_kmer_db.h"
+
+namespace fs = boost::filesystem;
+namespace ip = boost::interprocess;
+
+template <typename StoredData, int K, typename Alphabet = ProteinAlphabet>
+class DirectKmerDb
+{
+public:
+    static constexpr int kmer_size = K;
+    static constexpr int KmerSize = K;
+    using KmerAlphabet = Alphabet;
+    using KData = StoredData;
+    using key_type = Kmer<K, Alphabet>;
+
+    /*! Largest key space we will lay out as a table. */
+    static constexpr uint64_t max_entries = uint64_t(1) << 28;
+    static constexpr uint64_t n_entries = key_type::dense_size();
+
+    static constexpr bool supported() {
+	return n_entries <= max_entries;
+    }
+
+    static fs::path data_path(const fs::path &file_base) {
+	return fs::path(file_base.native() + ".direct");
+    }
+
+    DirectKmerDb(const fs::path &file_base)
+	: file_base_(file_base)
+	, dat_path_(data_path(file_base))
+	, data_(0)
+	{
+	    if (!supported())
+		throw std::runtime_error("Kmer key space of " + std::to_string(n_entries) +
+					 " entries is too large for a direct table");
+	}
+
+    void open() {
+	map_backing_data(false);
+    }
+
+    void open_for_writing() {
+	map_backing_data(true);
+    }
+
+    size_t data_size() const {
+	return n_entries * sizeof(StoredData);
+    }
+
+    /*! Create the (sparse, zero-filled) backing data store for the whole key space.
+     */
+    void create_backing_data() {
+	std::filebuf fbuf;
+	if (!fbuf.open(dat_path_.native(), std::ios_base::in | std::ios_base::out
+		       | std::ios_base::trunc | std::ios_base::binary))
+	{
+	    throw std::system_error(errno, std::generic_category(), dat_path_.native());
+	}
+	fbuf.pubseekoff(data_size() - 1, std::ios_base::beg);
+	fbuf.sputc(0);
+    }
+
+    void map_backing_data(bool writable) {
+	if (fs::file_size(dat_path_) != data_size())
+	{
+	    throw std::runtime_error("Direct table " + dat_path_.string() +
+				     " does not match the kmer size and alphabet of the database");
+	}
+
+	auto write_flag = writable ? ip::read_write : ip::read_only;
+	mapping_ = ip::file_mapping(dat_path_.native().c_str(), write_flag);
+	mapped_region_ = ip::mapped_region(mapping_, write_flag);
+	data_ = (StoredData *) mapped_region_.get_address();
+
+	if (madvise(data_, data_size(), MADV_WILLNEED) != 0)
+	{
+	    std::cerr << "madvise failed: " << strerror(errno) << "\n";
+	}
+    }
+
+    bool exists() {
+	return fs::exists(dat_path_);
+    }
+
+    key_type convert_key(const std::string &key) {
+	key_type ka;
+	if (key.length() != kmer_size)
+	    throw std::runtime_error("Invalid kmer size");
+	if (!encode_kmer(key.data(), ka))
+	    throw std::runtime_error("Invalid kmer " + key);
+	return ka;
+    }
+
+    void insert(const std::string &key, const KData &kdata) {
+	int ec;
+	insert(convert_key(key), kdata, ec);
+    }
+    void insert(const key_type &key, const KData &kdata, int &ec) {
+	data_[key.dense_index()] = kdata;
+	ec = 0;
+    }
+
+    template <typename CB>
+    void fetch(const key_type &key, CB cb, int &iec) {
+	const StoredData &d = data_[key.dense_index()];
+	if (is_empty(d))
+	{
+	    iec = 1;
+	    return;
+	}
+	iec = 0;
+	cb(d);
+    }
+    template <typename CB>
+    void fetch(const std::string &key, CB cb, int &iec) {
+	fetch(convert_key(key), cb, iec);
+    }
+
+private:
+    static bool is_empty(const StoredData &d) {
+	static const char zero[sizeof(StoredData)] = {};
+	return std::memcmp(&d, zero, sizeof(StoredData)) == 0;
+    }
+
+    fs::path file_base_;
+    fs::path dat_path_;
+
+    ip::file_mapping mapping_;
+    ip::mapped_region mapped_region_;
+
+    StoredData *data_;
+};
+
+template <typename T>
+struct kmer_db_type
+{
+    using type = T;
+};
+
+/*! @brief Select the database class for the kmer data stored at file_base.
+
+  Invokes f with a kmer_db_type<> naming DirectKmerDb if a direct table was
+  built there, FrozenKmerDb if a frozen table was, and CmphKmerDb otherwise:
+
+      dispatch_kmer_db<StoredKmerData, K, Alphabet>(db_base, [&](auto db) {
+	  run<K, Alphabet, typename decltype(db)::type>(params);
+      });
+*/
+template <typename StoredData, int K, typename Alphabet, typename F>
+auto dispatch_kmer_db(const fs::path &file_base, F &&f)
+{
+    using Direct = DirectKmerDb<StoredData, K, Alphabet>;
+    if constexpr (Direct::supported())
+    {
+	if (fs::exists(Direct::data_path(file_base)))
+	    return f(kmer_db_type<Direct>());
+    }
+    using Frozen = FrozenKmerDb<StoredData, K, Alphabet>;
+    if (fs::exists(Frozen::data_path(file_base)))
+	return f(kmer_db_type<Frozen>());
+    return f(kmer_db_type<CmphKmerDb<StoredData, K, Alphabet>>());
+}
+
+#endif // _direct_kmer_db_h
@@ -1,38 +1,121 @@
 #include "fasta_parser.h"
 #include <cctype>
 
-FastaParser::FastaParser() : line_number(1)
+FastaParser::FastaParser() : line_number_(1), in_record_(false), stop_(false)
 {
-    init_parse();
 }
 
 void FastaParser::init_parse()
 {
-    cur_state_ = s_start;
-    cur_id_ = "";
-    cur_def_ = "";
-    cur_seq_ = "";
+    line_number_ = 1;
+    in_record_ = false;
+    stop_ = false;
+    cur_id_.clear();
+    cur_def_.clear();
+    cur_seq_.clear();
 }
 
-void FastaParser::parse(std::istream &stream)
+void FastaParser::report_error(const std::string &err)
 {
-    char c;
-    init_parse();
-    while (stream.get(c))
+    std::cerr << "Error found: " << err << " at line " << line_number_ << " id='" << cur_id_ << "'" << std::endl;
+    if (on_error_ && !on_error_(err, line_number_, cur_id_))
+	stop_ = true;
+}
+
+/*!
+  Append a sequence line to the current sequence, reporting and skipping
+  any character that is not a residue.
+*/
+void FastaParser::append_checked(const char *p, const char *end)
+{
+    if (valid_seq_line(p, end))
+    {
+	cur_seq_.append(p, end);
+	return;
+    }
+    for (; p < end && !stop_; p++)
     {
-	bool ok = parse_char(c);
-	if (!ok)
-	    break;
+	char c = *p;
+	if (isalpha(c) || c == '*')
+	    cur_seq_.push_back(c);
+	else if (c != '\r')
+	{
+	    std::string err = "Bad data character '";
+	    err += c;
+	    err += "'";
+	    report_error(err);
+	}
     }
-    parse_complete();
 }
 
-void FastaParser::parse_complete()
+FastaChunks::FastaChunks(const boost::filesystem::path &file, size_t chunk_size, const KseqCache *cache)
+    : file_(file)
+    , split_(false)
+    , data_(0)
+    , cached_(cache ? cache->find(file) : nullptr)
 {
-    call_callback();
-    cur_id_ = "";
-    cur_def_ = "";
-    cur_seq_ = "";
-}
+    namespace ip = boost::interprocess;
+
+    if (chunk_size == 0)
+	chunk_size = DefaultChunkSize;
+
+    /*
+     * A cached file is split into ranges of records holding about
+     * chunk_size residues.
+     */
+    if (cached_)
+    {
+	split_ = true;
+	size_t start = 0, residues = 0;
+	for (size_t i = 0; i < cached_->n_records; i++)
+	{
+	    residues += cached_->records[i].seq_len;
+	    if (residues >= chunk_size || i + 1 == cached_->n_records)
+	    {
+		ranges_.emplace_back(start, i + 1 - start);
+		start = i + 1;
+		residues = 0;
+	    }
+	}
+	return;
+    }
+
+    if (!boost::filesystem::is_regular_file(file) || detect_compression(file) != Compression::None)
+	return;
+
+    split_ = true;
+    size_t len = boost::filesystem::file_size(file);
+    if (len == 0)
+	return;
 
-	
+    mapping_ = ip::file_mapping(file.native().c_str(), ip::read_only);
+    region_ = ip::mapped_region(mapping_, ip::read_only);
+    region_.advise(ip::mapped_region::advice_sequential);
+    data_ = static_cast<const char *>(region_.get_address());
+
+    /*
+     * Each range ends just after the first newline at or past the target
+     * size that is followed by a '>'.
+     */
+    const char *stop = data_ + len;
+    size_t start = 0;
+    while (start < len)
+    {
+	size_t end = len;
+	if (len - start > chunk_size)
+	{
+	    const char *p = data_ + start + chunk_size - 1;
+	    while (const char *nl = static_cast<const char *>(std::memchr(p, '\n', stop - p)))
+	    {
+		if (nl + 1 < stop && nl[1] == '>')
+		{
+		    end = nl + 1 - data_;
+		    break;
+		}
+		p = nl + 1;
+	    }
+	}
+	ranges_.emplace_back(start, end - start);
+	start = end;
+    }
+}
@@ -1,168 +1,150 @@
 #ifndef _fasta_parser_h
 #define _fasta_parser_h
 
-#include <sstream>
+/*!
+  @file fasta_parser.h
+  @brief Block-buffered FASTA parser.
+
+  The parser works on large buffers - a whole memory-mapped file, or
+  blocks read from a stream - rather than a character at a time. Line
+  ends are located with memchr(); sequence lines are validated with a
+  loop the compiler can vectorize and appended to a sequence buffer
+  that is reused (and keeps its capacity) from record to record.
+
+  Each record is handed to a template callback as
+
+      cb(std::string_view id, std::string_view def, std::string_view seq)
+
+  The views are only valid for the duration of the callback. The id is
+  the text following '>' up to the first blank; the definition is the
+  remainder of the header line including its leading blank. When a
+  record's sequence is a single line of a mapped file it is passed
+  directly from the mapped data without copying.
+*/
+
 #include <iostream>
 #include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstring>
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "compressed_input.h"
+#include "kseq_cache.h"
 
 class FastaParser
 {
 public:
 
-    enum state {
-	s_start = 0,
-	s_id,
-	s_defline,
-	s_data,
-	s_id_or_data,
-    };
-
     FastaParser();
 
-    void set_callback(std::function<void(const std::string &id, const std::string &seq)> on_seq) {
-	on_seq_ = on_seq;
-    }
-    
-    void set_def_callback(std::function<void(const std::string &id, const std::string &def, const std::string &seq)> on_seq) {
-	on_def_seq_ = on_seq;
-    }
-
     void set_error_callback(std::function<bool(const std::string &err, int line, const std::string id)> cb)
     {
 	on_error_ = cb;
     }
 
-    void parse(std::istream &stream);
-    void init_parse();
-    // return true to continue parsing
-    inline bool parse_char(char c)
-    {
-	/*
-	  std::cout << "top " << c << " " << (0+cur_state_) << std::endl;
-	  std::cout << cur_id_ << "\n";
-	  std::cout << cur_seq_ << "\n";
-	*/
-	if (c == '\n')
-	    line_number++;
-	if (c == '\r')
-	    return true;
-	
-	std::string err;
-	switch (cur_state_)
-	{
-	case s_start:
-	    if (c != '>')
-	    {
-		err = "Missing >";
-	    }
-	    else
-	    {
-		cur_state_ = s_id;
-	    }
-	    break;
-	    
-	case s_id:
-	    if (isblank(c))
-	    {
-		cur_def_.push_back(c);
-		cur_state_ = s_defline;
-	    }
-	    else if (c == '\n')
-	    {
-		cur_state_ = s_data;
-	    }
-	    else
-	    {
-		cur_id_.push_back(c);
-	    }
-	    break;
-
-	case s_defline:
-	    if (c == '\n')
-	    {
-		cur_state_ = s_data;
-	    }
-	    else
-	    {
-		cur_def_.push_back(c);
-	    }
-	    break;
-
-	case s_data:
-	    if (c == '\n')
-	    {
-		cur_state_ = s_id_or_data;
-
-	    }
-	    else if (isalpha(c) || c == '*')
-	    {
-		cur_seq_.push_back(c);
-	    }
-	    else
-	    {
-		err = "Bad data character '";
-		err += c;
-		err += "'"; 
-	    }
-	    break;
-
-	case s_id_or_data:
-	    if (c == '>')
-	    {
-		call_callback();
-		cur_id_ = "";
-		cur_def_ = "";
-		cur_seq_ = "";
-		cur_state_ = s_id;
-	    }
-	    else if (c == '\n')
-	    {
-		// No change. cur_state_ = s_id_or_data;
-	    }
-	    else if (isalpha(c))
-	    {
-		cur_seq_.push_back(c);
-		cur_state_ = s_data;
-	    }
-	    else
-	    {
-		err = "Bad id or data character '";
-		err += c;
-		err += "'";
-	    }
-	    break;
-	}
-	if (!err.empty())
-	{
-	    std::cerr << "Error found: " << err << " at line " << line_number << " id='" << cur_id_ << "'" << std::endl;
-	    if (on_error_)
-	    {
-		return on_error_(err, line_number, cur_id_);
-	    }
-	}
-	return true;
-    }
+    /*! Parse fasta data from a stream, reading it in large blocks. */
+    template <typename CB>
+    void parse(std::istream &stream, CB &&cb);
+
+    /*! Parse a fasta file, mapping it into memory, or decompressing it if it is compressed. */
+    template <typename CB>
+    void parse(const boost::filesystem::path &file, CB &&cb);
+
+    /*! Parse a buffer holding complete fasta data. */
+    template <typename CB>
+    void parse(const char *data, size_t len, CB &&cb);
+
+    /*! Replay the records of a file held in a sequence cache. */
+    template <typename CB>
+    void parse(const KseqFile &file, CB &&cb);
+
+    /*! Parse a fasta file, replaying it from cache if the cache holds it. */
+    template <typename CB>
+    void parse(const boost::filesystem::path &file, const KseqCache *cache, CB &&cb);
 
-    void parse_complete();
+    static constexpr size_t BlockSize = 1 << 20;
 
 private:
-    int line_number;
-    state cur_state_;
+    int line_number_;
+    bool in_record_;
+    bool stop_;
     std::string cur_id_;
-    std::string cur_seq_;
     std::string cur_def_;
-    
-    std::function<void(const std::string &id, const std::string &seq)> on_seq_;
-    std::function<void(const std::string &id, const std::string &def, const std::string &seq)> on_def_seq_;
+    std::string cur_seq_;
+    std::vector<char> block_;
+
     std::function<bool(const std::string &err, int line, const std::string id)> on_error_;
-    void call_callback()
-    {
-	if (on_seq_)
-	    on_seq_(cur_id_, cur_seq_);
-	if (on_def_seq_)
-	    on_def_seq_(cur_id_, cur_def_, cur_seq_);
+
+    void init_parse();
+    void report_error(const std::string &err);
+    void append_checked(const char *p, const char *end);
+
+    /*! True if [p, end) holds only residue characters (letters and '*'). */
+    static bool valid_seq_line(const char *p, const char *end) {
+	unsigned char bad = 0;
+	for (; p < end; p++)
+	{
+	    unsigned char c = static_cast<unsigned char>(*p);
+	    unsigned char letter = static_cast<unsigned char>((c | 0x20) - 'a') < 26;
+	    bad |= !(letter | (c == '*'));
+	}
+	return bad == 0;
     }
+
+    template <typename Reader, typename CB>
+    void parse_blocks(Reader &&read, CB &cb);
+    template <typename CB>
+    const char *parse_lines(const char *p, const char *end, bool at_eof, CB &cb);
+    template <typename CB>
+    void parse_complete(CB &cb);
+};
+
+/*!
+  @brief A fasta file divided into pieces that can be parsed concurrently.
+
+  A regular uncompressed file is mapped into memory and split into byte
+  ranges of about chunk_size bytes. Each range is extended to the start
+  of the next record, so every range holds whole records and can be
+  parsed on its own. A compressed or non-regular file can't be split and
+  is presented as a single chunk parsed from the path. A file held in
+  the sequence cache is split into ranges of records instead.
+
+  Line numbers in parse errors are relative to the start of the chunk.
+*/
+class FastaChunks
+{
+public:
+    FastaChunks(const boost::filesystem::path &file, size_t chunk_size = DefaultChunkSize,
+		const KseqCache *cache = nullptr);
+
+    FastaChunks(const FastaChunks &) = delete;
+    FastaChunks &operator=(const FastaChunks &) = delete;
+
+    const boost::filesystem::path &file() const { return file_; }
+    size_t size() const { return split_ ? ranges_.size() : 1; }
+
+    /*! Parse chunk i with parser, invoking cb for each record as FastaParser::parse does. */
+    template <typename CB>
+    void parse(FastaParser &parser, size_t i, CB &&cb) const;
+
+    static constexpr size_t DefaultChunkSize = 16 << 20;
+
+private:
+    boost::filesystem::path file_;
+    bool split_;
+    boost::interprocess::file_mapping mapping_;
+    boost::interprocess::mapped_region region_;
+    const char *data_;
+    const KseqFile *cached_;
+    std::vector<std::pair<size_t, size_t>> ranges_;
 };
 
+#include "fasta_parser.tcc"
 
 #endif
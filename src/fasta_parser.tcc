@@ -0,0 +1,183 @@
+
+template <typename CB>
+void FastaParser::parse(std::istream &stream, CB &&cb)
+{
+    parse_blocks([&stream](char *buf, size_t n) {
+	stream.read(buf, n);
+	return static_cast<size_t>(stream.gcount());
+    }, cb);
+}
+
+/*!
+  Parse data delivered in blocks by read(buf, n), which returns the
+  number of bytes it stored and 0 at the end of the data.
+*/
+template <typename Reader, typename CB>
+void FastaParser::parse_blocks(Reader &&read, CB &cb)
+{
+    init_parse();
+    block_.resize(BlockSize);
+
+    size_t carry = 0;
+    while (!stop_)
+    {
+	/*
+	 * A partial line is carried to the front of the block; grow the
+	 * block if a single line fills it.
+	 */
+	if (carry == block_.size())
+	    block_.resize(block_.size() * 2);
+
+	size_t got = read(block_.data() + carry, block_.size() - carry);
+	size_t n = carry + got;
+	bool at_eof = got == 0;
+
+	const char *start = block_.data();
+	const char *rest = parse_lines(start, start + n, at_eof, cb);
+	if (at_eof)
+	    break;
+	carry = start + n - rest;
+	std::memmove(block_.data(), rest, carry);
+    }
+    parse_complete(cb);
+}
+
+template <typename CB>
+void FastaParser::parse(const boost::filesystem::path &file, CB &&cb)
+{
+    namespace ip = boost::interprocess;
+
+    /*
+     * Pipes and other special files can't be mapped; read them as a stream.
+     * Compressed files are decompressed in the background and parsed in blocks.
+     */
+    if (!boost::filesystem::is_regular_file(file))
+    {
+	boost::filesystem::ifstream ifstr(file);
+	parse(ifstr, cb);
+	return;
+    }
+
+    Compression compression = detect_compression(file);
+    if (compression != Compression::None)
+    {
+	DecompressingReader reader(file, compression);
+	parse_blocks([&reader](char *buf, size_t n) { return reader.read(buf, n); }, cb);
+	return;
+    }
+
+    size_t len = boost::filesystem::file_size(file);
+    if (len == 0)
+    {
+	init_parse();
+	return;
+    }
+
+    ip::file_mapping mapping(file.native().c_str(), ip::read_only);
+    ip::mapped_region region(mapping, ip::read_only);
+    region.advise(ip::mapped_region::advice_sequential);
+
+    parse(static_cast<const char *>(region.get_address()), len, cb);
+}
+
+template <typename CB>
+void FastaParser::parse(const char *data, size_t len, CB &&cb)
+{
+    init_parse();
+    parse_lines(data, data + len, true, cb);
+    parse_complete(cb);
+}
+
+/*!
+  Parse the complete lines in [p, end), invoking cb for each record that
+  is finished. If at_eof is false, a trailing partial line is left
+  unconsumed; the return value is the first byte not consumed.
+*/
+template <typename CB>
+const char *FastaParser::parse_lines(const char *p, const char *end, bool at_eof, CB &cb)
+{
+    while (p < end && !stop_)
+    {
+	const char *nl = static_cast<const char *>(std::memchr(p, '\n', end - p));
+	if (nl == 0)
+	{
+	    if (!at_eof)
+		break;
+	    nl = end;
+	}
+	const char *next = nl < end ? nl + 1 : end;
+	const char *eol = nl;
+	if (eol > p && eol[-1] == '\r')
+	    eol--;
+
+	if (*p == '>')
+	{
+	    if (in_record_)
+		cb(std::string_view(cur_id_), std::string_view(cur_def_), std::string_view(cur_seq_));
+
+	    const char *id = p + 1;
+	    const char *def = id;
+	    while (def < eol && *def != ' ' && *def != '\t')
+		def++;
+	    cur_id_.assign(id, def);
+	    cur_def_.assign(def, eol);
+	    cur_seq_.clear();
+	    in_record_ = true;
+	}
+	else if (!in_record_)
+	{
+	    if (eol > p)
+		report_error("Missing >");
+	}
+	else if (cur_seq_.empty() && (next == end ? at_eof : *next == '>') && valid_seq_line(p, eol))
+	{
+	    /*
+	     * The whole sequence is on this line; pass it without copying.
+	     */
+	    cb(std::string_view(cur_id_), std::string_view(cur_def_), std::string_view(p, eol - p));
+	    in_record_ = false;
+	}
+	else
+	{
+	    append_checked(p, eol);
+	}
+	line_number_++;
+	p = next;
+    }
+    return p;
+}
+
+template <typename CB>
+void FastaParser::parse_complete(CB &cb)
+{
+    if (in_record_)
+	cb(std::string_view(cur_id_), std::string_view(cur_def_), std::string_view(cur_seq_));
+    in_record_ = false;
+}
+
+template <typename CB>
+void FastaParser::parse(const KseqFile &file, CB &&cb)
+{
+    file.for_each(0, file.n_records, cb);
+}
+
+template <typename CB>
+void FastaParser::parse(const boost::filesystem::path &file, const KseqCache *cache, CB &&cb)
+{
+    const KseqFile *cached = cache ? cache->find(file) : nullptr;
+    if (cached)
+	parse(*cached, cb);
+    else
+	parse(file, cb);
+}
+
+template <typename CB>
+void FastaChunks::parse(FastaParser &parser, size_t i, CB &&cb) const
+{
+    if (cached_)
+	cached_->for_each(ranges_[i].first, ranges_[i].first + ranges_[i].second, cb);
+    else if (split_)
+	parser.parse(data_ + ranges_[i].first, ranges_[i].second, cb);
+    else
+	parser.parse(file_, cb);
+}
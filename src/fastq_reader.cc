@@ -0,0 +1,99 @@
+#include "fastq_reader.h"
+
+#include <cstring>
+#include <stdexcept>
+
+FastqReader::FastqReader(const fs::path &file)
+    : file_(file)
+    , block_(BlockSize)
+    , pos_(0)
+    , end_(0)
+    , eof_(false)
+    , line_number_(0)
+{
+    Compression compression = fs::is_regular_file(file) ? detect_compression(file) : Compression::None;
+    if (compression != Compression::None)
+    {
+	decompressor_ = std::make_unique<DecompressingReader>(file, compression);
+    }
+    else
+    {
+	stream_.open(file, std::ios::binary);
+	if (!stream_)
+	    throw std::runtime_error("cannot open " + file.string());
+    }
+}
+
+size_t FastqReader::fill(char *buf, size_t n)
+{
+    if (decompressor_)
+	return decompressor_->read(buf, n);
+    stream_.read(buf, n);
+    return static_cast<size_t>(stream_.gcount());
+}
+
+/*!
+  Find the next line in the block, refilling the block as needed.
+  The line is valid until the next call.
+*/
+bool FastqReader::next_line(std::string_view &line)
+{
+    while (true)
+    {
+	const char *p = block_.data() + pos_;
+	const char *nl = static_cast<const char *>(std::memchr(p, '\n', end_ - pos_));
+	if (nl || (eof_ && pos_ < end_))
+	{
+	    const char *eol = nl ? nl : block_.data() + end_;
+	    pos_ = eol - block_.data() + (nl ? 1 : 0);
+	    if (eol > p && eol[-1] == '\r')
+		eol--;
+	    line = std::string_view(p, eol - p);
+	    line_number_++;
+	    return true;
+	}
+	if (eof_)
+	    return false;
+
+	/*
+	 * Move the partial line to the front of the block, growing the
+	 * block if the line fills it.
+	 */
+	size_t carry = end_ - pos_;
+	std::memmove(block_.data(), block_.data() + pos_, carry);
+	pos_ = 0;
+	end_ = carry;
+	if (end_ == block_.size())
+	    block_.resize(block_.size() * 2);
+	size_t got = fill(block_.data() + end_, block_.size() - end_);
+	end_ += got;
+	eof_ = got == 0;
+    }
+}
+
+bool FastqReader::read_batch(FastqBatch &batch, size_t max_reads)
+{
+    batch.clear();
+
+    std::string_view line;
+    while (batch.size() < max_reads && next_line(line))
+    {
+	if (line.empty())
+	    continue;
+	if (line[0] != '@')
+	    throw std::runtime_error(file_.string() + ": expected fastq header at line " + std::to_string(line_number_));
+
+	std::string_view id = line.substr(1, line.find_first_of(" \t") - 1);
+	std::string id_copy(id);
+
+	std::string_view seq;
+	if (!next_line(seq))
+	    throw std::runtime_error(file_.string() + ": truncated fastq record at line " + std::to_string(line_number_));
+	batch.add(id_copy, seq);
+
+	std::string_view plus, qual;
+	if (!next_line(plus) || plus.empty() || plus[0] != '+' || !next_line(qual))
+	    throw std::runtime_error(file_.string() + ": invalid fastq record at line " + std::to_string(line_number_));
+    }
+    return !batch.empty();
+}
@@ -0,0 +1,94 @@
+#ifndef _fastq_reader_h
+#define _fastq_reader_h
+
+/*!
+  @file fastq_reader.h
+  @brief Batched streaming reader for FASTQ files.
+
+  Sequencing read files are far larger than the memory we want to use,
+  so FastqReader streams the file through a fixed size block buffer and
+  hands out reads in batches of a bounded number of records. Compressed
+  input is decompressed in the background (see compressed_input.h).
+
+  Only the read identifier (the header up to the first blank) and the
+  sequence are kept; quality lines are skipped.
+*/
+
+#include "compressed_input.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*! @brief A batch of reads, stored back to back in a single buffer. */
+class FastqBatch
+{
+public:
+    size_t size() const { return reads_.size(); }
+    bool empty() const { return reads_.empty(); }
+
+    std::string_view id(size_t i) const { return std::string_view(data_.data() + reads_[i].id_offset, reads_[i].id_len); }
+    std::string_view seq(size_t i) const { return std::string_view(data_.data() + reads_[i].seq_offset, reads_[i].seq_len); }
+
+    void clear() {
+	data_.clear();
+	reads_.clear();
+    }
+
+    void add(std::string_view id, std::string_view seq) {
+	reads_.push_back(Read { data_.size(), id.size(), data_.size() + id.size(), seq.size() });
+	data_.append(id);
+	data_.append(seq);
+    }
+
+private:
+    struct Read
+    {
+	size_t id_offset;
+	size_t id_len;
+	size_t seq_offset;
+	size_t seq_len;
+    };
+    std::string data_;
+    std::vector<Read> reads_;
+};
+
+class FastqReader
+{
+public:
+    FastqReader(const fs::path &file);
+
+    FastqReader(const FastqReader &) = delete;
+    FastqReader &operator=(const FastqReader &) = delete;
+
+    /*! Replace the contents of batch with up to max_reads reads.
+
+      @return false once the end of the file is reached and no reads were read.
+      A malformed record is reported as std::runtime_error.
+    */
+    bool read_batch(FastqBatch &batch, size_t max_reads);
+
+    const fs::path &file() const { return file_; }
+
+    static constexpr size_t BlockSize = 1 << 20;
+
+private:
+    fs::path file_;
+    std::unique_ptr<DecompressingReader> decompressor_;
+    fs::ifstream stream_;
+
+    std::vector<char> block_;
+    size_t pos_;
+    size_t end_;
+    bool eof_;
+    size_t line_number_;
+
+    size_t fill(char *buf, size_t n);
+    bool next_line(std::string_view &line);
+};
+
+#endif // _fastq_reader_h
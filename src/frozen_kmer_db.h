@@ -0,0 +1,259 @@
+#ifndef _frozen_kmer_db_h
+#define _frozen_kmer_db_h
+
+/**
+ * Read-only kmer database in a compact open-addressed table.
+ *
+ * The kept kmers of a build are collected in a node-based concurrent map
+ * made for concurrent insertion. Once the set of kmers is final it is
+ * frozen into two arrays with a power-of-two number of slots, at most half
+ * of them used: the packed kmer keys, probed linearly from
+ * kmer_hash_mix(key), and the kmer data in the matching slots. A lookup
+ * that misses, as most kmers of a protein do, reads only the key array.
+ * No kmer packs to zero (residue codes start at 1), so a zero key marks an
+ * empty slot.
+ *
+ * Keys are placed in the order of their home slot and then of their value,
+ * so a set of kmers always gives the same table. save() writes the table
+ * to <base>.frozen as a FrozenKmerHeader followed by the keys and the data,
+ * and open() maps it, so the table the build recalls against is the one
+ * the calling tools use. The header names the alphabet, since alphabets
+ * with the same bits per residue pack kmers alike but code residues
+ * differently.
+ *
+ * Presents the same lookup interface as CmphKmerDb.
+ */
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <tbb/parallel_sort.h>
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "kmer_data.h"
+
+namespace fs = boost::filesystem;
+namespace ip = boost::interprocess;
+
+struct FrozenKmerHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t kmer_size;
+    uint32_t bits_per_residue;
+    uint32_t data_size;
+    uint32_t pad;
+    uint64_t n_slots;
+    uint64_t n_keys;
+    char alphabet[16];
+};
+
+template <typename StoredData, int K, typename Alphabet = ProteinAlphabet>
+class FrozenKmerDb
+{
+public:
+    static constexpr int kmer_size = K;
+    static constexpr int KmerSize = K;
+    using KmerAlphabet = Alphabet;
+    using KData = StoredData;
+    using key_type = Kmer<K, Alphabet>;
+
+    /*! A kmer's packed key and its data, as given to freeze(). */
+    using Entry = std::pair<uint64_t, StoredData>;
+
+    static const uint32_t Version = 2;
+
+    static fs::path data_path(const fs::path &file_base) {
+	return fs::path(file_base.native() + ".frozen");
+    }
+
+    FrozenKmerDb(const fs::path &file_base)
+	: file_base_(file_base)
+	, dat_path_(data_path(file_base))
+	, n_slots_(0)
+	, n_keys_(0)
+	, mask_(0)
+	, keys_(nullptr)
+	, data_(nullptr)
+	{
+	}
+
+    /*! Build the table in memory from entries, which must have distinct keys. */
+    void freeze(std::vector<Entry> entries) {
+	n_keys_ = entries.size();
+	n_slots_ = 16;
+	while (n_slots_ < 2 * n_keys_)
+	    n_slots_ *= 2;
+	mask_ = n_slots_ - 1;
+
+	uint64_t mask = mask_;
+	tbb::parallel_sort(entries.begin(), entries.end(), [mask](const Entry &a, const Entry &b) {
+	    uint64_t ha = kmer_hash_mix(a.first) & mask;
+	    uint64_t hb = kmer_hash_mix(b.first) & mask;
+	    return ha < hb || (ha == hb && a.first < b.first);
+	});
+
+	owned_keys_.assign(n_slots_, 0);
+	owned_data_.assign(n_slots_, StoredData());
+	for (auto &ent: entries)
+	{
+	    uint64_t slot = kmer_hash_mix(ent.first) & mask_;
+	    while (owned_keys_[slot] != 0)
+		slot = (slot + 1) & mask_;
+	    owned_keys_[slot] = ent.first;
+	    owned_data_[slot] = ent.second;
+	}
+	keys_ = owned_keys_.data();
+	data_ = owned_data_.data();
+    }
+
+    /*! Write the frozen table to <base>.frozen; it is written under a
+      temporary name and renamed into place, so a reader never finds a
+      partial table.
+    */
+    void save() const {
+	fs::path tmp = dat_path_.native() + ".tmp";
+	fs::ofstream out(tmp, std::ios::binary);
+	if (!out)
+	    throw std::runtime_error("cannot write frozen kmer table " + tmp.string());
+	FrozenKmerHeader hdr = header();
+	out.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+	out.write(reinterpret_cast<const char *>(keys_), n_slots_ * sizeof(uint64_t));
+	out.write(reinterpret_cast<const char *>(data_), n_slots_ * sizeof(StoredData));
+	out.close();
+	if (!out)
+	    throw std::runtime_error("error writing frozen kmer table " + tmp.string());
+	fs::rename(tmp, dat_path_);
+    }
+
+    void open() {
+	uint64_t len = fs::file_size(dat_path_);
+	if (len < sizeof(FrozenKmerHeader))
+	    throw std::runtime_error("Frozen kmer table " + dat_path_.string() + " is truncated");
+
+	mapping_ = ip::file_mapping(dat_path_.native().c_str(), ip::read_only);
+	mapped_region_ = ip::mapped_region(mapping_, ip::read_only);
+	const char *base = static_cast<const char *>(mapped_region_.get_address());
+
+	const FrozenKmerHeader *hdr = reinterpret_cast<const FrozenKmerHeader *>(base);
+	FrozenKmerHeader want = header();
+	if (std::memcmp(hdr->magic, want.magic, sizeof(want.magic)) != 0 || hdr->version != Version)
+	    throw std::runtime_error(dat_path_.string() + " is not a frozen kmer table");
+	if (hdr->kmer_size != want.kmer_size || hdr->bits_per_residue != want.bits_per_residue ||
+	    hdr->data_size != want.data_size ||
+	    std::strncmp(hdr->alphabet, want.alphabet, sizeof(want.alphabet)) != 0)
+	{
+	    throw std::runtime_error("Frozen kmer table " + dat_path_.string() +
+				     " does not match the kmer size and alphabet of the database");
+	}
+	if (hdr->n_slots == 0 || (hdr->n_slots & (hdr->n_slots - 1)) != 0 ||
+	    len != sizeof(FrozenKmerHeader) + hdr->n_slots * (sizeof(uint64_t) + sizeof(StoredData)))
+	{
+	    throw std::runtime_error("Frozen kmer table " + dat_path_.string() + " is corrupt");
+	}
+
+	owned_keys_.clear();
+	owned_data_.clear();
+	n_slots_ = hdr->n_slots;
+	n_keys_ = hdr->n_keys;
+	mask_ = n_slots_ - 1;
+	keys_ = reinterpret_cast<const uint64_t *>(base + sizeof(FrozenKmerHeader));
+	data_ = reinterpret_cast<const StoredData *>(base + sizeof(FrozenKmerHeader) + n_slots_ * sizeof(uint64_t));
+
+	if (madvise(mapped_region_.get_address(), len, MADV_WILLNEED) != 0)
+	{
+	    std::cerr << "madvise failed: " << strerror(errno) << "\n";
+	}
+    }
+
+    bool exists() {
+	return fs::exists(dat_path_);
+    }
+
+    size_t size() const { return n_keys_; }
+    size_t n_slots() const { return n_slots_; }
+
+    /*! Bytes taken by the keys and data. */
+    size_t data_size() const {
+	return n_slots_ * (sizeof(uint64_t) + sizeof(StoredData));
+    }
+
+    key_type convert_key(const std::string &key) {
+	key_type ka;
+	if (key.length() != kmer_size)
+	    throw std::runtime_error("Invalid kmer size");
+	if (!encode_kmer(key.data(), ka))
+	    throw std::runtime_error("Invalid kmer " + key);
+	return ka;
+    }
+
+    template <typename CB>
+    void fetch(const key_type &key, CB cb, int &iec) const {
+	uint64_t slot = kmer_hash_mix(key.bits) & mask_;
+	for (;;)
+	{
+	    uint64_t k = keys_[slot];
+	    if (k == key.bits)
+	    {
+		iec = 0;
+		cb(data_[slot]);
+		return;
+	    }
+	    if (k == 0)
+	    {
+		iec = 1;
+		return;
+	    }
+	    slot = (slot + 1) & mask_;
+	}
+    }
+    template <typename CB>
+    void fetch(const std::string &key, CB cb, int &iec) {
+	fetch(convert_key(key), cb, iec);
+    }
+
+private:
+    FrozenKmerHeader header() const {
+	FrozenKmerHeader hdr;
+	std::memset(&hdr, 0, sizeof(hdr));
+	std::memcpy(hdr.magic, "KFRZ", 4);
+	hdr.version = Version;
+	hdr.kmer_size = K;
+	hdr.bits_per_residue = key_type::bits_per_residue;
+	hdr.data_size = sizeof(StoredData);
+	hdr.n_slots = n_slots_;
+	hdr.n_keys = n_keys_;
+	std::strncpy(hdr.alphabet, Alphabet::name, sizeof(hdr.alphabet) - 1);
+	return hdr;
+    }
+
+    fs::path file_base_;
+    fs::path dat_path_;
+
+    uint64_t n_slots_;
+    uint64_t n_keys_;
+    uint64_t mask_;
+
+    /* Table built by freeze(); empty when the table is mapped by open(). */
+    std::vector<uint64_t> owned_keys_;
+    std::vector<StoredData> owned_data_;
+
+    ip::file_mapping mapping_;
+    ip::mapped_region mapped_region_;
+
+    const uint64_t *keys_;
+    const StoredData *data_;
+};
+
+#endif // _frozen_kmer_db_h
@@ -4,6 +4,7 @@
 #include "kmer_data.h"
 #include <map>
 #include <string>
+#include <string_view>
 #include <set>
 #include <iostream>
 #include <cmath>
@@ -19,6 +20,12 @@
 
 #include "seed_utils.h"
 #include "fasta_parser.h"
+#include "tbb_pipeline.h"
+
+#include <tbb/task_arena.h>
+
+#include <memory>
+#include <vector>
 
 namespace fs = boost::filesystem;
 namespace acc = boost::accumulators;
@@ -116,125 +123,42 @@ public:
       @param file Fasta file of protein data
       @param keep_function_flag If true, mark each function found in this file as a kept function.
       @param deleted_fids List of protein identifiers to exclude from the mapping.
+      @param cache If not null, read the file from this sequence cache when it holds it.
      */
-    void load_fasta_file(const fs::path &file, bool keep_function_flag, const std::set<std::string> &deleted_fids) {
-
-	const boost::regex genome_regex("\\s+(.*)\\s+\\[([^]]+)\\]$");
-	const boost::regex figid_regex("fig\\|(\\d+\\.\\d+)");
-	const boost::regex genome_id_regex("\\d+\\.\\d+");
-	
-	fs::ifstream ifstr(file);
-
-	FastaParser parser;
-
-	std::string genome;
-
-	parser.set_def_callback([this, &deleted_fids, &genome, &genome_regex, &figid_regex, &genome_id_regex, &file, keep_function_flag]
-				(const std::string &id, const std::string &def, const std::string &seq) {
-		if (id.empty())
-		    return;
-		else if (deleted_fids.find(id) != deleted_fids.end())
-		    return;
-
-		boost::smatch match;
-
-		//
-		// Need to always parse for [genome]
-		//
+    void load_fasta_file(const fs::path &file, bool keep_function_flag, const std::set<std::string, std::less<>> &deleted_fids,
+			 const KseqCache *cache = nullptr) {
+	FastaAssignments assignments;
+	parse_fasta_assignments(file, deleted_fids, cache, assignments);
+	merge_fasta_assignments(assignments, keep_function_flag);
+    }
 
-		std::string func;
-		if (!def.empty())
-		{
-		    size_t x = def.find_first_not_of(" \t");
-		    func = def.substr(x);
-		}
-		std::string genome_loc;
-		if (boost::regex_match(def, match, genome_regex))
-		{
-		    std::string delim, comment;
-		    seed_utils::split_func_comment(match[1], func, delim, comment);
-		    if (delim == "#" && seed_utils::is_truncated_comment(comment))
-		    {
-			// std::cerr << "skipping truncation " << match[1] << "\n";
-//			id_function_map_.erase(id);
-			return;
-		    }
-		    //func = strip_func_comment(match[1]);
-		    genome_loc = match[2];
-		}
-		
-		// Determine genome from first sequence.
-		if (genome.empty())
-		{
-		    if (def.empty())
-		    {
-			if (boost::regex_search(id, match, figid_regex))
-			{
-			    genome = match[1];
-			}
-		    }
-		    else
-		    {
-			if (!genome_loc.empty())
-			{
-			    genome = genome_loc;
-			}
-		    }
-		}
-		if (genome.empty())
-		{
-		    // default it to the file, just to have a value
-		    genome = file.filename().string();
-		    
-		    if (!boost::regex_match(genome, genome_id_regex))
-		    {
-			std::cerr << "cannot determine genome from file " << file << "\n";
-		    }
-		}
+    /*! @brief Load a list of fasta files as load_fasta_file() does, in parallel.
 
-		/*
-		 *
-		 * If the current-function map has a value, use that. We assume explicit setting
-		 * of functions overrides what is in the fasta.
-		 *
-		 * If we're assigning a function, update the id to function
-		 * map.
-		 *
-		 * Then look up the function for this id and add to the function_genome map.
-		 */
-		std::string cur_func = id_function_map_[id];
-		if (cur_func.empty())
-		{
-		    if (!func.empty())
-		    {
-			id_function_map_[id] = func;
-		    }
-		}
-		else
-		{
-		    func = cur_func;
-		}
-		
-		if (func.empty())
-		{
-		    // std::cerr << "No function found for " << id << "\n";
-		}
-		else
-		{
-		    function_genome_map_[func].insert(genome);
-		    if (keep_function_flag)
-		    {
-			// std::cerr << "Keeping function " << func << "\n";
-			good_functions_.insert(func);
-		    }
-		    // Update the accumulators managing protein length stats for this function
-		    function_accumulators_[func](static_cast<double>(seq.length()));
-		}
-			
-		return;
-	    });
-	parser.parse(ifstr);
-	parser.parse_complete();
+      The files are parsed concurrently and merged into the maps one at
+      a time in the order given, so the result is the same as loading
+      them in sequence. The protein length statistics in particular
+      depend on the order of the lengths.
+     */
+    void load_fasta_files(const std::vector<fs::path> &files, bool keep_function_flag,
+			  const std::set<std::string, std::less<>> &deleted_fids, const KseqCache *cache = nullptr) {
+	using AssignmentsPtr = std::shared_ptr<FastaAssignments>;
+	size_t next = 0;
+	size_t n_tokens = 2 * tbb::this_task_arena::max_concurrency();
+	tbb::parallel_pipeline(n_tokens,
+			       tbb::make_filter<void, size_t>(TBB_FILTER_MODE::serial_in_order, [&](tbb::flow_control &fc) -> size_t {
+				   if (next == files.size())
+				       fc.stop();
+				   return next++;
+			       }) &
+			       tbb::make_filter<size_t, AssignmentsPtr>(TBB_FILTER_MODE::parallel, [&](size_t i) -> AssignmentsPtr {
+				   auto assignments = std::make_shared<FastaAssignments>();
+				   if (i < files.size())
+				       parse_fasta_assignments(files[i], deleted_fids, cache, *assignments);
+				   return assignments;
+			       }) &
+			       tbb::make_filter<AssignmentsPtr, void>(TBB_FILTER_MODE::serial_in_order, [this, keep_function_flag](AssignmentsPtr assignments) {
+				   merge_fasta_assignments(*assignments, keep_function_flag);
+			       }));
     }
 
     /*!
@@ -254,7 +178,7 @@ public:
      * which functions are to have signatures created.
      * @param min_reps_required Function must occur in this many distinct genomes to be kept
      */
-    void process_kept_functions(int min_reps_required, const std::set<std::string> &ignored_functions) {
+    void process_kept_functions(int min_reps_required, const std::set<std::string, std::less<>> &ignored_functions) {
 	std::set<std::string> kept;
 	for (auto entry: function_genome_map_)
 	{
@@ -348,12 +272,12 @@ public:
 	}
     }
 
-    void lookup_original_assignment(const std::string &id, std::string &func, std::string &stripped) const {
+    void lookup_original_assignment(std::string_view id, std::string &func, std::string &stripped) const {
 	auto x = original_assignment_.find(id);
 	if (x != original_assignment_.end())
 	{
 	    func = x->second;
-	    stripped = original_assignment_stripped_.at(id);
+	    stripped = original_assignment_stripped_.find(id)->second;
 	}
     }
 
@@ -365,10 +289,10 @@ public:
 	    return it->second;
     }
 
-    std::string lookup_function(const std::string &id) {
+    const std::string &lookup_function(std::string_view id) {
 	auto it = id_function_map_.find(id);
 	if (it == id_function_map_.end())
-	    return "";
+	    return empty_function_;
 	else
 	    return it->second;
     }
@@ -417,8 +341,216 @@ public:
     void add_good_functions(const std::vector<std::string> &r) {
 	std::copy(r.begin(), r.end(), std::inserter(good_functions_, good_functions_.end()));
     }
+
+    /*! @brief Write the id to function assignments and the kept function index.
+
+      This is the state the kmer extraction and recall use after
+      process_kept_functions(); see load_assignments().
+    */
+    void save_assignments(std::ostream &os) const {
+	write_count(os, id_function_map_.size());
+	for (auto &ent: id_function_map_)
+	{
+	    write_string(os, ent.first);
+	    write_string(os, ent.second);
+	}
+	write_count(os, function_index_map_.size());
+	for (auto &ent: function_index_map_)
+	{
+	    write_string(os, ent.first);
+	    os.write(reinterpret_cast<const char *>(&ent.second), sizeof(ent.second));
+	}
+    }
+
+    /*! @brief Restore the state written by save_assignments() in place of
+      loading the fasta files and processing the kept functions.
+
+      The original assignments are not saved; they come from
+      load_id_assignments().
+      @return false if the data is truncated.
+    */
+    bool load_assignments(std::istream &is) {
+	uint64_t n;
+	if (!read_count(is, n))
+	    return false;
+	for (uint64_t i = 0; i < n; i++)
+	{
+	    std::string id, func;
+	    if (!read_string(is, id) || !read_string(is, func))
+		return false;
+	    id_function_map_[id] = func;
+	}
+	if (!read_count(is, n))
+	    return false;
+	for (uint64_t i = 0; i < n; i++)
+	{
+	    std::string func;
+	    FunctionIndex idx;
+	    if (!read_string(is, func) || !is.read(reinterpret_cast<char *>(&idx), sizeof(idx)))
+		return false;
+	    function_index_map_[func] = idx;
+	    index_function_map_[idx] = func;
+	}
+	return true;
+    }
     
 private:
+    /*! @brief The sequences of a fasta file with the function on their
+      definition lines, as parsed by parse_fasta_assignments().
+    */
+    struct FastaAssignments
+    {
+	struct Entry
+	{
+	    std::string id;
+	    std::string func;
+	    size_t length;
+	};
+	std::string genome;
+	std::vector<Entry> entries;
+    };
+
+    /*! Parse a fasta file for merge_fasta_assignments(); this does not use or change the maps. */
+    static void parse_fasta_assignments(const fs::path &file, const std::set<std::string, std::less<>> &deleted_fids,
+					const KseqCache *cache, FastaAssignments &assignments) {
+
+	const boost::regex genome_regex("\\s+(.*)\\s+\\[([^]]+)\\]$");
+	const boost::regex figid_regex("fig\\|(\\d+\\.\\d+)");
+	const boost::regex genome_id_regex("\\d+\\.\\d+");
+	
+	FastaParser parser;
+
+	std::string &genome = assignments.genome;
+
+	parser.parse(file, cache, [&assignments, &deleted_fids, &genome, &genome_regex, &figid_regex, &genome_id_regex, &file]
+		     (std::string_view id, std::string_view def, std::string_view seq) {
+		if (id.empty())
+		    return;
+		else if (deleted_fids.find(id) != deleted_fids.end())
+		    return;
+
+		boost::cmatch match;
+
+		//
+		// Need to always parse for [genome]
+		//
+
+		std::string func;
+		if (!def.empty())
+		{
+		    size_t x = def.find_first_not_of(" \t");
+		    func = std::string(def.substr(x));
+		}
+		std::string genome_loc;
+		if (boost::regex_match(def.data(), def.data() + def.size(), match, genome_regex))
+		{
+		    std::string delim, comment;
+		    seed_utils::split_func_comment(match[1].str(), func, delim, comment);
+		    if (delim == "#" && seed_utils::is_truncated_comment(comment))
+		    {
+			// std::cerr << "skipping truncation " << match[1] << "\n";
+			return;
+		    }
+		    //func = strip_func_comment(match[1]);
+		    genome_loc = match[2];
+		}
+		
+		// Determine genome from first sequence.
+		if (genome.empty())
+		{
+		    if (def.empty())
+		    {
+			if (boost::regex_search(id.data(), id.data() + id.size(), match, figid_regex))
+			{
+			    genome = match[1];
+			}
+		    }
+		    else
+		    {
+			if (!genome_loc.empty())
+			{
+			    genome = genome_loc;
+			}
+		    }
+		}
+		if (genome.empty())
+		{
+		    // default it to the file, just to have a value
+		    genome = strip_compression_extension(file).filename().string();
+		    
+		    if (!boost::regex_match(genome, genome_id_regex))
+		    {
+			std::cerr << "cannot determine genome from file " << file << "\n";
+		    }
+		}
+
+		assignments.entries.push_back(FastaAssignments::Entry { std::string(id), std::move(func), seq.length() });
+	    });
+    }
+
+    /*! @brief Apply the assignments of a parsed fasta file to the maps.
+     *
+     * If the current-function map has a value, use that. We assume explicit setting
+     * of functions overrides what is in the fasta.
+     *
+     * If we're assigning a function, update the id to function
+     * map.
+     *
+     * Then look up the function for this id and add to the function_genome map.
+     */
+    void merge_fasta_assignments(const FastaAssignments &assignments, bool keep_function_flag) {
+	for (auto &entry: assignments.entries)
+	{
+	    std::string func = entry.func;
+	    auto cur_func = id_function_map_.find(entry.id);
+	    if (cur_func == id_function_map_.end() || cur_func->second.empty())
+	    {
+		if (!func.empty())
+		{
+		    id_function_map_[entry.id] = func;
+		}
+	    }
+	    else
+	    {
+		func = cur_func->second;
+	    }
+		
+	    if (func.empty())
+	    {
+		// std::cerr << "No function found for " << entry.id << "\n";
+	    }
+	    else
+	    {
+		function_genome_map_[func].insert(assignments.genome);
+		if (keep_function_flag)
+		{
+		    // std::cerr << "Keeping function " << func << "\n";
+		    good_functions_.insert(func);
+		}
+		// Update the accumulators managing protein length stats for this function
+		function_accumulators_[func](static_cast<double>(entry.length));
+	    }
+	}
+    }
+
+    static void write_count(std::ostream &os, uint64_t n) {
+	os.write(reinterpret_cast<const char *>(&n), sizeof(n));
+    }
+    static bool read_count(std::istream &is, uint64_t &n) {
+	return static_cast<bool>(is.read(reinterpret_cast<char *>(&n), sizeof(n)));
+    }
+    static void write_string(std::ostream &os, const std::string &s) {
+	write_count(os, s.size());
+	os.write(s.data(), s.size());
+    }
+    static bool read_string(std::istream &is, std::string &s) {
+	uint64_t n;
+	if (!read_count(is, n))
+	    return false;
+	s.resize(n);
+	return static_cast<bool>(is.read(&s[0], n));
+    }
+
     /*!
       @brief Mapping from function string to the list of genomes in which it occurs.
 
@@ -433,7 +565,8 @@ private:
       are overridden if a fasta file also has a function definition in the
       fasta header.
     */
-    std::map<std::string, std::string> id_function_map_;
+    std::map<std::string, std::string, std::less<>> id_function_map_;
+    std::string empty_function_;
     std::map<std::string, FunctionIndex> function_index_map_;
     std::map<FunctionIndex, std::string> index_function_map_;
 
@@ -442,8 +575,8 @@ private:
 
     std::ofstream kept_function_stream_;
 
-    std::map<std::string, std::string> original_assignment_stripped_;
-    std::map<std::string, std::string> original_assignment_;
+    std::map<std::string, std::string, std::less<>> original_assignment_stripped_;
+    std::map<std::string, std::string, std::less<>> original_assignment_;
 
     /* Keep track of per-function statistics. We keep accumulator here
        because sequences are loaded via multiple calls into this object.
@@ -0,0 +1,99 @@
+#ifndef _kmer_alphabet_h
+#define _kmer_alphabet_h
+
+/*!
+  @file kmer_alphabet.h
+  @brief Residue alphabets used to encode kmers.
+
+  An alphabet maps each of the 20 standard amino acids (either case) to a
+  residue code in 1..size; code 0 marks a residue that may not appear in a
+  kmer. The full protein alphabet gives each amino acid its own code. A
+  reduced alphabet merges physico-chemically similar residues into a single
+  code, which shrinks the kmer key space and lets longer kmers fit in a
+  packed key.
+
+  Each alphabet is a type holding a constexpr ResidueTable built from a
+  grouping string, so the tables are fixed at compile time and selected by
+  template parameter (Kmer<K, Alphabet>, SignatureBuilder<K, Alphabet>,
+  ...). To add a grouping, define a type like the ones below and list it in
+  dispatch_kmer_encoding().
+*/
+
+#include <cstdint>
+
+const uint8_t InvalidResidue = 0;
+
+constexpr int residue_bits_for(int n_codes)
+{
+    int bits = 1;
+    while ((1 << bits) <= n_codes)
+	bits++;
+    return bits;
+}
+
+struct ResidueTable
+{
+    uint8_t code[256];
+    char residue[32];
+    int size;
+    int bits;
+    int letters;
+
+    /*! Build from space-separated residue groups; the first residue of a group names it when decoding. */
+    constexpr ResidueTable(const char *groups) : code{}, residue{}, size(0), bits(0), letters(0) {
+	bool in_group = false;
+	for (const char *p = groups; *p; p++)
+	{
+	    if (*p == ' ')
+	    {
+		in_group = false;
+		continue;
+	    }
+	    if (!in_group)
+	    {
+		size++;
+		residue[size] = *p;
+		in_group = true;
+	    }
+	    code[static_cast<unsigned char>(*p)] = static_cast<uint8_t>(size);
+	    code[static_cast<unsigned char>(*p - 'A' + 'a')] = static_cast<uint8_t>(size);
+	    letters++;
+	}
+	residue[InvalidResidue] = 'X';
+	bits = residue_bits_for(size);
+    }
+};
+
+/*! The 20 standard amino acids, one code each. */
+struct ProteinAlphabet
+{
+    static constexpr const char *name = "protein";
+    static constexpr ResidueTable table{"A C D E F G H I K L M N P Q R S T V W Y"};
+};
+
+/*! Murphy et al. (2000) 10-letter reduced alphabet. */
+struct Murphy10Alphabet
+{
+    static constexpr const char *name = "murphy10";
+    static constexpr ResidueTable table{"LVIM C A G ST P FYW EDNQ KR H"};
+};
+
+/*! Murphy et al. (2000) 15-letter reduced alphabet. */
+struct Murphy15Alphabet
+{
+    static constexpr const char *name = "murphy15";
+    static constexpr ResidueTable table{"LVIM C A G S T P FY W E D N Q KR H"};
+};
+
+static_assert(ProteinAlphabet::table.letters == 20 &&
+	      Murphy10Alphabet::table.letters == 20 &&
+	      Murphy15Alphabet::table.letters == 20,
+	      "an alphabet must assign a code to each of the 20 standard amino acids");
+
+template <typename Alphabet>
+inline uint8_t residue_code(char c)
+{
+    return Alphabet::table.code[static_cast<unsigned char>(c)];
+}
+
+#endif // _kmer_alphabet_h
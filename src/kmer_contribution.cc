@@ -0,0 +1,221 @@
+#include "kmer_contribution.h"
+#include "kseq_cache.h"
+
+#include <boost/filesystem/fstream.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <set>
+#include <stdexcept>
+
+static const char ContributionMagic[4] = { 'K', 'C', 'O', 'N' };
+static const uint32_t ContributionVersion = 3;
+
+template <typename T>
+static void put(std::ostream &os, const T &v)
+{
+    os.write(reinterpret_cast<const char *>(&v), sizeof(T));
+}
+
+static void put_string(std::ostream &os, const std::string &s)
+{
+    put(os, static_cast<uint32_t>(s.size()));
+    os.write(s.data(), s.size());
+}
+
+template <typename T>
+static bool get(std::istream &is, T &v)
+{
+    return static_cast<bool>(is.read(reinterpret_cast<char *>(&v), sizeof(T)));
+}
+
+static bool get_string(std::istream &is, std::string &s)
+{
+    uint32_t len;
+    if (!get(is, len))
+	return false;
+    s.resize(len);
+    return static_cast<bool>(is.read(&s[0], len));
+}
+
+KmerContributionStore::KmerContributionStore(const fs::path &dir, const std::string &encoding, int partition_bits)
+    : dir_(dir)
+    , encoding_(encoding)
+    , partition_bits_(partition_bits)
+{
+    fs::create_directories(dir_);
+}
+
+/*!
+  Contribution files are named by a 64-bit FNV-1a hash of the canonical
+  source path; the path is also stored in the file and checked on open.
+*/
+fs::path KmerContributionStore::contribution_path(const std::string &canonical_source) const
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c: canonical_source)
+    {
+	h ^= c;
+	h *= 0x100000001b3ULL;
+    }
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.kcontrib", static_cast<unsigned long long>(h));
+    return dir_ / name;
+}
+
+std::unique_ptr<KmerContribution> KmerContributionStore::open(const fs::path &source, bool verify_checksum) const
+{
+    std::string name = fs::canonical(source).string();
+    fs::path path = contribution_path(name);
+    if (!fs::exists(path))
+	return nullptr;
+
+    fs::ifstream in(path, std::ios::binary);
+    char magic[4];
+    uint32_t version, partition_bits;
+    std::string encoding, stored_name;
+    uint64_t source_size, checksum, n_functions, n_sequences, n_records;
+    if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, ContributionMagic, sizeof(magic)) != 0 ||
+	!get(in, version) || version != ContributionVersion ||
+	!get_string(in, encoding) || encoding != encoding_ ||
+	!get(in, partition_bits) || int(partition_bits) != partition_bits_ ||
+	!get_string(in, stored_name) || stored_name != name ||
+	!get(in, source_size) || source_size != fs::file_size(source) ||
+	!get(in, checksum) ||
+	!get(in, n_functions) || !get(in, n_sequences) || !get(in, n_records))
+	return nullptr;
+
+    if (verify_checksum && checksum != KseqCache::checksum(source))
+	return nullptr;
+
+    auto contrib = std::make_unique<KmerContribution>();
+    contrib->path_ = path;
+    contrib->n_records_ = n_records;
+    contrib->functions_.resize(n_functions);
+    for (auto &f: contrib->functions_)
+	if (!get_string(in, f))
+	    return nullptr;
+    contrib->sequences_.resize(n_sequences);
+    for (auto &s: contrib->sequences_)
+    {
+	uint8_t deleted;
+	if (!get_string(in, s.id) || !get(in, s.function) || !get(in, deleted))
+	    return nullptr;
+	s.deleted = deleted != 0;
+    }
+    contrib->partition_table_offset_ = static_cast<uint64_t>(in.tellg());
+    contrib->records_offset_ = contrib->partition_table_offset_ + (n_partitions() + 1) * sizeof(uint64_t);
+
+    if (contrib->records_offset_ + n_records * sizeof(KmerRecord) != fs::file_size(path))
+	return nullptr;
+
+    return contrib;
+}
+
+std::unique_ptr<KmerContribution> KmerContributionStore::write(const fs::path &source, KmerContributionData &data) const
+{
+    std::string name = fs::canonical(source).string();
+    fs::path path = contribution_path(name);
+    fs::path tmp = path;
+    tmp += ".tmp";
+
+    std::vector<uint64_t> partition_start(n_partitions() + 1, 0);
+    for (auto &r: data.records)
+	partition_start[kmer_hash_partition(r.kmer, partition_bits_) + 1]++;
+    for (size_t p = 1; p < partition_start.size(); p++)
+	partition_start[p] += partition_start[p - 1];
+
+    std::vector<KmerRecord> records(data.records.size());
+    {
+	std::vector<uint64_t> next(partition_start.begin(), partition_start.end() - 1);
+	for (auto &r: data.records)
+	    records[next[kmer_hash_partition(r.kmer, partition_bits_)]++] = r;
+	std::vector<KmerRecord>().swap(data.records);
+    }
+    for (size_t p = 0; p < n_partitions(); p++)
+	std::sort(records.begin() + partition_start[p], records.begin() + partition_start[p + 1], kmer_record_less);
+
+    auto contrib = std::make_unique<KmerContribution>();
+    contrib->path_ = path;
+    contrib->n_records_ = records.size();
+
+    fs::ofstream out(tmp, std::ios::binary);
+    if (!out)
+	throw std::runtime_error("cannot write kmer contribution " + tmp.string());
+
+    out.write(ContributionMagic, sizeof(ContributionMagic));
+    put(out, ContributionVersion);
+    put_string(out, encoding_);
+    put(out, static_cast<uint32_t>(partition_bits_));
+    put_string(out, name);
+    put(out, static_cast<uint64_t>(fs::file_size(source)));
+    put(out, KseqCache::checksum(source));
+    put(out, static_cast<uint64_t>(data.functions.size()));
+    put(out, static_cast<uint64_t>(data.sequences.size()));
+    put(out, static_cast<uint64_t>(records.size()));
+    for (auto &f: data.functions)
+	put_string(out, f);
+    for (auto &s: data.sequences)
+    {
+	put_string(out, s.id);
+	put(out, s.function);
+	put(out, static_cast<uint8_t>(s.deleted));
+    }
+    contrib->partition_table_offset_ = static_cast<uint64_t>(out.tellp());
+    contrib->records_offset_ = contrib->partition_table_offset_ + partition_start.size() * sizeof(uint64_t);
+    out.write(reinterpret_cast<const char *>(partition_start.data()), partition_start.size() * sizeof(uint64_t));
+    out.write(reinterpret_cast<const char *>(records.data()), records.size() * sizeof(KmerRecord));
+    out.close();
+    if (!out)
+	throw std::runtime_error("error writing kmer contribution " + tmp.string());
+    fs::rename(tmp, path);
+
+    contrib->functions_ = std::move(data.functions);
+    contrib->sequences_ = std::move(data.sequences);
+    return contrib;
+}
+
+void KmerContributionStore::remove_stale(const std::vector<fs::path> &sources) const
+{
+    std::set<fs::path> current;
+    for (auto &s: sources)
+	if (fs::exists(s))
+	    current.insert(contribution_path(fs::canonical(s).string()));
+
+    for (auto &ent: fs::directory_iterator(dir_))
+    {
+	const fs::path &p = ent.path();
+	if ((p.extension() == ".kcontrib" && current.find(p) == current.end()) || p.extension() == ".tmp")
+	{
+	    std::cerr << "remove stale contribution " << p << "\n";
+	    fs::remove(p);
+	}
+    }
+}
+
+void KmerContribution::read_partitions(const std::vector<size_t> &parts, std::vector<KmerRecord> &out,
+				       std::vector<size_t> &start) const
+{
+    fs::ifstream in(path_, std::ios::binary);
+    start.assign(1, out.size());
+    for (size_t p: parts)
+    {
+	uint64_t range[2];
+	in.seekg(partition_table_offset_ + p * sizeof(uint64_t));
+	if (!in.read(reinterpret_cast<char *>(range), sizeof(range)) || range[0] > range[1] || range[1] > n_records_)
+	    throw std::runtime_error("error reading kmer contribution " + path_.string());
+
+	size_t n = range[1] - range[0];
+	size_t pos = out.size();
+	out.resize(pos + n);
+	if (n > 0)
+	{
+	    in.seekg(records_offset_ + range[0] * sizeof(KmerRecord));
+	    if (!in.read(reinterpret_cast<char *>(out.data() + pos), n * sizeof(KmerRecord)))
+		throw std::runtime_error("error reading kmer contribution " + path_.string());
+	}
+	start.push_back(out.size());
+    }
+}
@@ -0,0 +1,133 @@
+#ifndef _kmer_contribution_h
+#define _kmer_contribution_h
+
+/*!
+  @file kmer_contribution.h
+  @brief Persistent per-file kmer contributions for incremental signature builds.
+
+  An incremental build keeps, for each fasta file, the kmer occurrences
+  the file contributes in a contribution file in a store directory.
+  A later build re-extracts only the files that were added or changed
+  and reuses the rest, then merges all contributions to select the
+  signature kmers. The result is the same as a full build.
+
+  A contribution file holds:
+
+  - a header with the source path, size and checksum, and the kmer
+    encoding the records were extracted with;
+  - the names of the functions of its sequences;
+  - a sequence table with each sequence id, its function (as an index
+    into the names) and whether it was excluded as a deleted feature;
+  - a table of the start of each partition, and the KmerRecords of
+    every sequence with a function, grouped by partition (the leading
+    bits of kmer_hash_mix() of the kmer) and sorted by kmer within each.
+
+  Records hold file-local sequence and function indexes, mapped to the
+  build's indexes when they are merged. Records are written for every
+  sequence with a function, kept or not, so changing the kept function
+  set does not invalidate a contribution. A contribution is reused only
+  if the source checksum matches and every sequence still has the
+  recorded function and deleted state. A change to the function
+  definitions or the deleted features therefore causes exactly the
+  affected files to be re-extracted.
+*/
+
+#include "kmer_record_sort.h"
+
+#include <boost/filesystem.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace fs = boost::filesystem;
+
+const uint16_t NoContributionFunction = 0xffff;
+
+struct KmerContributionSequence
+{
+    std::string id;
+    uint16_t function;
+    bool deleted;
+};
+
+/*! @brief The extracted kmers of one source file, as written to the store. */
+struct KmerContributionData
+{
+    std::vector<std::string> functions;
+    std::vector<KmerContributionSequence> sequences;
+    std::vector<KmerRecord> records;
+};
+
+/*! @brief A contribution file read from the store.
+
+  Holds the function names and sequence table; the records are read a
+  batch of partitions at a time, so the file is not held open.
+*/
+class KmerContribution
+{
+public:
+    const fs::path &path() const { return path_; }
+    const std::vector<std::string> &functions() const { return functions_; }
+    const std::vector<KmerContributionSequence> &sequences() const { return sequences_; }
+    uint64_t n_records() const { return n_records_; }
+
+    /*! Free the sequence table once the contribution has been validated. */
+    void release_sequences() { std::vector<KmerContributionSequence>().swap(sequences_); }
+
+    /*! Read the records of each partition in parts, sorted by kmer, into out.
+
+      The file is opened once. The records of parts[j] are
+      out[start[j]] .. out[start[j + 1]).
+    */
+    void read_partitions(const std::vector<size_t> &parts, std::vector<KmerRecord> &out,
+			 std::vector<size_t> &start) const;
+
+private:
+    friend class KmerContributionStore;
+
+    fs::path path_;
+    std::vector<std::string> functions_;
+    std::vector<KmerContributionSequence> sequences_;
+    uint64_t n_records_ = 0;
+    uint64_t partition_table_offset_ = 0;
+    uint64_t records_offset_ = 0;
+};
+
+class KmerContributionStore
+{
+public:
+    /*!
+      @param dir Store directory; created if it does not exist.
+      @param encoding Description of the kmer encoding (size and alphabet); contributions
+      written with a different encoding are not used.
+      @param partition_bits Number of leading bits of the kmer hash that define a partition
+    */
+    KmerContributionStore(const fs::path &dir, const std::string &encoding, int partition_bits);
+
+    /*! Open the contribution of source, if the store holds one for its current contents.
+
+      With verify_checksum false, a contribution of a file with the
+      expected size is trusted without reading the file; this is for
+      contributions known to have been written by the current build.
+    */
+    std::unique_ptr<KmerContribution> open(const fs::path &source, bool verify_checksum = true) const;
+
+    /*! Write the contribution of source. The records are sorted by kmer. */
+    std::unique_ptr<KmerContribution> write(const fs::path &source, KmerContributionData &data) const;
+
+    /*! Remove contributions of files that are not in sources. */
+    void remove_stale(const std::vector<fs::path> &sources) const;
+
+    size_t n_partitions() const { return size_t(1) << partition_bits_; }
+
+private:
+    fs::path contribution_path(const std::string &canonical_source) const;
+
+    fs::path dir_;
+    std::string encoding_;
+    int partition_bits_;
+};
+
+#endif // _kmer_contribution_h
@@ -5,11 +5,19 @@
 #include <cstddef>
 #include <limits>
 #include <array>
+#include <string>
+#include <string_view>
 #include <unordered_map>
 #include <iostream>
 #include <iterator>
 #include <algorithm>
 
+#include "kmer_alphabet.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 
 /*!
  * Function indexes are use to reference the entries in function.index
@@ -33,71 +41,240 @@ typedef uint16_t OTUIndex;
  */
 const FunctionIndex UndefinedOTU = std::numeric_limits<FunctionIndex>::max();
 
-template <int K>
-using Kmer = std::array<char, K>;
+/*! @brief A kmer of K residues packed into a 64-bit key.
 
-template <size_t K>
-std::ostream &operator<<(std::ostream &os, const Kmer<K> &k)
+  Residue codes from the kmer's alphabet (see kmer_alphabet.h) are packed
+  Alphabet::table.bits bits per residue, so the kmer is compared and hashed
+  as a single integer; upper and lower case encode identically. The first
+  residue of the kmer occupies the most significant bits, so the ordering
+  of packed keys matches the ordering of the residue codes.
+  data() and size() expose the key bytes for the on-disk hash backends.
+*/
+template <int K, typename Alphabet = ProteinAlphabet>
+struct Kmer
 {
-    std::copy(k.begin(), k.end(),
-	      std::ostream_iterator<char>(os, ""));
-    return os;
-}
+    using alphabet = Alphabet;
+    static constexpr int bits_per_residue = Alphabet::table.bits;
+    static constexpr int max_size = 64 / bits_per_residue;
 
-/*! @brief Hash function on kmers.
- */
-/*
-namespace std {
-template<class T, size_t N>
-struct hash<std::array<T, N>> {
-    auto operator() (const array<T, N>& key) const {
-	hash<T> hasher;
-	size_t result = 0;
-	for(size_t i = 0; i < N; ++i) {
-	    result = result * 31 + hasher(key[i]); // ??
-	}
-	return result;
+    static_assert(K > 0 && K <= max_size, "kmer size does not fit in a packed key");
+
+    static constexpr int bits_used = K * bits_per_residue;
+    static constexpr uint64_t mask = (bits_used == 64) ? ~uint64_t(0) : ((uint64_t(1) << bits_used) - 1);
+
+    uint64_t bits = 0;
+
+    /*! Shift a residue code onto the end of the kmer, dropping the first residue. */
+    void push(uint8_t code) {
+	bits = ((bits << bits_per_residue) | code) & mask;
     }
+
+    uint8_t code_at(int i) const {
+	return static_cast<uint8_t>((bits >> ((K - 1 - i) * bits_per_residue)) & ((1 << bits_per_residue) - 1));
+    }
+
+    /*! Number of distinct kmers, Alphabet::table.size ^ K. */
+    static constexpr uint64_t dense_size() {
+	uint64_t n = 1;
+	for (int i = 0; i < K; i++)
+	    n *= Alphabet::table.size;
+	return n;
+    }
+
+    /*! Rank of the kmer in 0 .. dense_size() - 1, for direct-addressed tables. */
+    uint64_t dense_index() const {
+	uint64_t r = 0;
+	for (int i = 0; i < K; i++)
+	    r = r * Alphabet::table.size + (code_at(i) - 1);
+	return r;
+    }
+
+    const char *data() const { return reinterpret_cast<const char *>(&bits); }
+    static constexpr size_t size() { return sizeof(bits); }
+
+    std::string str() const {
+	std::string s(K, ' ');
+	for (int i = 0; i < K; i++)
+	    s[i] = Alphabet::table.residue[code_at(i)];
+	return s;
+    }
+
+    bool operator==(const Kmer &o) const { return bits == o.bits; }
+    bool operator!=(const Kmer &o) const { return bits != o.bits; }
+    bool operator<(const Kmer &o) const { return bits < o.bits; }
 };
+
+/*! @brief Encode K residues starting at s into kmer.
+  @return false if any residue is not valid in a kmer.
+*/
+template <int K, typename Alphabet>
+bool encode_kmer(const char *s, Kmer<K, Alphabet> &kmer)
+{
+    Kmer<K, Alphabet> k;
+    for (int i = 0; i < K; i++)
+    {
+	uint8_t code = residue_code<Alphabet>(s[i]);
+	if (code == InvalidResidue)
+	    return false;
+	k.push(code);
+    }
+    kmer = k;
+    return true;
+}
+
+template <int K, typename Alphabet>
+std::ostream &operator<<(std::ostream &os, const Kmer<K, Alphabet> &k)
+{
+    os << k.str();
+    return os;
 }
+
+/*! @brief Mix a packed kmer key into a hash value.
+
+  This is the multiply-xorshift finalizer from MurmurHash3. Every input bit
+  affects every output bit, so both the low bits (used by the TBB containers
+  to select a bucket) and the high bits are well distributed even though
+  packed kmers differ mostly in their low-order residues.
 */
+inline uint64_t kmer_hash_mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
 
-template <int K>
+/*! @brief Hash function on kmers.
+ */
+template <int K, typename Alphabet = ProteinAlphabet>
 struct tbb_hash {
     tbb_hash() {}
-    size_t operator()(const Kmer<K>& k) const {
-        size_t h = 0;
-	for (auto s: k)
-	    h = (h * 17) ^ (unsigned int) s;
-	return h;
+    size_t operator()(const Kmer<K, Alphabet>& k) const {
+	return static_cast<size_t>(kmer_hash_mix(k.bits));
+    }
+};
+
+/*! @brief HashCompare on kmers for tbb::concurrent_hash_map.
+ */
+template <int K, typename Alphabet = ProteinAlphabet>
+struct tbb_hash_compare {
+    static size_t hash(const Kmer<K, Alphabet>& k) {
+	return static_cast<size_t>(kmer_hash_mix(k.bits));
+    }
+    static bool equal(const Kmer<K, Alphabet>& a, const Kmer<K, Alphabet>& b) {
+	return a == b;
     }
 };
 
-template <int N, typename F>
-void for_each_kmer(const std::string &str, F cb) {
-    const char *ptr = str.c_str();
-    const char *end = ptr  + str.length();
-    const char *last_kmer= end - N;
+/*! @brief Compute the residue validity bitmap for up to 64 residues.
+
+  Bit i of the result is set if p[i] is valid in a kmer (see residue_code()).
+  Full 32- or 16-byte blocks are classified with AVX2 or SSE2 when available;
+  the definition matches the residue tables: the letters A-Y, either case,
+  excluding B, J, O, U and X. Every alphabet codes the same 20 residues, so
+  validity does not depend on the alphabet.
+*/
+inline uint64_t valid_residue_bits(const char *p, size_t n)
+{
+    uint64_t bits = 0;
+    size_t i = 0;
+#if defined(__AVX2__)
+    {
+	const __m256i case_bit = _mm256_set1_epi8(0x20);
+	const __m256i a = _mm256_set1_epi8('a');
+	const __m256i span = _mm256_set1_epi8('y' - 'a');
+	for (; i + 32 <= n; i += 32)
+	{
+	    __m256i v = _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i)), case_bit);
+	    __m256i off = _mm256_sub_epi8(v, a);
+	    __m256i in_range = _mm256_cmpeq_epi8(_mm256_min_epu8(off, span), off);
+	    __m256i bad = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('b')),
+							  _mm256_cmpeq_epi8(v, _mm256_set1_epi8('j'))),
+					  _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('o')),
+									  _mm256_cmpeq_epi8(v, _mm256_set1_epi8('u'))),
+							  _mm256_cmpeq_epi8(v, _mm256_set1_epi8('x'))));
+	    uint32_t m = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_andnot_si256(bad, in_range)));
+	    bits |= static_cast<uint64_t>(m) << i;
+	}
+    }
+#endif
+#if defined(__SSE2__)
+    {
+	const __m128i case_bit = _mm_set1_epi8(0x20);
+	const __m128i a = _mm_set1_epi8('a');
+	const __m128i span = _mm_set1_epi8('y' - 'a');
+	for (; i + 16 <= n; i += 16)
+	{
+	    __m128i v = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i)), case_bit);
+	    __m128i off = _mm_sub_epi8(v, a);
+	    __m128i in_range = _mm_cmpeq_epi8(_mm_min_epu8(off, span), off);
+	    __m128i bad = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('b')),
+						    _mm_cmpeq_epi8(v, _mm_set1_epi8('j'))),
+				       _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('o')),
+								 _mm_cmpeq_epi8(v, _mm_set1_epi8('u'))),
+						    _mm_cmpeq_epi8(v, _mm_set1_epi8('x'))));
+	    uint32_t m = static_cast<uint32_t>(_mm_movemask_epi8(_mm_andnot_si128(bad, in_range)));
+	    bits |= static_cast<uint64_t>(m) << i;
+	}
+    }
+#endif
+    for (; i < n; i++)
+    {
+	if (residue_code<ProteinAlphabet>(p[i]) != InvalidResidue)
+	    bits |= uint64_t(1) << i;
+    }
+    return bits;
+}
+
+/*! @brief Compute the valid-window bitmap for a block of 64 positions.
+
+  Given the residue validity bits for a block (cur) and for the block that
+  follows it (next), bit i of the result is set if the K residues starting
+  at position i of the block are all valid.
+*/
+template <int K>
+inline uint64_t valid_kmer_window_bits(uint64_t cur, uint64_t next)
+{
+    uint64_t w = cur;
+    for (int j = 1; j < K; j++)
+	w &= (cur >> j) | (next << (64 - j));
+    return w;
+}
+
+/*! @brief Invoke cb(kmer, offset) for each valid kmer in str.
+
+  Each residue is classified once into a validity bitmap, which is reduced
+  to a bitmap of valid kmer windows 64 positions at a time. We walk the set
+  bits of the window bitmap; the packed kmer is rolled forward one residue
+  between adjacent windows and rebuilt after a run of invalid residues.
+*/
+template <int N, typename Alphabet = ProteinAlphabet, typename F>
+void for_each_kmer(std::string_view str, F cb) {
+    const char *ptr = str.data();
+    size_t len = str.length();
+    if (len < (size_t) N)
+	return;
 
-    const char *next_ambig = std::find_if(ptr, end, [](char c) -> bool { return c == '*' || c == 'X'; });
-    // std::cerr << "next_ambig=" << next_ambig << "\n";
-    std::array<char, N> kmer;
-    while (ptr <= last_kmer)
+    Kmer<N, Alphabet> kmer;
+    size_t encoded_end = 0;
+    uint64_t cur = valid_residue_bits(ptr, std::min<size_t>(len, 64));
+    for (size_t block = 0; block < len; block += 64)
     {
-	// std::cerr << "ptr=" << ptr << "\n";
-	const char *kend = ptr + N;
-	// std::cerr << "kend=" << kend << "\n";
-	if (next_ambig != end && kend >= next_ambig)
+	size_t next_block = block + 64;
+	uint64_t next = next_block < len ? valid_residue_bits(ptr + next_block, std::min<size_t>(len - next_block, 64)) : 0;
+	uint64_t windows = valid_kmer_window_bits<N>(cur, next);
+	while (windows)
 	{
-	    // std::cerr << "hit abmig\n";
-	    ptr = next_ambig + 1;
-	    next_ambig = std::find_if(ptr, end, [](char c) { return c == '*' || c == 'X'; });
-	    continue;
+	    size_t i = block + __builtin_ctzll(windows);
+	    windows &= windows - 1;
+	    for (size_t p = std::max(encoded_end, i); p < i + N; p++)
+		kmer.push(residue_code<Alphabet>(ptr[p]));
+	    encoded_end = i + N;
+	    cb(kmer, i);
 	}
-	std::copy(ptr, kend, kmer.data());
-	// std::cerr << "cb " << kmer << "\n";
-	cb(kmer, ptr - str.c_str());
-	ptr++;
+	cur = next;
     }
 }
 
@@ -0,0 +1,69 @@
+#ifndef _kmer_db_metadata_h
+#define _kmer_db_metadata_h
+
+/*!
+  @file kmer_db_metadata.h
+  @brief Build parameters recorded alongside a signature kmer database.
+
+  kmers-build-signatures writes the file kmer.params into the kmer data
+  directory; the calling tools read it to learn how the database was built.
+  The file holds one tab-separated key/value pair per line. Unknown keys are
+  ignored so older tools can read newer files. A data directory without
+  kmer.params predates the file; its kmer keys use the old character-array
+  encoding, which the current tools cannot look up, so it must be rebuilt.
+*/
+
+#include "kmer_data.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+
+#include <iostream>
+#include <string>
+#include <stdexcept>
+
+namespace fs = boost::filesystem;
+
+const int DefaultKmerSize = 8;
+
+struct KmerDbMetadata
+{
+    int kmer_size = DefaultKmerSize;
+    std::string alphabet = ProteinAlphabet::name;
+
+    static fs::path path(const fs::path &data_dir) {
+	return data_dir / "kmer.params";
+    }
+
+    void write(const fs::path &data_dir) const {
+	fs::ofstream of(path(data_dir));
+	if (!of)
+	    throw std::runtime_error("cannot write " + path(data_dir).string());
+	of << "kmer_size\t" << kmer_size << "\n";
+	of << "alphabet\t" << alphabet << "\n";
+    }
+
+    /*! Read the metadata for a data directory; throws if there is none. */
+    void read(const fs::path &data_dir) {
+	fs::ifstream ifstr(path(data_dir));
+	if (!ifstr)
+	    throw std::runtime_error("kmer data directory " + data_dir.string() + " has no " +
+				     path(data_dir).filename().string() +
+				     "; it was built by an older kmers-build-signatures and must be rebuilt");
+	std::string line;
+	while (std::getline(ifstr, line, '\n'))
+	{
+	    auto tab = line.find('\t');
+	    if (tab == std::string::npos)
+		continue;
+	    std::string key = line.substr(0, tab);
+	    std::string val = line.substr(tab + 1);
+	    if (key == "kmer_size")
+		kmer_size = std::stoi(val);
+	    else if (key == "alphabet")
+		alphabet = val;
+	}
+    }
+};
+
+#endif // _kmer_db_metadata_h
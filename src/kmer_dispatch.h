@@ -0,0 +1,72 @@
+#ifndef _kmer_dispatch_h
+#define _kmer_dispatch_h
+
+/*!
+  @file kmer_dispatch.h
+  @brief Select a compile-time kmer size from a runtime value.
+
+  The kmer size is a template parameter throughout (Kmer<K>, SignatureBuilder<K>,
+  the database backends) so the inner loops are fully specialized. The tools
+  learn the kmer size at startup, either from the command line or from the
+  database metadata, and use dispatch_kmer_size() to enter code instantiated
+  for each size in [MinKmerSize, MaxKmerSize<Alphabet>]. The largest size
+  is as many residues as fit in a packed key: 12 for the protein alphabet
+  and 16 for the 4-bit reduced alphabets.
+
+  The callback is a generic lambda that receives a std::integral_constant:
+
+      dispatch_kmer_size(k, [&](auto kc) {
+	  constexpr int K = decltype(kc)::value;
+	  return run<K>(params);
+      });
+
+  dispatch_kmer_encoding() additionally selects the residue alphabet by name,
+  which sets the size range, and passes a value of the alphabet type:
+
+      dispatch_kmer_encoding(k, "murphy10", [&](auto kc, auto alphabet) {
+	  return run<decltype(kc)::value, decltype(alphabet)>(params);
+      });
+*/
+
+#include "kmer_data.h"
+
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+const int MinKmerSize = 6;
+
+template <typename Alphabet>
+constexpr int MaxKmerSize = Kmer<MinKmerSize, Alphabet>::max_size;
+
+template <typename Alphabet = ProteinAlphabet, int K = MinKmerSize, typename F>
+auto dispatch_kmer_size(int kmer_size, F &&f) -> decltype(f(std::integral_constant<int, MinKmerSize>()))
+{
+    if constexpr (K > MaxKmerSize<Alphabet>)
+    {
+	throw std::runtime_error("Unsupported kmer size " + std::to_string(kmer_size) +
+				 " for the " + Alphabet::name + " alphabet (supported sizes are " +
+				 std::to_string(MinKmerSize) + " to " + std::to_string(MaxKmerSize<Alphabet>) + ")");
+    }
+    else
+    {
+	if (kmer_size == K)
+	    return f(std::integral_constant<int, K>());
+	return dispatch_kmer_size<Alphabet, K + 1>(kmer_size, std::forward<F>(f));
+    }
+}
+
+template <typename F>
+auto dispatch_kmer_encoding(int kmer_size, const std::string &alphabet, F &&f)
+{
+    if (alphabet == ProteinAlphabet::name)
+	return dispatch_kmer_size<ProteinAlphabet>(kmer_size, [&f](auto kc) { return f(kc, ProteinAlphabet()); });
+    else if (alphabet == Murphy10Alphabet::name)
+	return dispatch_kmer_size<Murphy10Alphabet>(kmer_size, [&f](auto kc) { return f(kc, Murphy10Alphabet()); });
+    else if (alphabet == Murphy15Alphabet::name)
+	return dispatch_kmer_size<Murphy15Alphabet>(kmer_size, [&f](auto kc) { return f(kc, Murphy15Alphabet()); });
+    throw std::runtime_error("Unknown kmer alphabet " + alphabet);
+}
+
+#endif // _kmer_dispatch_h
@@ -0,0 +1,130 @@
+#ifndef _kmer_record_sort_h
+#define _kmer_record_sort_h
+
+/*!
+  @file kmer_record_sort.h
+  @brief Packed kmer occurrence records and their parallel radix sort.
+
+  The sort-based signature build writes one KmerRecord per kmer
+  occurrence into a per-thread vector instead of inserting a node into
+  a concurrent multimap. The records are then sorted by kmer so each
+  kmer's occurrences are adjacent:
+
+  - a counting pass over the per-thread buffers histograms the records
+    by the leading partition_bits bits of the kmer key;
+  - a scatter pass copies each buffer into its reserved slice of each
+    partition of a single output array, releasing the buffer as it goes;
+  - each partition is sorted independently with kmer_record_less.
+
+  Since a partition is defined by a key prefix, the occurrences of a
+  kmer never span partitions and the partitions can be grouped in parallel.
+*/
+
+#include "kmer_data.h"
+
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#pragma pack(push, 4)
+/*! One kmer occurrence: the packed kmer and the attributes of the occurrence. */
+struct KmerRecord
+{
+    uint64_t kmer;
+    uint32_t seq_id;
+    uint32_t protein_length;
+    FunctionIndex func_index;
+    uint16_t offset;
+
+    KmerAttributes attributes() const {
+	return KmerAttributes { func_index, UndefinedOTU, offset, seq_id, protein_length };
+    }
+};
+#pragma pack(pop)
+
+static_assert(sizeof(KmerRecord) == 20, "KmerRecord should be packed into 20 bytes");
+
+/*! Order records by kmer, then by sequence and offset so the order of a
+  kmer's records does not depend on thread scheduling.
+*/
+inline bool kmer_record_less(const KmerRecord &a, const KmerRecord &b)
+{
+    return a.kmer < b.kmer || (a.kmer == b.kmer && (a.seq_id < b.seq_id || (a.seq_id == b.seq_id && a.offset < b.offset)));
+}
+
+using KmerRecordBuffers = tbb::enumerable_thread_specific<std::vector<KmerRecord>>;
+
+/*! @brief Partition of key with the given number of leading bits of a key_bits-bit key. */
+inline size_t kmer_partition(uint64_t key, int key_bits, int partition_bits)
+{
+    return static_cast<size_t>(key >> (key_bits - partition_bits));
+}
+
+/*! @brief Partition of key with the given number of leading bits of kmer_hash_mix(key).
+
+  The leading residue of a packed kmer takes only a few values, so this
+  spreads kmers over the partitions far more evenly than kmer_partition().
+*/
+inline size_t kmer_hash_partition(uint64_t key, int partition_bits)
+{
+    return partition_bits == 0 ? 0 : static_cast<size_t>(kmer_hash_mix(key) >> (64 - partition_bits));
+}
+
+/*! @brief Sort the records in buffers by kmer into a single vector.
+
+  partition_start receives 2^partition_bits + 1 offsets; partition p holds
+  records [partition_start[p], partition_start[p + 1]). The buffers are
+  emptied.
+*/
+inline std::vector<KmerRecord> sort_kmer_records(KmerRecordBuffers &buffers, int key_bits, int partition_bits,
+						 std::vector<size_t> &partition_start)
+{
+    partition_bits = std::min(partition_bits, key_bits);
+    size_t n_partitions = size_t(1) << partition_bits;
+
+    std::vector<std::vector<KmerRecord> *> bufs;
+    for (auto &b: buffers)
+	bufs.push_back(&b);
+
+    /*
+     * counts[b][p] becomes the output position of buffer b's first record in partition p.
+     */
+    std::vector<std::vector<size_t>> counts(bufs.size(), std::vector<size_t>(n_partitions, 0));
+    tbb::parallel_for(size_t(0), bufs.size(), [&](size_t b) {
+	for (auto &r: *bufs[b])
+	    counts[b][kmer_partition(r.kmer, key_bits, partition_bits)]++;
+    });
+
+    partition_start.assign(n_partitions + 1, 0);
+    size_t pos = 0;
+    for (size_t p = 0; p < n_partitions; p++)
+    {
+	partition_start[p] = pos;
+	for (size_t b = 0; b < bufs.size(); b++)
+	{
+	    size_t n = counts[b][p];
+	    counts[b][p] = pos;
+	    pos += n;
+	}
+    }
+    partition_start[n_partitions] = pos;
+
+    std::vector<KmerRecord> sorted(pos);
+    tbb::parallel_for(size_t(0), bufs.size(), [&](size_t b) {
+	std::vector<size_t> &next = counts[b];
+	for (auto &r: *bufs[b])
+	    sorted[next[kmer_partition(r.kmer, key_bits, partition_bits)]++] = r;
+	std::vector<KmerRecord>().swap(*bufs[b]);
+    });
+
+    tbb::parallel_for(size_t(0), n_partitions, [&](size_t p) {
+	std::sort(sorted.begin() + partition_start[p], sorted.begin() + partition_start[p + 1], kmer_record_less);
+    });
+
+    return sorted;
+}
+
+#endif // _kmer_record_sort_h
@@ -0,0 +1,193 @@
+#include "kmer_spill.h"
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+/*! Partition of kmer among 2^bits, from the hash bits following the first skip_bits. */
+static size_t hash_partition(uint64_t kmer, int skip_bits, int bits)
+{
+    return static_cast<size_t>((kmer_hash_mix(kmer) << skip_bits) >> (64 - bits));
+}
+
+/*! Most hash bits that select a partition; the records of one kmer cannot be split further anyway. */
+static const int MaxHashBits = 32;
+
+/*! Most bits one split_partition() adds, bounding its write buffers. */
+static const int MaxSplitBits = 8;
+
+KmerSpillFiles::KmerSpillFiles(const fs::path &spill_dir, int partition_bits)
+    : partition_bits_(std::max(1, std::min(partition_bits, MaxHashBits)))
+{
+    dir_ = spill_dir / fs::unique_path("kmer-spill-%%%%-%%%%-%%%%");
+    fs::create_directories(dir_);
+
+    size_t n = size_t(1) << partition_bits_;
+    partitions_.reserve(n);
+    for (size_t p = 0; p < n; p++)
+    {
+	partitions_.emplace_back(std::make_unique<Partition>());
+	partitions_.back()->path = dir_ / ("part." + std::to_string(p));
+	partitions_.back()->hash_bits = partition_bits_;
+    }
+}
+
+KmerSpillFiles::~KmerSpillFiles()
+{
+    boost::system::error_code ec;
+    fs::remove_all(dir_, ec);
+    if (ec)
+	std::cerr << "cannot remove spill directory " << dir_ << ": " << ec.message() << "\n";
+}
+
+void KmerSpillFiles::append(Partition &part, const KmerRecord *begin, const KmerRecord *end)
+{
+    if (begin == end)
+	return;
+    std::lock_guard<std::mutex> guard(part.lock);
+    if (!part.out.is_open())
+    {
+	part.out.open(part.path, std::ios::binary);
+	if (!part.out)
+	    throw std::runtime_error("cannot create spill file " + part.path.string());
+    }
+    size_t n = end - begin;
+    part.out.write(reinterpret_cast<const char *>(begin), n * sizeof(KmerRecord));
+    if (!part.out)
+	throw std::runtime_error("error writing spill file " + part.path.string());
+    part.n_records += n;
+}
+
+/*!
+  The records are ordered by partition in place rather than bucketed into
+  a second buffer, so a spill needs no memory beyond the buffer itself.
+*/
+void KmerSpillFiles::spill(std::vector<KmerRecord> &records)
+{
+    int bits = partition_bits_;
+    std::sort(records.begin(), records.end(), [bits](const KmerRecord &a, const KmerRecord &b) {
+	return hash_partition(a.kmer, 0, bits) < hash_partition(b.kmer, 0, bits);
+    });
+
+    auto run_start = records.begin();
+    while (run_start != records.end())
+    {
+	size_t p = hash_partition(run_start->kmer, 0, bits);
+	auto run_end = std::find_if(run_start, records.end(), [bits, p](const KmerRecord &r) {
+	    return hash_partition(r.kmer, 0, bits) != p;
+	});
+	append(*partitions_[p], &*run_start, &*run_start + (run_end - run_start));
+	run_start = run_end;
+    }
+    records.clear();
+}
+
+/*!
+  The partition is streamed through a fixed buffer, so splitting needs
+  no more memory than the buffer.
+*/
+std::vector<size_t> KmerSpillFiles::split_partition(size_t p, uint64_t max_records)
+{
+    Partition &part = *partitions_[p];
+    int skip = part.hash_bits;
+    int bits = 1;
+    while (bits < MaxSplitBits && skip + bits < MaxHashBits && (part.n_records >> bits) > max_records)
+	bits++;
+    if (skip + bits > MaxHashBits)
+	return { p };
+
+    std::vector<size_t> parts;
+    for (size_t i = 0; i < (size_t(1) << bits); i++)
+    {
+	parts.push_back(partitions_.size());
+	partitions_.emplace_back(std::make_unique<Partition>());
+	partitions_.back()->path = dir_ / ("part." + std::to_string(parts.back()));
+	partitions_.back()->hash_bits = skip + bits;
+    }
+
+    fs::ifstream in(part.path, std::ios::binary);
+    std::vector<KmerRecord> buf(1 << 16);
+    std::vector<std::vector<KmerRecord>> out(parts.size());
+    uint64_t left = part.n_records;
+    while (left > 0)
+    {
+	size_t n = std::min<uint64_t>(left, buf.size());
+	in.read(reinterpret_cast<char *>(buf.data()), n * sizeof(KmerRecord));
+	if (!in)
+	    throw std::runtime_error("error reading spill file " + part.path.string());
+	left -= n;
+	for (size_t i = 0; i < n; i++)
+	{
+	    size_t sub = hash_partition(buf[i].kmer, skip, bits);
+	    out[sub].push_back(buf[i]);
+	    if (out[sub].size() == buf.size() / 16)
+	    {
+		append(*partitions_[parts[sub]], out[sub].data(), out[sub].data() + out[sub].size());
+		out[sub].clear();
+	    }
+	}
+    }
+    for (size_t sub = 0; sub < parts.size(); sub++)
+    {
+	Partition &sub_part = *partitions_[parts[sub]];
+	append(sub_part, out[sub].data(), out[sub].data() + out[sub].size());
+	if (sub_part.out.is_open())
+	{
+	    sub_part.out.close();
+	    if (!sub_part.out)
+		throw std::runtime_error("error writing spill file " + sub_part.path.string());
+	}
+    }
+    in.close();
+    fs::remove(part.path);
+    part.n_records = 0;
+    return parts;
+}
+
+void KmerSpillFiles::finish()
+{
+    for (auto &part: partitions_)
+    {
+	if (part->out.is_open())
+	{
+	    part->out.close();
+	    if (!part->out)
+		throw std::runtime_error("error writing spill file " + part->path.string());
+	}
+    }
+}
+
+std::vector<KmerRecord> KmerSpillFiles::read_partition(size_t p)
+{
+    Partition &part = *partitions_[p];
+    std::vector<KmerRecord> records(part.n_records);
+    if (part.n_records == 0)
+	return records;
+
+    fs::ifstream in(part.path, std::ios::binary);
+    in.read(reinterpret_cast<char *>(records.data()), records.size() * sizeof(KmerRecord));
+    if (!in || static_cast<size_t>(in.gcount()) != records.size() * sizeof(KmerRecord))
+	throw std::runtime_error("error reading spill file " + part.path.string());
+    in.close();
+    fs::remove(part.path);
+
+    std::sort(records.begin(), records.end(), kmer_record_less);
+    return records;
+}
+
+uint64_t KmerSpillFiles::records_spilled() const
+{
+    uint64_t n = 0;
+    for (auto &part: partitions_)
+	n += part->n_records;
+    return n;
+}
+
+uint64_t KmerSpillFiles::largest_partition() const
+{
+    uint64_t n = 0;
+    for (auto &part: partitions_)
+	n = std::max(n, part->n_records);
+    return n;
+}
@@ -0,0 +1,93 @@
+#ifndef _kmer_spill_h
+#define _kmer_spill_h
+
+/*!
+  @file kmer_spill.h
+  @brief Disk spill files for an out-of-core signature build.
+
+  When the kmer occurrences of a collection do not fit in memory, each
+  thread's KmerRecord buffer is spilled to disk whenever it reaches its
+  share of the memory budget. A spilled buffer is split by the leading
+  partition_bits bits of kmer_hash_mix() of the kmer, and each run is
+  appended to the file for that partition. Hashing spreads the records
+  evenly over the partitions; the leading bits of the packed kmers
+  themselves are heavily skewed and with residue codes 1..20 most prefixes
+  never occur.
+
+  Once extraction is complete each partition file is read back, sorted
+  and grouped on its own; a kmer's occurrences are all in one partition.
+  A partition is read whole, so before reading back split_partition()
+  re-splits any partition larger than a thread's share of the budget on
+  further hash bits; with one partition in memory per thread the
+  read-back stays within the budget. A single kmer's occurrences cannot
+  be split, so a kmer with more occurrences than the share can exceed it.
+  The files are created in a private directory under the spill
+  directory and removed with it.
+*/
+
+#include "kmer_record_sort.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace fs = boost::filesystem;
+
+class KmerSpillFiles
+{
+public:
+    KmerSpillFiles(const fs::path &spill_dir, int partition_bits);
+    ~KmerSpillFiles();
+
+    KmerSpillFiles(const KmerSpillFiles &) = delete;
+    KmerSpillFiles &operator=(const KmerSpillFiles &) = delete;
+
+    /*! Sort records and append them to the partition files, then empty records.
+      May be called concurrently.
+    */
+    void spill(std::vector<KmerRecord> &records);
+
+    /*! Close the partition files; no more records may be spilled. */
+    void finish();
+
+    size_t n_partitions() const { return partitions_.size(); }
+
+    uint64_t partition_records(size_t p) const { return partitions_[p]->n_records; }
+
+    /*! Move the records of partition p into new partitions of at most about
+      max_records records each, split on the following hash bits, and return
+      their numbers. Partition p is left empty. Must not be called
+      concurrently with read_partition().
+    */
+    std::vector<size_t> split_partition(size_t p, uint64_t max_records);
+
+    /*! Read partition p, sorted by kmer, and remove its file. */
+    std::vector<KmerRecord> read_partition(size_t p);
+
+    uint64_t records_spilled() const;
+    uint64_t largest_partition() const;
+
+    const fs::path &directory() const { return dir_; }
+
+private:
+    struct Partition
+    {
+	fs::path path;
+	std::mutex lock;
+	fs::ofstream out;
+	uint64_t n_records = 0;
+	int hash_bits = 0;   /* leading hash bits that select this partition */
+    };
+
+    void append(Partition &part, const KmerRecord *begin, const KmerRecord *end);
+
+    fs::path dir_;
+    int partition_bits_;
+    std::vector<std::unique_ptr<Partition>> partitions_;
+};
+
+#endif // _kmer_spill_h
@@ -0,0 +1,247 @@
+#ifndef _kmer_statistics_h
+#define _kmer_statistics_h
+
+/*!
+  @file kmer_statistics.h
+  @brief Signature build statistics without shared hot spots.
+
+  The statistics are updated for every kept kmer and every sequence, so
+  they are kept where threads do not contend: counts indexed by function
+  are per-thread arrays combined when read, and the set of sequences
+  with a signature is a bitmap updated with atomic or.
+
+  Sequence ids are file_number * max_seqs_per_file plus the sequence's
+  number within its file. init_sequences() lays out the bitmap from the
+  number of sequences in each file, so it has one bit per sequence
+  rather than one per possible id. The function of each sequence is
+  recorded when it is first marked, so that save() can write the covered
+  sequences with their functions and load() can merge the coverage of
+  several builders, each sequence counted once.
+*/
+
+#include "kmer_data.h"
+
+#include <tbb/combinable.h>
+
+#include <atomic>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+class KmerStatistics
+{
+public:
+    KmerStatistics() : max_seqs_per_file_(1), n_bits_(0), n_words_(0) {}
+
+    /*! Size the sequence bitmap; file_sequences[i] is the number of sequence ids used by file i. */
+    void init_sequences(const std::vector<uint32_t> &file_sequences, unsigned max_seqs_per_file) {
+	max_seqs_per_file_ = max_seqs_per_file;
+	file_base_.resize(file_sequences.size());
+	uint64_t n = 0;
+	for (size_t i = 0; i < file_sequences.size(); i++)
+	{
+	    file_base_[i] = n;
+	    n += file_sequences[i];
+	}
+	init_bitmap(n);
+    }
+
+    /*! Count a sequence with a kept function. */
+    void add_sequence(FunctionIndex func) {
+	increment(seqs_with_func_.local(), func);
+    }
+
+    /*! Count a kept kmer. */
+    void add_signature(FunctionIndex func) {
+	distinct_signatures_.local()++;
+	increment(distinct_functions_.local(), func);
+    }
+
+    /*! Mark a sequence, with function func, as containing a kept kmer.
+      Returns true if it was not marked before.
+    */
+    bool add_signature_sequence(unsigned int seq_id, FunctionIndex func) {
+	if (!seqs_with_a_signature_)
+	    return false;
+	uint64_t bit = file_base_[seq_id / max_seqs_per_file_] + seq_id % max_seqs_per_file_;
+	uint64_t mask = uint64_t(1) << (bit % 64);
+	if ((seqs_with_a_signature_[bit / 64].fetch_or(mask, std::memory_order_relaxed) & mask) != 0)
+	    return false;
+	seq_functions_[bit] = func;
+	increment(covered_seqs_with_func_.local(), func);
+	return true;
+    }
+
+    uint64_t distinct_signatures() const {
+	return distinct_signatures_.combine([](uint64_t a, uint64_t b) { return a + b; });
+    }
+
+    /*! Number of kept kmers by function index. */
+    std::vector<uint64_t> distinct_functions() const { return combine(distinct_functions_); }
+
+    /*! Number of sequences by function index. */
+    std::vector<uint64_t> seqs_with_func() const { return combine(seqs_with_func_); }
+
+    /*! Number of sequences containing a kept kmer by function index. */
+    std::vector<uint64_t> covered_seqs_with_func() const { return combine(covered_seqs_with_func_); }
+
+    /*! Whether init_sequences() was called, so sequences with a signature were recorded. */
+    bool has_sequence_coverage() const { return static_cast<bool>(seqs_with_a_signature_); }
+
+    uint64_t seqs_with_a_signature() const {
+	uint64_t n = 0;
+	for (size_t i = 0; i < n_words_; i++)
+	    n += __builtin_popcountll(seqs_with_a_signature_[i].load(std::memory_order_relaxed));
+	return n;
+    }
+
+    /*! Write the sequence counts and the covered sequences with their functions. */
+    void save(std::ostream &out) const {
+	write_counts(out, seqs_with_func());
+	uint64_t n_files = has_sequence_coverage() ? file_base_.size() : 0;
+	write_value(out, n_files);
+	if (n_files == 0)
+	    return;
+	write_value(out, uint64_t(max_seqs_per_file_));
+	write_value(out, uint64_t(n_bits_));
+	for (uint64_t base: file_base_)
+	    write_value(out, base);
+	write_value(out, seqs_with_a_signature());
+	for (size_t w = 0; w < n_words_; w++)
+	{
+	    uint64_t word = seqs_with_a_signature_[w].load(std::memory_order_relaxed);
+	    for (; word; word &= word - 1)
+	    {
+		uint64_t bit = w * 64 + __builtin_ctzll(word);
+		write_value(out, bit);
+		write_value(out, uint64_t(seq_functions_[bit]));
+	    }
+	}
+    }
+
+    /*! Merge statistics written by save().
+
+      The sequence counts cover all of a build's sequences whichever
+      builder saved them, so they are taken only if this builder has none.
+      Returns false if in holds no statistics, as after a kept kmers file
+      from an older build.
+    */
+    bool load(std::istream &in) {
+	Counts seqs;
+	if (!read_counts(in, seqs))
+	    return false;
+	if (seqs_with_func().empty())
+	    seqs_with_func_.local() = seqs;
+
+	uint64_t n_files = read_saved(in);
+	if (n_files == 0)
+	    return true;
+	uint64_t max_seqs = read_saved(in);
+	uint64_t n_bits = read_saved(in);
+	std::vector<uint64_t> file_base(n_files);
+	for (auto &base: file_base)
+	    base = read_saved(in);
+	if (!has_sequence_coverage())
+	{
+	    max_seqs_per_file_ = static_cast<unsigned>(max_seqs);
+	    file_base_ = file_base;
+	    init_bitmap(n_bits);
+	}
+	else if (file_base != file_base_ || max_seqs != max_seqs_per_file_ || n_bits != n_bits_)
+	    throw std::runtime_error("saved sequence statistics do not match this build's sequences");
+
+	uint64_t n_covered = read_saved(in);
+	Counts &covered = covered_seqs_with_func_.local();
+	for (uint64_t i = 0; i < n_covered; i++)
+	{
+	    uint64_t bit = read_saved(in);
+	    FunctionIndex func = static_cast<FunctionIndex>(read_saved(in));
+	    if (bit >= n_bits_)
+		throw std::runtime_error("invalid sequence in saved sequence statistics");
+	    uint64_t mask = uint64_t(1) << (bit % 64);
+	    if ((seqs_with_a_signature_[bit / 64].fetch_or(mask, std::memory_order_relaxed) & mask) != 0)
+		continue;
+	    seq_functions_[bit] = func;
+	    increment(covered, func);
+	}
+	return true;
+    }
+
+private:
+    using Counts = std::vector<uint64_t>;
+
+    void init_bitmap(uint64_t n) {
+	n_bits_ = n;
+	n_words_ = (n + 63) / 64;
+	seqs_with_a_signature_ = std::make_unique<std::atomic<uint64_t>[]>(n_words_);
+	for (size_t i = 0; i < n_words_; i++)
+	    seqs_with_a_signature_[i].store(0, std::memory_order_relaxed);
+	seq_functions_ = std::make_unique<FunctionIndex[]>(n);
+    }
+
+    static void write_value(std::ostream &out, uint64_t v) {
+	out.write(reinterpret_cast<const char *>(&v), sizeof(v));
+    }
+
+    static bool read_value(std::istream &in, uint64_t &v) {
+	return static_cast<bool>(in.read(reinterpret_cast<char *>(&v), sizeof(v)));
+    }
+
+    static void write_counts(std::ostream &out, const Counts &counts) {
+	write_value(out, counts.size());
+	for (uint64_t c: counts)
+	    write_value(out, c);
+    }
+
+    static uint64_t read_saved(std::istream &in) {
+	uint64_t v;
+	if (!read_value(in, v))
+	    throw std::runtime_error("truncated sequence statistics");
+	return v;
+    }
+
+    /*! Read counts written by write_counts(); false if in is at its end. */
+    static bool read_counts(std::istream &in, Counts &counts) {
+	uint64_t n;
+	if (!read_value(in, n))
+	    return false;
+	counts.resize(n);
+	for (auto &c: counts)
+	    c = read_saved(in);
+	return true;
+    }
+
+    static void increment(Counts &counts, FunctionIndex func) {
+	if (func >= counts.size())
+	    counts.resize(size_t(func) + 1);
+	counts[func]++;
+    }
+
+    static Counts combine(tbb::combinable<Counts> &c) {
+	Counts total;
+	c.combine_each([&total](const Counts &counts) {
+	    if (counts.size() > total.size())
+		total.resize(counts.size());
+	    for (size_t i = 0; i < counts.size(); i++)
+		total[i] += counts[i];
+	});
+	return total;
+    }
+
+    mutable tbb::combinable<uint64_t> distinct_signatures_;
+    mutable tbb::combinable<Counts> distinct_functions_;
+    mutable tbb::combinable<Counts> seqs_with_func_;
+    mutable tbb::combinable<Counts> covered_seqs_with_func_;
+
+    unsigned max_seqs_per_file_;
+    std::vector<uint64_t> file_base_;
+    std::unique_ptr<std::atomic<uint64_t>[]> seqs_with_a_signature_;
+    std::unique_ptr<FunctionIndex[]> seq_functions_;
+    uint64_t n_bits_;
+    size_t n_words_;
+};
+
+#endif // _kmer_statistics_h
@@ -0,0 +1,245 @@
+#ifndef _kmer_summary_h
+#define _kmer_summary_h
+
+/*!
+  @file kmer_summary.h
+  @brief Fixed-size running summary of the occurrences of a kmer.
+
+  The online signature build folds each kmer occurrence into a
+  KmerSummary instead of storing it, so memory scales with the number of
+  distinct kmers rather than with the number of occurrences.
+
+  The summary keeps what SignatureBuilder::process_kmer_set needs:
+
+  - the exact occurrence count;
+  - a Misra-Gries histogram of functions with OnlineFunctionSlots slots.
+    The counts are exact for a kmer seen with at most that many distinct
+    functions. Beyond that a function's count may be underestimated by
+    at most (count - best count) / OnlineFunctionSlots;
+  - for each function slot, the running mean and variance of the
+    protein length (exact up to float rounding) and a P-square median
+    estimate, which is the estimator the exact mode uses;
+  - a P-square estimate of the median offset from the end of the
+    protein. It is exact for kmers seen at most five times.
+
+  The error in the kept kmers is one-sided. Counts are never
+  overestimated and the occurrence count is exact, so a kmer kept here
+  is kept by the exact modes, with the same function. But a kmer whose
+  best function is just above the 80% threshold and which has a tail of
+  more than OnlineFunctionSlots - 1 other functions can be rejected
+  here and kept by the exact modes. On a synthetic set with heavy kmer
+  sharing, 745 fewer kmers were kept than by the exact modes, out of
+  233,551, all of them such rejections. The length statistics of
+  a kept kmer cover only the occurrences counted for its function. They
+  miss any that arrived while the other functions held every slot, and
+  any from before its slot was freed. tst-kmer-summary pins the
+  difference from the exact selection.
+
+  The P-square estimates depend on the order in which occurrences
+  arrive, which in either mode depends on thread scheduling.
+*/
+
+#include "kmer_data.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+
+/*! @brief P-square median estimator (Jain and Chlamtac, 1985).
+
+  Follows the boost::accumulators p_square_quantile implementation used
+  by the exact build. The sample count is kept by the caller and passed
+  in, and the desired marker positions are computed from it, so the
+  estimator is 32 bytes.
+*/
+class P2Median
+{
+public:
+    P2Median() : heights_{}, positions_{ 2, 3, 4 } {}
+
+    /*! Add sample x, the n'th sample. */
+    void add(float x, uint32_t n) {
+	if (n <= 5)
+	{
+	    heights_[n - 1] = x;
+	    if (n == 5)
+		std::sort(heights_, heights_ + 5);
+	    return;
+	}
+
+	int cell;
+	if (x < heights_[0])
+	{
+	    heights_[0] = x;
+	    cell = 1;
+	}
+	else if (heights_[4] <= x)
+	{
+	    heights_[4] = x;
+	    cell = 4;
+	}
+	else
+	    cell = static_cast<int>(std::upper_bound(heights_, heights_ + 5, x) - heights_);
+
+	for (int i = cell; i < 4; i++)
+	    positions_[i - 1]++;
+
+	float pos[5] = { 1.0f, float(positions_[0]), float(positions_[1]), float(positions_[2]), float(n) };
+	for (int i = 1; i <= 3; i++)
+	{
+	    float d = desired_position(i, n) - pos[i];
+	    float dp = pos[i + 1] - pos[i];
+	    float dm = pos[i - 1] - pos[i];
+	    float hp = (heights_[i + 1] - heights_[i]) / dp;
+	    float hm = (heights_[i - 1] - heights_[i]) / dm;
+
+	    if ((d >= 1.0f && dp > 1.0f) || (d <= -1.0f && dm < -1.0f))
+	    {
+		float sign_d = d > 0.0f ? 1.0f : -1.0f;
+		float h = heights_[i] + sign_d / (dp - dm) * ((sign_d - dm) * hp + (dp - sign_d) * hm);
+		if (heights_[i - 1] < h && h < heights_[i + 1])
+		    heights_[i] = h;
+		else if (d > 0.0f)
+		    heights_[i] += hp;
+		else
+		    heights_[i] -= hm;
+		pos[i] += sign_d;
+		positions_[i - 1] = static_cast<uint32_t>(pos[i]);
+	    }
+	}
+    }
+
+    /*! The estimate as the exact build reports it; like boost, the third
+      sample before five samples have been seen.
+    */
+    float estimate() const { return heights_[2]; }
+
+    /*! The upper median of n samples: exact for n <= 5, else the estimate. */
+    float upper_median(uint32_t n) const {
+	if (n > 5)
+	    return heights_[2];
+	float s[5];
+	std::copy(heights_, heights_ + n, s);
+	std::sort(s, s + n);
+	return s[n / 2];
+    }
+
+private:
+    static float desired_position(int i, uint32_t n) {
+	static const float initial[5] = { 1.0f, 2.0f, 3.0f, 4.0f, 5.0f };
+	static const float increment[5] = { 0.0f, 0.25f, 0.5f, 0.75f, 1.0f };
+	return initial[i] + float(n - 5) * increment[i];
+    }
+
+    float heights_[5];
+    uint32_t positions_[3];
+};
+
+/*! @brief Occurrence count and protein length statistics for one function of a kmer. */
+struct FunctionSlot
+{
+    FunctionIndex func_index = UndefinedFunction;
+    uint32_t count = 0;
+    uint32_t n_lengths = 0;
+    float length_mean = 0.0f;
+    float length_m2 = 0.0f;
+    P2Median length_median;
+
+    void add_length(unsigned short len) {
+	n_lengths++;
+	float delta = float(len) - length_mean;
+	length_mean += delta / float(n_lengths);
+	length_m2 += delta * (float(len) - length_mean);
+	length_median.add(float(len), n_lengths);
+    }
+
+    float length_variance() const { return n_lengths ? length_m2 / float(n_lengths) : 0.0f; }
+};
+
+const int OnlineFunctionSlots = 3;
+
+/*! @brief Running summary of all occurrences of a kmer.
+
+  The first function slot is held inline; the others are allocated when
+  a kmer is first seen with a second function, which most kmers never are.
+*/
+class KmerSummary
+{
+public:
+    void add(FunctionIndex func, unsigned short offset, unsigned short protein_length) {
+	count_++;
+	offsets_.add(float(offset), count_);
+
+	FunctionSlot *slot = find_slot(func);
+	if (slot)
+	{
+	    slot->count++;
+	    slot->add_length(protein_length);
+	    return;
+	}
+
+	/*
+	 * No free slot: Misra-Gries decrement. The occurrence is not
+	 * counted for any function and slots reaching zero are freed.
+	 */
+	for (int i = 0; i < OnlineFunctionSlots; i++)
+	{
+	    FunctionSlot &s = this->slot(i);
+	    if (--s.count == 0)
+		s = FunctionSlot();
+	}
+    }
+
+    uint32_t count() const { return count_; }
+
+    /*! The slot with the highest count; ties go to the lowest function index. */
+    const FunctionSlot *best() const {
+	const FunctionSlot *b = nullptr;
+	for (int i = 0; i < (more_ ? OnlineFunctionSlots : 1); i++)
+	{
+	    const FunctionSlot &s = i == 0 ? first_ : more_[i - 1];
+	    if (s.count > 0 && (!b || s.count > b->count || (s.count == b->count && s.func_index < b->func_index)))
+		b = &s;
+	}
+	return b;
+    }
+
+    unsigned short median_offset() const {
+	return static_cast<unsigned short>(offsets_.upper_median(count_));
+    }
+
+private:
+    FunctionSlot &slot(int i) {
+	if (i == 0)
+	    return first_;
+	if (!more_)
+	    more_ = std::make_unique<FunctionSlot[]>(OnlineFunctionSlots - 1);
+	return more_[i - 1];
+    }
+
+    /*! The slot holding func, or a free slot assigned to it; null if none is free. */
+    FunctionSlot *find_slot(FunctionIndex func) {
+	FunctionSlot *free_slot = nullptr;
+	for (int i = 0; i < OnlineFunctionSlots; i++)
+	{
+	    if (i > 0 && !more_ && first_.func_index == UndefinedFunction)
+		break;
+	    FunctionSlot &s = slot(i);
+	    if (s.func_index == func)
+		return &s;
+	    if (!free_slot && s.count == 0)
+		free_slot = &s;
+	}
+	if (free_slot)
+	    free_slot->func_index = func;
+	return free_slot;
+    }
+
+    uint32_t count_ = 0;
+    P2Median offsets_;
+    FunctionSlot first_;
+    std::unique_ptr<FunctionSlot[]> more_;
+};
+
+#endif // _kmer_summary_h
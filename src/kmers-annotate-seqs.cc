@@ -1,7 +1,11 @@
 #include "nudb_kmer_db.h"
 #include "cmph_kmer.h"
+#include "direct_kmer_db.h"
 #include "call_functions.h"
 #include "fasta_parser.h"
+#include "kmer_dispatch.h"
+#include "kmer_db_metadata.h"
+#include "kseq_cache.h"
 #include "path_utils.h"
 
 #include <tbb/global_control.h>
@@ -36,6 +40,7 @@ struct program_parameters
     fs::path sequences_dir;
     fs::path calls_file;
     fs::path uncalled_ids_file;
+    fs::path seq_cache;
     bool ignore_hypo = false;
     int n_threads = 1;
 };
@@ -53,6 +58,7 @@ void process_options(int argc, char **argv, program_parameters &params)
 	("calls-file", po::value<fs::path>(&params.calls_file), "Output calls file")
 	("uncalled-ids-file", po::value<fs::path>(&params.uncalled_ids_file), "Output uncalled IDs file")
 	("parallel,j", po::value<int>(&params.n_threads), "Number of threads")
+	("seq-cache", po::value<fs::path>(&params.seq_cache), "Read the input through this sequence cache (.kseq); it is created or updated if it is not current")
 	("ignore-hypo", po::bool_switch(&params.ignore_hypo), "Ignore hypothetical protein kmers when making calls")
 	("help,h", "show this help message");
 
@@ -76,17 +82,11 @@ void process_options(int argc, char **argv, program_parameters &params)
     }
 }
 
-int main(int argc, char **argv)
+template <int K, typename Alphabet, typename DbType>
+void run(program_parameters &params)
 {
-    program_parameters params;
-    process_options(argc, argv, params);
-
-    tbb::global_control global_limit(tbb::global_control::max_allowed_parallelism, params.n_threads);
-
     auto db_base = params.data_dir / "kmer_data";
 
-    using DbType = CmphKmerDb<StoredKmerData, 8>;
-
     DbType kdb(db_base);
 
     if (!kdb.exists())
@@ -98,22 +98,31 @@ int main(int argc, char **argv)
     FunctionCaller<DbType> caller(kdb, params.data_dir / "function.index");
     caller.ignore_hypothetical(params.ignore_hypo);
 
-    auto hit_cb = [](const std::string &id, const Kmer<8> &kmer, size_t offset, double seqlen, const StoredKmerData &kd) {
+    auto hit_cb = [](std::string_view id, const Kmer<K, Alphabet> &kmer, size_t offset, double seqlen, const StoredKmerData &kd) {
     };
 
     fs::ofstream anno_out(params.calls_file);
 
-    using shared_buf_t = std::shared_ptr<boost::asio::streambuf>;
+    /*
+     * Calls for each piece of the input are formatted into their own buffer;
+     * an empty buffer marks the end of the output.
+     */
+    struct output_buf
+    {
+	boost::asio::streambuf buf;
+	std::ostream str{&buf};
+    };
+    using shared_buf_t = std::shared_ptr<output_buf>;
     tbb::concurrent_bounded_queue<shared_buf_t> output_queue;
     output_queue.set_capacity(100);
     std::thread writer_thread([&output_queue, &anno_out]{
-	shared_buf_t buf;
+	shared_buf_t out;
 	while (true)
 	{
-	    output_queue.pop(buf);
-	    if (buf->size() == 0)
+	    output_queue.pop(out);
+	    if (out->buf.size() == 0)
 		break;
-	    anno_out << buf;
+	    anno_out << &out->buf;
 	}
     });
 
@@ -123,40 +132,37 @@ int main(int argc, char **argv)
 
     tbb::concurrent_vector<fs::path> ivec;
     populate_path_list(params.sequences_dir, ivec);
+
+    std::unique_ptr<KseqCache> seq_cache;
+    if (!params.seq_cache.empty())
+    {
+	seq_cache = std::make_unique<KseqCache>(params.seq_cache, std::vector<fs::path>(ivec.begin(), ivec.end()));
+	caller.set_sequence_cache(seq_cache.get());
+    }
     
-    tbb::parallel_for(ivec.range(), [&caller, &output_queue, &db_base, &params, &hit_cb, &uncalled_ids](auto inp)
+    auto seq_cb = [&caller, &hit_cb, &uncalled_ids](output_buf &out, std::string_view id, std::string_view seq)
     {
-	for (auto input_path: inp)
-	{
-	    fs::ifstream ifstr(input_path);
-	    shared_buf_t buf = std::make_shared<boost::asio::streambuf>();
-	    
-	    std::ostream bufstr(buf.get());
-	    
-	    auto call2_cb = [&bufstr, &uncalled_ids](const std::string &id, const std::string &func, FunctionIndex func_index, float score, size_t seq_len)
-		{
-		    if (func_index == UndefinedFunction)
-		    {
-			uncalled_ids.push_back(id);
-		    }
-		    else
-		    {
-			bufstr << id << "\t" << func << "\t" << func_index << "\t" << score << "\n";
-		    }
-		};
-	    
-	    caller.process_fasta_stream(ifstr, hit_cb, call2_cb);
-	    
-	    ifstr.close();
-	    if (buf->size() > 0)
+	auto call_cb = [&out, &uncalled_ids](std::string_view id, const std::string &func, FunctionIndex func_index, float score, size_t seq_len) {
+	    if (func_index == UndefinedFunction)
 	    {
-		output_queue.push(buf);
+		uncalled_ids.push_back(std::string(id));
 	    }
-	}
-    });
+	    else
+	    {
+		out.str << id << "\t" << func << "\t" << func_index << "\t" << score << "\n";
+	    }
+	};
+	caller.process_sequence(id, seq, hit_cb, call_cb);
+    };
+    auto output_cb = [&output_queue](shared_buf_t out)
+    {
+	if (out->buf.size() > 0)
+	    output_queue.push(out);
+    };
 
-    shared_buf_t buf = std::make_shared<boost::asio::streambuf>();
-    output_queue.push(buf);
+    caller.template process_fasta_files_chunked<output_buf>(ivec, seq_cb, output_cb);
+
+    output_queue.push(std::make_shared<output_buf>());
 
     writer_thread.join();
 
@@ -167,3 +173,28 @@ int main(int argc, char **argv)
     }
 }
 
+int main(int argc, char **argv)
+{
+    program_parameters params;
+    process_options(argc, argv, params);
+
+    tbb::global_control global_limit(tbb::global_control::max_allowed_parallelism, params.n_threads);
+
+    KmerDbMetadata meta;
+    try {
+	meta.read(params.data_dir);
+    }
+    catch (std::exception &x)
+    {
+	std::cerr << x.what() << "\n";
+	return 1;
+    }
+
+    dispatch_kmer_encoding(meta.kmer_size, meta.alphabet, [&params](auto kc, auto alphabet) {
+	constexpr int K = decltype(kc)::value;
+	using Alphabet = decltype(alphabet);
+	dispatch_kmer_db<StoredKmerData, K, Alphabet>(params.data_dir / "kmer_data", [&params](auto db) {
+	    run<K, Alphabet, typename decltype(db)::type>(params);
+	});
+    });
+}
@@ -1,36 +1,72 @@
 #include "signature_build.h"
 #include "path_utils.h"
-#include "kept_kmer_db.h"
 #include "call_functions.h"
 #include "nudb_kmer_db.h"
 #include "perfect_hash.h"
 #include "cmph_kmer.h"
+#include "direct_kmer_db.h"
+#include "frozen_kmer_db.h"
+#include "kmer_dispatch.h"
+#include "kmer_db_metadata.h"
+#include "kseq_cache.h"
+#include "build_checkpoint.h"
+#include "build_stats.h"
 
 #include <boost/program_options.hpp>
 
 #include <tbb/global_control.h>
 #include <tbb/concurrent_map.h>
 
+#include <chrono>
+#include <csignal>
+#include <thread>
+
 namespace po = boost::program_options;
 namespace fs = boost::filesystem;
 
-const int K = 8;
 const int MaxSequencesPerFile = 100000;
-static bool process_command_line_options(int argc, char *argv[],
-					 std::vector<fs::path> &function_definitions,
-					 std::vector<fs::path> &fasta_data,
-					 std::vector<fs::path> &fasta_data_kept_functions,
-					 std::vector<std::string> &good_functions,
-					 std::vector<std::string> &good_roles,
-					 fs::path &deleted_fids_file,
-					 fs::path &ignored_functions_file,
-					 int &min_reps_required,
-					 fs::path &kmer_data_dir,
-					 fs::path &final_kmers,
-					 std::string &nudb_file,
-					 fs::path &perfect_hash,
-					 fs::path &perfect_hash_data,
-					 int &n_threads)
+
+struct build_parameters
+{
+    std::vector<fs::path> function_definitions;
+    std::vector<fs::path> fasta_data;
+    std::vector<fs::path> fasta_data_kept_functions;
+    std::vector<std::string> good_functions;
+    std::vector<std::string> good_roles;
+    fs::path deleted_fids_file;
+    fs::path ignored_functions_file;
+    int min_reps_required = 3;
+    fs::path kmer_data_dir;
+    fs::path final_kmers;
+    std::string nudb_file;
+    fs::path perfect_hash_file;
+    fs::path perfect_hash_data_file;
+    fs::path seq_cache;
+    bool single_pass = false;
+    bool direct_table = false;
+    bool no_frozen_table = false;
+    bool bucket_report = false;
+    int kmer_size = DefaultKmerSize;
+    std::string alphabet = ProteinAlphabet::name;
+    std::string aggregation = "multimap";
+    fs::path spill_dir;
+    fs::path contribution_dir;
+    int shard_index = 0;
+    int shard_count = 0;
+    fs::path shard_dir;
+    std::string shard_phase = "all";
+    int shard_timeout = 0;
+    std::string shard_run_id;
+    fs::path checkpoint_dir;
+    bool resume = false;
+    bool numa = false;
+    bool dedup_sequences = false;
+    fs::path stats_json;
+    size_t memory_budget = 4096;
+    int n_threads = 1;
+};
+
+static bool process_command_line_options(int argc, char *argv[], build_parameters &params)
 {
     std::ostringstream x;
     x << "Usage: " << argv[0] << " [options]\nAllowed options";
@@ -42,23 +78,43 @@ static bool process_command_line_options(int argc, char *argv[],
     std::vector<std::string> good_function_files;
     std::vector<std::string> good_role_files;
 
-    n_threads = 1;
-
     desc.add_options()
 	("definition-dir,D", po::value<std::vector<std::string>>(&definition_dirs)->multitoken(), "Directory of function definition files")
 	("fasta-dir,F", po::value<std::vector<std::string>>(&fasta_dirs)->multitoken(), "Directory of fasta files of protein data")
 	("fasta-keep-functions-dir,K", po::value<std::vector<std::string>>(&fasta_keep_dirs), "Directory of fasta files of protein data (keep functions defined here)")
 	("good-functions", po::value<std::vector<std::string>>(&good_function_files), "File containing list of functions to be kept")
 	("good-roles", po::value<std::vector<std::string>>(&good_role_files), "File containing list of roles to be kept")
-	("deleted-features-file", po::value<fs::path>(&deleted_fids_file), "File containing list of deleted feature IDs")
-	("ignored-functions-file", po::value<fs::path>(&ignored_functions_file), "File containing list of functions for which we do not create signatures")
-	("kmer-data-dir", po::value<fs::path>(&kmer_data_dir), "Write kmer data files to this directory")
-	("nudb-file", po::value<std::string>(&nudb_file), "Write saved kmers to this NuDB file base. Should be on a SSD drive.")
-	("min-reps-required", po::value<int>(&min_reps_required), "Minimum number of genomes a function must be seen in to be considered for kmers")
-	("final-kmers", po::value<fs::path>(&final_kmers), "Write final.kmers file to be consistent with km_build_Data")
-	("n-threads", po::value<int>(&n_threads), "Number of threads to use")
-	("perfect-hash", po::value<fs::path>(&perfect_hash), "Compute perfect hash of signature kmers and store in this file")
-	("perfect-hash-data", po::value<fs::path>(&perfect_hash_data), "Kmer data stored by perfect hash")
+	("deleted-features-file", po::value<fs::path>(&params.deleted_fids_file), "File containing list of deleted feature IDs")
+	("ignored-functions-file", po::value<fs::path>(&params.ignored_functions_file), "File containing list of functions for which we do not create signatures")
+	("kmer-data-dir", po::value<fs::path>(&params.kmer_data_dir), "Write kmer data files to this directory")
+	("nudb-file", po::value<std::string>(&params.nudb_file), "Write saved kmers to this NuDB file base. Should be on a SSD drive.")
+	("min-reps-required", po::value<int>(&params.min_reps_required), "Minimum number of genomes a function must be seen in to be considered for kmers")
+	("final-kmers", po::value<fs::path>(&params.final_kmers), "Write final.kmers file to be consistent with km_build_Data")
+	("n-threads", po::value<int>(&params.n_threads), "Number of threads to use")
+	("kmer-size", po::value<int>(&params.kmer_size), "Kmer size (default 8)")
+	("alphabet", po::value<std::string>(&params.alphabet), "Residue alphabet for kmers: protein (default), murphy10 or murphy15")
+	("aggregation", po::value<std::string>(&params.aggregation), "How kmer occurrences are grouped: multimap (default), sort (packed per-thread records and a parallel sort; uses much less memory) spill (as sort, but records beyond --memory-budget are spilled to disk partitions), online (a running summary per distinct kmer; approximate length and offset medians, and a kmer with more than 3 functions may be rejected when the exact modes keep it, never the reverse) or incremental (reuse the per-file kmer contributions of the last build; only changed files are extracted)")
+	("contribution-dir", po::value<fs::path>(&params.contribution_dir), "Contribution store for --aggregation incremental (default contributions in the kmer data directory)")
+	("shard-count", po::value<int>(&params.shard_count), "Run as one of this many cooperating build processes sharing --shard-dir")
+	("shard-index", po::value<int>(&params.shard_index), "Index of this process, from 0 to shard-count - 1")
+	("shard-dir", po::value<fs::path>(&params.shard_dir), "Directory on a filesystem shared by all shards")
+	("shard-phase", po::value<std::string>(&params.shard_phase), "Sharded build phase to run: extract, aggregate, merge or all (default; the phases are synchronized through --shard-dir and shard 0 merges)")
+	("shard-timeout", po::value<int>(&params.shard_timeout), "Minutes to wait for the other shards to finish a phase before failing (default 0, no limit)")
+	("shard-run-id", po::value<std::string>(&params.shard_run_id), "Identifier shared by the shards of one build; the phase markers of other builds left in --shard-dir are ignored. Without it a shard refuses to start if any shard's phase marker is present, so all shards must start before any finishes extracting")
+	("spill-dir", po::value<fs::path>(&params.spill_dir), "Directory for spill files with --aggregation spill (default the kmer data directory); should be on local SSD")
+	("memory-budget", po::value<size_t>(&params.memory_budget), "Memory in MB for buffered kmer records with --aggregation spill (default 4096)")
+	("dedup-sequences", po::bool_switch(&params.dedup_sequences), "Extract the kmers of identical proteins with the same function once, weighted by the number of copies (not used with online or incremental aggregation)")
+	("numa", po::bool_switch(&params.numa), "Split kmer aggregation by kmer hash across the NUMA nodes, each in a task arena on its node (uses --aggregation sort)")
+	("perfect-hash", po::value<fs::path>(&params.perfect_hash_file), "Compute perfect hash of signature kmers and store in this file")
+	("perfect-hash-data", po::value<fs::path>(&params.perfect_hash_data_file), "Kmer data stored by perfect hash")
+	("seq-cache", po::value<fs::path>(&params.seq_cache), "Read the fasta data through this sequence cache (.kseq); it is created or updated if it is not current")
+	("single-pass", po::bool_switch(&params.single_pass), "Parse each fasta file once, into a scratch sequence cache in --spill-dir or the kmer data directory that is removed at the end; needs disk space for the uncompressed sequences")
+	("checkpoint-dir", po::value<fs::path>(&params.checkpoint_dir), "Save the build state in this directory at each phase boundary (implies --aggregation incremental)")
+	("resume", po::bool_switch(&params.resume), "Resume the build checkpointed in --checkpoint-dir if its inputs are unchanged")
+	("direct-table", po::bool_switch(&params.direct_table), "Write a direct-addressed kmer table (kmer_data.direct) to the kmer data directory; requires a small kmer key space")
+	("no-frozen-table", po::bool_switch(&params.no_frozen_table), "Do not write the frozen kmer table (kmer_data.frozen) to the kmer data directory, or without one next to the perfect hash, NuDB or final kmers file; recall then runs against the table in memory")
+	("bucket-report", po::bool_switch(&params.bucket_report), "Report hash bucket occupancy of the kmer tables")
+	("stats-json", po::value<fs::path>(&params.stats_json), "Write wall and CPU time, peak memory, throughput and container sizes for each build phase to this JSON file")
 	("help,h", "show this help message");
 
     po::variables_map vm;
@@ -76,9 +132,9 @@ static bool process_command_line_options(int argc, char *argv[],
     /*
      * Read definition and fasta dirs to populate the path lists.
      */
-    populate_path_list(definition_dirs, function_definitions);
-    populate_path_list(fasta_dirs, fasta_data);
-    populate_path_list(fasta_keep_dirs, fasta_data_kept_functions);
+    populate_path_list(definition_dirs, params.function_definitions);
+    populate_path_list(fasta_dirs, params.fasta_data);
+    populate_path_list(fasta_keep_dirs, params.fasta_data_kept_functions);
 
     std::cout << "definitions: ";
     for (auto x: definition_dirs)
@@ -93,15 +149,16 @@ static bool process_command_line_options(int argc, char *argv[],
 	std::cout << x << " ";
     std::cout << std::endl;
 
-    load_strings(good_function_files, good_functions);
-    load_strings(good_role_files, good_roles);
+    load_strings(good_function_files, params.good_functions);
+    load_strings(good_role_files, params.good_roles);
 
     return true;
 }
 
-void write_nudb_data(const std::string &nudb_file, const KeptKmers<8> &kmers)
+template <int K, typename Alphabet>
+void write_nudb_data(const std::string &nudb_file, const KeptKmers<K, Alphabet> &kmers)
 {
-    typedef NuDBKmerDb<StoredKmerData, 8> KDB;
+    typedef NuDBKmerDb<StoredKmerData, K, Alphabet> KDB;
 
     KDB db(nudb_file);
 
@@ -122,67 +179,450 @@ void write_nudb_data(const std::string &nudb_file, const KeptKmers<8> &kmers)
     }
 }
 
+/*!
+  Write the kept kmers into a direct-addressed table at file_base.direct.
+  The table is written under a temporary name and renamed into place, so
+  the calling tools never find a partial table.
+ */
+template <int K, typename Alphabet>
+void write_direct_data(const fs::path &file_base, const KeptKmers<K, Alphabet> &kmers)
+{
+    using DB = DirectKmerDb<StoredKmerData, K, Alphabet>;
+    fs::path tmp_base = file_base.native() + ".tmp";
+    {
+	DB db(tmp_base);
 
-int main(int argc, char *argv[])
+	std::cerr << "write direct table " << db.n_entries << " entries\n";
+	db.create_backing_data();
+	db.open_for_writing();
+
+	tbb::parallel_for(kmers.range(), [&db](auto r) {
+	    for (auto ent = r.begin(); ent != r.end(); ent++)
+	    {
+		int ec;
+		db.insert(ent->first, ent->second.stored_data, ec);
+	    }
+	});
+    }
+    fs::rename(DB::data_path(tmp_base), DB::data_path(file_base));
+    std::cerr << "write direct table complete\n";
+}
+
+/*!
+  Digest of everything that determines the function assignments and
+  kept kmers of a build, for validating a checkpoint.
+*/
+static uint64_t build_input_digest(const build_parameters &params)
 {
-    std::vector<fs::path> function_definitions;
-    std::vector<fs::path> fasta_data;
-    std::vector<fs::path> fasta_data_kept_functions;
+    InputDigest d;
+    d.add(uint64_t(params.kmer_size));
+    d.add(params.alphabet);
+    d.add(uint64_t(params.min_reps_required));
+    d.add(uint64_t(MaxSequencesPerFile));
+    for (auto *files: { &params.function_definitions, &params.fasta_data, &params.fasta_data_kept_functions })
+    {
+	d.add(uint64_t(files->size()));
+	for (auto &f: *files)
+	    d.add_file(f);
+    }
+    for (auto *strings: { &params.good_functions, &params.good_roles })
+    {
+	d.add(uint64_t(strings->size()));
+	for (auto &str: *strings)
+	    d.add(str);
+    }
+    d.add_file(params.deleted_fids_file);
+    d.add_file(params.ignored_functions_file);
+    return d.value();
+}
 
-    std::vector<std::string> good_functions;
-    std::vector<std::string> good_roles;
+/*!
+  The phase markers of a shard are named <phase>.<shard>[.<run>].done and
+  .failed, so the markers of a build with a different --shard-run-id are
+  never mistaken for this build's.
+*/
+static fs::path shard_marker_path(const fs::path &shard_dir, const std::string &phase, int shard, const std::string &run,
+				  const char *suffix)
+{
+    return shard_dir / (phase + "." + std::to_string(shard) + (run.empty() ? "" : "." + run) + suffix);
+}
 
-    fs::path final_kmers;
-    fs::path deleted_fids_file;
-    fs::path kmer_data_dir;
-    fs::path ignored_functions_file;
+static fs::path shard_marker(const fs::path &shard_dir, const std::string &phase, int shard, const std::string &run)
+{
+    return shard_marker_path(shard_dir, phase, shard, run, ".done");
+}
 
-    int min_reps_required = 3;
-    
-    int n_threads;
+static fs::path shard_failure_marker(const fs::path &shard_dir, const std::string &phase, int shard, const std::string &run)
+{
+    return shard_marker_path(shard_dir, phase, shard, run, ".failed");
+}
 
-    std::string nudb_file;
-    fs::path perfect_hash_file;
-    fs::path perfect_hash_data_file;
+static const char *ShardPhases[] = { "extract", "aggregate" };
 
-    if (!process_command_line_options(argc, argv,
-				      function_definitions,
-				      fasta_data,
-				      fasta_data_kept_functions,
-				      good_functions,
-				      good_roles,
-				      deleted_fids_file,
-				      ignored_functions_file,
-				      min_reps_required,
-				      kmer_data_dir,
-				      final_kmers,
-				      nudb_file,
-				      perfect_hash_file,
-				      perfect_hash_data_file,
-				      n_threads))
+static void mark_shard_phase(const fs::path &shard_dir, const std::string &phase, int shard, const std::string &run)
+{
+    fs::ofstream marker(shard_marker(shard_dir, phase, shard, run));
+}
+
+/*! Record in the shard directory that shard failed in phase, so the shards waiting for it fail too. */
+static void mark_shard_failed(const fs::path &shard_dir, const std::string &phase, int shard, const std::string &run,
+			      const std::string &what)
+{
+    fs::ofstream marker(shard_failure_marker(shard_dir, phase, shard, run));
+    marker << what << "\n";
+}
+
+/*!
+  Wait until every shard has finished phase, polling for the marker
+  files in the shared shard directory. Throws if a shard has marked
+  itself failed, or if timeout_minutes (when positive) pass first.
+*/
+static void wait_for_shards(const fs::path &shard_dir, const std::string &phase, int shard_count, const std::string &run,
+			    int timeout_minutes)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int s = 0; s < shard_count; s++)
     {
-	return 1;
+	if (!fs::exists(shard_marker(shard_dir, phase, s, run)))
+	    std::cerr << "waiting for shard " << s << " to finish " << phase << "\n";
+	while (!fs::exists(shard_marker(shard_dir, phase, s, run)))
+	{
+	    for (auto failed_phase: ShardPhases)
+	    {
+		if (fs::exists(shard_failure_marker(shard_dir, failed_phase, s, run)))
+		    throw std::runtime_error("shard " + std::to_string(s) + " failed in " + failed_phase);
+	    }
+	    if (timeout_minutes > 0 && std::chrono::steady_clock::now() - start > std::chrono::minutes(timeout_minutes))
+		throw std::runtime_error("timed out waiting for shard " + std::to_string(s) + " to finish " + phase);
+	    std::this_thread::sleep_for(std::chrono::seconds(2));
+	}
+    }
+}
+
+/*!
+  Run this process's phases of a sharded build:
+
+  - extract: write the contributions of this shard's files to the shared
+    contribution store;
+  - aggregate: when all shards have extracted, process this shard's kmer
+    partitions and write its kept kmers to kept.<shard>;
+  - merge: when all shards have aggregated, load every shard's kept kmers
+    in shard order and remove the stale contributions from the store.
+
+  A shard that fails in a phase leaves a <phase>.<shard>[.<run>].failed
+  marker, on which the shards waiting for it fail in turn.
+
+  Returns true if this process merged and should write the outputs.
+*/
+template <int K, typename Alphabet>
+bool run_shard_phases(SignatureBuilder<K, Alphabet> &builder, const build_parameters &params,
+		      const std::set<std::string, std::less<>> &deleted_fids)
+{
+    const fs::path &dir = params.shard_dir;
+    const std::string &phase = params.shard_phase;
+    int shard = params.shard_index;
+    int timeout = params.shard_timeout;
+    const std::string &run = params.shard_run_id;
+
+    std::string running = "extract";
+    try
+    {
+	if (phase == "extract" || phase == "all")
+	{
+	    for (auto p: ShardPhases)
+		fs::remove(shard_failure_marker(dir, p, shard, run));
+	    std::cerr << "shard " << shard << ": extract kmers\n";
+	    builder.extract_kmers(deleted_fids);
+	    mark_shard_phase(dir, "extract", shard, run);
+	}
+	running = "aggregate";
+	if (phase == "aggregate" || phase == "all")
+	{
+	    fs::remove(shard_failure_marker(dir, "aggregate", shard, run));
+	    wait_for_shards(dir, "extract", params.shard_count, run, timeout);
+	    std::cerr << "shard " << shard << ": process kmers\n";
+	    builder.load_contributions();
+	    builder.process_kmers();
+	    builder.write_kept_kmers(dir / ("kept." + std::to_string(shard)));
+	    mark_shard_phase(dir, "aggregate", shard, run);
+	}
+    }
+    catch (const std::exception &e)
+    {
+	mark_shard_failed(dir, running, shard, run, e.what());
+	throw;
     }
 
+    if (phase == "merge" || (phase == "all" && shard == 0))
+    {
+	wait_for_shards(dir, "aggregate", params.shard_count, run, timeout);
+	std::cerr << "merge " << params.shard_count << " shards\n";
+	for (int s = 0; s < params.shard_count; s++)
+	    builder.read_kept_kmers(dir / ("kept." + std::to_string(s)));
+	builder.remove_stale_contributions();
+	for (int s = 0; s < params.shard_count; s++)
+	{
+	    fs::remove(shard_marker(dir, "extract", s, run));
+	    fs::remove(shard_marker(dir, "aggregate", s, run));
+	}
+	std::cout << "Kept " << builder.kept_kmers().size() << " kmers\n";
+	return true;
+    }
+    return false;
+}
+
+template <int K, typename Alphabet>
+int run_build(build_parameters &params)
+{
+    fs::path &kmer_data_dir = params.kmer_data_dir;
+    fs::path &final_kmers = params.final_kmers;
+    fs::path &perfect_hash_file = params.perfect_hash_file;
+    fs::path &perfect_hash_data_file = params.perfect_hash_data_file;
+    int n_threads = params.n_threads;
+
+    /*
+     * SIGUSR1 prints the build's progress; this must precede starting any threads.
+     */
+    BuildStats stats;
+    stats.watch_signal(SIGUSR1);
+    auto write_stats = [&stats, &params]() {
+	if (!params.stats_json.empty())
+	    stats.write_json(params.stats_json);
+    };
+
     tbb::global_control global_limit(tbb::global_control::max_allowed_parallelism, n_threads);
 
-    SignatureBuilder<K> builder(n_threads, MaxSequencesPerFile);
+    if (params.direct_table && !DirectKmerDb<StoredKmerData, K, Alphabet>::supported())
+    {
+	std::cerr << "Kmer size " << K << " with alphabet " << Alphabet::name << " is too large for a direct table\n";
+	return 1;
+    }
+
+    SignatureBuilder<K, Alphabet> builder(n_threads, MaxSequencesPerFile);
+    stats.watch_counter("files_extracted", builder.extract_progress().files);
+    stats.watch_counter("sequences_extracted", builder.extract_progress().sequences);
+    stats.watch_counter("kmers_extracted", builder.extract_progress().kmers);
+
+    /*
+     * A sharded build is an incremental build whose contribution store
+     * is shared by the shards. Every shard derives the same function
+     * index from the same inputs; the merging shard writes it.
+     */
+    bool sharded = params.shard_count > 0;
+    bool merging = !sharded || params.shard_phase == "merge" || (params.shard_phase == "all" && params.shard_index == 0);
+    if (sharded)
+    {
+	if (params.shard_index < 0 || params.shard_index >= params.shard_count || params.shard_dir.empty())
+	{
+	    std::cerr << "A sharded build requires --shard-dir and --shard-index between 0 and shard-count - 1\n";
+	    return 1;
+	}
+	if (params.shard_phase != "all" && params.shard_phase != "extract" &&
+	    params.shard_phase != "aggregate" && params.shard_phase != "merge")
+	{
+	    std::cerr << "Unknown shard phase " << params.shard_phase << "\n";
+	    return 1;
+	}
+	if (params.shard_run_id.find('/') != std::string::npos)
+	{
+	    std::cerr << "A shard run id may not contain '/'\n";
+	    return 1;
+	}
+	fs::create_directories(params.shard_dir);
+
+	/*
+	 * A done marker left by an unfinished build would let the other
+	 * shards go ahead on that build's results. Without a run id a
+	 * marker of any shard may be such a leftover; with one, only this
+	 * shard's own marker shows the id was used before. On refusing,
+	 * mark this shard failed so the shards already running stop
+	 * waiting for it.
+	 */
+	if (params.shard_phase == "all" || params.shard_phase == "extract")
+	{
+	    const std::string &run = params.shard_run_id;
+	    std::vector<fs::path> stale;
+	    for (int s = 0; s < params.shard_count; s++)
+	    {
+		if (!run.empty() && s != params.shard_index)
+		    continue;
+		for (auto p: ShardPhases)
+		    if (fs::exists(shard_marker(params.shard_dir, p, s, run)))
+			stale.push_back(shard_marker(params.shard_dir, p, s, run));
+	    }
+	    if (!stale.empty())
+	    {
+		std::cerr << "Shard directory " << params.shard_dir << " holds markers of an unfinished build, such as "
+			  << stale.front() << "; remove the *.done and *.failed files or give a new --shard-run-id\n";
+		mark_shard_failed(params.shard_dir, "extract", params.shard_index, run, "stale markers in the shard directory");
+		return 1;
+	    }
+	}
+	params.aggregation = "incremental";
+	if (params.contribution_dir.empty())
+	    params.contribution_dir = params.shard_dir / "contributions";
+	builder.set_shard(params.shard_index, params.shard_count);
+    }
+
+    /*
+     * Checkpointed extraction goes through the contribution store, which
+     * saves each file's kmers as the file completes.
+     */
+    std::unique_ptr<BuildCheckpoint> checkpoint;
+    BuildPhase resume_after = BuildPhase::None;
+    if (!params.checkpoint_dir.empty())
+    {
+	if (sharded)
+	{
+	    std::cerr << "Checkpoints are not supported in a sharded build\n";
+	    return 1;
+	}
+	checkpoint = std::make_unique<BuildCheckpoint>(params.checkpoint_dir, build_input_digest(params), params.resume);
+	resume_after = checkpoint->completed();
+	if (params.aggregation != "incremental" && params.aggregation != "multimap")
+	    std::cerr << "Using incremental aggregation for a checkpointed build\n";
+	params.aggregation = "incremental";
+	if (params.contribution_dir.empty())
+	    params.contribution_dir = params.checkpoint_dir / "contributions";
+    }
+
+    if (params.numa)
+    {
+	if (params.aggregation == "multimap")
+	    params.aggregation = "sort";
+	else if (params.aggregation != "sort")
+	    std::cerr << "--numa is only used with sort aggregation; ignored\n";
+    }
+
+    if (params.aggregation == "sort")
+    {
+	if (params.numa)
+	    builder.set_numa();
+	else
+	    builder.set_aggregation(KmerAggregation::Sort);
+    }
+    else if (params.aggregation == "incremental")
+    {
+	fs::path dir = params.contribution_dir;
+	if (dir.empty())
+	{
+	    if (kmer_data_dir.empty())
+	    {
+		std::cerr << "Incremental aggregation requires --contribution-dir or --kmer-data-dir\n";
+		return 1;
+	    }
+	    dir = kmer_data_dir / "contributions";
+	}
+	builder.set_contribution_store(dir);
+    }
+    else if (params.aggregation == "online")
+	builder.set_aggregation(KmerAggregation::Online);
+    else if (params.aggregation == "spill")
+    {
+	fs::path spill_dir = params.spill_dir.empty() ? kmer_data_dir : params.spill_dir;
+	if (spill_dir.empty())
+	    spill_dir = fs::temp_directory_path();
+	builder.set_spill(spill_dir, params.memory_budget << 20);
+    }
+    else if (params.aggregation != "multimap")
+    {
+	std::cerr << "Unknown aggregation " << params.aggregation << "\n";
+	return 1;
+    }
+
+    if (params.dedup_sequences)
+    {
+	if (params.aggregation == "online" || params.aggregation == "incremental")
+	    std::cerr << "--dedup-sequences is not used with " << params.aggregation << " aggregation; ignored\n";
+	else
+	    builder.set_dedup(true);
+    }
+
+    /*
+     * The fasta data is read three times (function map, kmer extraction and
+     * recall); with a sequence cache it is parsed at most once. With
+     * --single-pass the cache is a scratch file written by reading each
+     * source once, without the checksum pass of a persistent cache.
+     */
+    std::unique_ptr<KseqCache> seq_cache;
+    if (!params.seq_cache.empty() || params.single_pass)
+    {
+	auto ingest_phase = stats.phase("ingest");
+	std::vector<fs::path> sources(params.fasta_data);
+	sources.insert(sources.end(), params.fasta_data_kept_functions.begin(), params.fasta_data_kept_functions.end());
+	if (!params.seq_cache.empty())
+	{
+	    if (params.single_pass)
+		std::cerr << "--single-pass is not used with --seq-cache; ignored\n";
+	    seq_cache = std::make_unique<KseqCache>(params.seq_cache, sources);
+	}
+	else
+	{
+	    fs::path dir = params.spill_dir.empty() ? kmer_data_dir : params.spill_dir;
+	    if (dir.empty())
+		dir = fs::temp_directory_path();
+	    ensure_directory(dir);
+	    std::string name = sharded ? "ingest." + std::to_string(params.shard_index) + ".kseq" : "ingest.kseq";
+	    seq_cache = std::make_unique<KseqCache>(dir / name, sources, true);
+	}
+	ingest_phase.count("files", seq_cache->size());
+	builder.set_sequence_cache(seq_cache.get());
+    }
 
-    builder.load_function_data(good_functions, good_roles, function_definitions);
+    auto load_phase = stats.phase("load_functions");
+    builder.load_function_data(params.good_functions, params.good_roles, params.function_definitions);
 
-    std::set<std::string> deleted_fids = load_set_from_file(deleted_fids_file);
-    std::set<std::string> ignored_functions = load_set_from_file(ignored_functions_file);
+    std::set<std::string, std::less<>> deleted_fids = load_set_from_file(params.deleted_fids_file);
+    std::set<std::string, std::less<>> ignored_functions = load_set_from_file(params.ignored_functions_file);
 
     ensure_directory(kmer_data_dir);
 
-    std::cerr << "load fasta\n";
-    builder.load_fasta(fasta_data, false, deleted_fids);
-    builder.load_fasta(fasta_data_kept_functions, true, deleted_fids);
+    /*
+     * The calling tools use a kmer table they find in the data directory,
+     * so remove one left by an earlier build that this build will not
+     * replace.
+     */
+    if (merging && !kmer_data_dir.empty())
+    {
+	if (params.no_frozen_table)
+	    fs::remove(FrozenKmerDb<StoredKmerData, K, Alphabet>::data_path(kmer_data_dir / "kmer_data"));
+	if (!params.direct_table)
+	    fs::remove(DirectKmerDb<StoredKmerData, K, Alphabet>::data_path(kmer_data_dir / "kmer_data"));
+    }
+
+    if (resume_after >= BuildPhase::FunctionsLoaded)
+    {
+	std::cerr << "load function assignments from checkpoint\n";
+	builder.load_function_checkpoint(checkpoint->file("functions"));
+	if (!kmer_data_dir.empty())
+	    BuildCheckpoint::copy_file(checkpoint->file("function.index"), kmer_data_dir / "function.index");
+    }
+    else
+    {
+	std::cerr << "load fasta\n";
+	builder.load_fasta(params.fasta_data, false, deleted_fids);
+	builder.load_fasta(params.fasta_data_kept_functions, true, deleted_fids);
+
+	builder.process_kept_functions(params.min_reps_required, merging ? kmer_data_dir : fs::path(), ignored_functions);
 
-    builder.process_kept_functions(min_reps_required, kmer_data_dir, ignored_functions);
+	if (checkpoint)
+	{
+	    builder.save_function_checkpoint(checkpoint->file("functions"));
+	    if (!kmer_data_dir.empty())
+		BuildCheckpoint::copy_file(kmer_data_dir / "function.index", checkpoint->file("function.index"));
+	    checkpoint->complete(BuildPhase::FunctionsLoaded);
+	}
+    }
+    load_phase.count("fasta_files", builder.all_fasta_data().size());
+    load_phase.end();
 
-    if (!kmer_data_dir.empty())
+    if (merging && !kmer_data_dir.empty())
     {
+	KmerDbMetadata meta;
+	meta.kmer_size = K;
+	meta.alphabet = Alphabet::name;
+	meta.write(kmer_data_dir);
+
 	fs::ofstream otu(kmer_data_dir / "otu.index");
 	otu.close();
 	fs::ofstream genomes(kmer_data_dir / "genomes");
@@ -190,10 +630,56 @@ int main(int argc, char *argv[])
 	genomes.close();
     }
 
-    std::cerr << "extract kmers\n";
-    builder.extract_kmers(deleted_fids); 
-    std::cerr << "process kmers\n";
-    builder.process_kmers();
+    if (sharded)
+    {
+	auto shard_phase = stats.phase("shard_" + params.shard_phase);
+	bool merged = run_shard_phases(builder, params, deleted_fids);
+	shard_phase.count("kmers", builder.extract_progress().kmers);
+	shard_phase.size("kept_kmers", builder.kept_kmers().size());
+	shard_phase.end();
+	if (!merged)
+	{
+	    write_stats();
+	    return 0;
+	}
+    }
+    else if (resume_after >= BuildPhase::KmersProcessed)
+    {
+	std::cerr << "load kept kmers from checkpoint\n";
+	auto resume_phase = stats.phase("load_kept_kmers");
+	builder.read_kept_kmers(checkpoint->file("kept_kmers"));
+	resume_phase.size("kept_kmers", builder.kept_kmers().size());
+    }
+    else
+    {
+	std::cerr << "extract kmers\n";
+	auto extract_phase = stats.phase("extract_kmers");
+	builder.extract_kmers(deleted_fids); 
+	if (checkpoint)
+	    checkpoint->complete(BuildPhase::KmersExtracted);
+	const ExtractProgress &progress = builder.extract_progress();
+	extract_phase.count("files", progress.files);
+	extract_phase.count("sequences", progress.sequences);
+	extract_phase.count("kmers", progress.kmers);
+	for (auto &ent: builder.container_sizes())
+	    extract_phase.size(ent.first, ent.second);
+	extract_phase.end();
+
+	std::cerr << "process kmers\n";
+	auto process_phase = stats.phase("process_kmers");
+	builder.process_kmers();
+	if (checkpoint)
+	{
+	    builder.write_kept_kmers(checkpoint->file("kept_kmers"));
+	    checkpoint->complete(BuildPhase::KmersProcessed);
+	}
+	process_phase.count("kmers", progress.kmers);
+	for (auto &ent: builder.container_sizes())
+	    process_phase.size(ent.first, ent.second);
+    }
+
+    if (params.bucket_report)
+	builder.report_bucket_occupancy(std::cerr);
 
     std::thread final_kmers_thread;
     if (!final_kmers.empty())
@@ -203,7 +689,8 @@ int main(int argc, char *argv[])
 	    final_kmers = kmer_data_dir / final_kmers;
 	    std::cerr << "Updated final_kmers to " << final_kmers << "\n";
 	}
-	final_kmers_thread = std::thread([&final_kmers, &builder] {
+	final_kmers_thread = std::thread([&final_kmers, &builder, &stats] {
+	    auto phase = stats.phase("write_final_kmers");
 	    std::cerr << "writing kmers to " << final_kmers << "\n";
 	    fs::ofstream kf(final_kmers);
 	    std::for_each(builder.kept_kmers().begin(), builder.kept_kmers().end(),
@@ -229,16 +716,82 @@ int main(int argc, char *argv[])
 
     {
 	fs::ofstream dfstr(kmer_data_dir / "distinct_functions");
-	for (auto ent: builder.kmer_stats().distinct_functions)
+	std::vector<uint64_t> distinct_functions = builder.kmer_stats().distinct_functions();
+	for (size_t f = 0; f < distinct_functions.size(); f++)
 	{
-	    dfstr << ent.first << "\t" << builder.lookup_function(ent.first) << "\t" << ent.second << "\n";
+	    if (distinct_functions[f] > 0)
+		dfstr << f << "\t" << builder.lookup_function(f) << "\t" << distinct_functions[f] << "\n";
 	}
     }
 
-    KeptKmerDB<K>  kdb(builder.kept_kmers());
+    /*
+     * Write the fraction of each function's sequences that contain a kept
+     * kmer. Online aggregation does not record sequences; a resume and a
+     * sharded merge restore them with the kept kmers.
+     */
+    if (builder.kmer_stats().has_sequence_coverage())
+    {
+	std::vector<uint64_t> seqs_with_func = builder.kmer_stats().seqs_with_func();
+	std::vector<uint64_t> covered = builder.kmer_stats().covered_seqs_with_func();
+	covered.resize(seqs_with_func.size());
+	fs::ofstream cov(kmer_data_dir / "function_coverage");
+	for (size_t f = 0; f < seqs_with_func.size(); f++)
+	{
+	    if (seqs_with_func[f] == 0)
+		continue;
+	    cov << f << "\t" << builder.lookup_function(f) << "\t" << seqs_with_func[f] << "\t" << covered[f]
+		<< "\t" << double(covered[f]) / double(seqs_with_func[f]) << "\n";
+	}
+    }
+
+    /*
+     * Recall runs against the kept kmers frozen into a read-only table.
+     * The table is saved as the database of the calling tools, and recall
+     * reads it back from that file, unless --no-frozen-table is given.
+     * Without a kmer data directory the table goes next to the first of
+     * the other kmer outputs, and with none of them it stays in memory.
+     */
+    fs::path frozen_dir = kmer_data_dir;
+    bool save_frozen = !params.no_frozen_table;
+    if (kmer_data_dir.empty())
+    {
+	if (!perfect_hash_file.empty())
+	    frozen_dir = perfect_hash_file.parent_path();
+	else if (!params.nudb_file.empty())
+	    frozen_dir = fs::path(params.nudb_file).parent_path();
+	else if (!final_kmers.empty())
+	    frozen_dir = final_kmers.parent_path();
+	else
+	    save_frozen = false;
+    }
+    FrozenKmerDb<StoredKmerData, K, Alphabet> kdb(frozen_dir / "kmer_data");
+    {
+	auto freeze_phase = stats.phase("freeze");
+	std::vector<typename FrozenKmerDb<StoredKmerData, K, Alphabet>::Entry> entries;
+	entries.reserve(builder.kept_kmers().size());
+	for (auto &ent: builder.kept_kmers())
+	    entries.emplace_back(ent.first.bits, ent.second.stored_data);
+	kdb.freeze(std::move(entries));
+	std::cerr << "froze " << kdb.size() << " kmers into " << kdb.n_slots() << " slots\n";
+	if (save_frozen)
+	{
+	    kdb.save();
+	    kdb.open();
+	}
+	freeze_phase.count("kmers", kdb.size());
+	freeze_phase.size("frozen_table_bytes", kdb.data_size());
+    }
 
+    /*
+     * A resumed build keeps the recall reports already written for its
+     * kept kmers; otherwise reports of an earlier build must not be
+     * mistaken for completed ones later.
+     */
     fs::path report_dir = kmer_data_dir / "recall.report.d";
-    if (!fs::create_directory(report_dir))
+    bool keep_reports = resume_after >= BuildPhase::KmersProcessed;
+    if (checkpoint && !keep_reports)
+	fs::remove_all(report_dir);
+    if (!fs::create_directory(report_dir) && !keep_reports)
     {
 	std::cerr << "mkdir " << report_dir << " failed\n";
     }
@@ -258,8 +811,18 @@ int main(int argc, char *argv[])
 	if (perfect_hash_data_file.is_relative())
 	    perfect_hash_data_file = kmer_data_dir / perfect_hash_data_file;
 	
-	perfect_hash_thread = std::thread([&builder, &perfect_hash_file, &perfect_hash_data_file]() {
-	    build_perfect_hash<K>(builder, perfect_hash_file, perfect_hash_data_file);
+	perfect_hash_thread = std::thread([&builder, &perfect_hash_file, &perfect_hash_data_file, &stats]() {
+	    auto phase = stats.phase("perfect_hash");
+	    build_perfect_hash<K, Alphabet>(builder, perfect_hash_file, perfect_hash_data_file);
+	});
+    }
+
+    std::thread direct_table_thread;
+    if (params.direct_table)
+    {
+	direct_table_thread = std::thread([&builder, &kmer_data_dir, &stats]() {
+	    auto phase = stats.phase("direct_table");
+	    write_direct_data<K, Alphabet>(kmer_data_dir / "kmer_data", builder.kept_kmers());
 	});
     }
 
@@ -267,7 +830,8 @@ int main(int argc, char *argv[])
      * Begin recall of source data using newly created kmers.
      */
     
-    FunctionCaller<KeptKmerDB<K>> kmer_caller(kdb, fi_file);
+    FunctionCaller<FrozenKmerDb<StoredKmerData, K, Alphabet>> kmer_caller(kdb, fi_file);
+    kmer_caller.set_sequence_cache(seq_cache.get());
 
     struct call_data
     {
@@ -285,31 +849,31 @@ int main(int argc, char *argv[])
 	const FunctionMap &fm;
 	std::map<std::string, call_data> data;
 	
-	void operator()(const std::string &id, const std::string &func, int func_index, float score, size_t seq_len) {
+	void operator()(std::string_view id, const std::string &func, int func_index, float score, size_t seq_len) {
 
 	    std::string orig, orig_stripped;
 	    fm.lookup_original_assignment(id, orig, orig_stripped);
 	    if (orig_stripped != func)
 	    {
-		data.emplace(id, call_data { id, orig, orig_stripped, func, func_index, score});
+		data.emplace(std::string(id), call_data { std::string(id), orig, orig_stripped, func, func_index, score});
 		// std::cout << "CALL "  << id << "\t" << orig_call << "\t" << func << "\t" << func_index << "\t" << score << "\n";
 	    }
 	}
     };
 
-    auto call_cb = [&builder, &recall_report](const std::string &id, const std::string &func, FunctionIndex func_index, float score) {
+    auto call_cb = [&builder, &recall_report](std::string_view id, const std::string &func, FunctionIndex func_index, float score) {
 
 	std::string orig, orig_stripped;
 	builder.function_map().lookup_original_assignment(id, orig, orig_stripped);
 	if (orig_stripped != func)
 	{
-	    recall_report.emplace(id, call_data { id, orig, orig_stripped, func, func_index, score});
+	    recall_report.emplace(std::string(id), call_data { std::string(id), orig, orig_stripped, func, func_index, score});
 	    // std::cout << "CALL "  << id << "\t" << orig << "\t" << func << "\t" << func_index << "\t" << score << "\n";
 	}
 	
     };
 
-    auto hit_cb = [&builder](const std::string &id, const Kmer<8> &kmer, size_t offset, double seqlen, const StoredKmerData &k) {
+    auto hit_cb = [&builder](std::string_view id, const Kmer<K, Alphabet> &kmer, size_t offset, double seqlen, const StoredKmerData &k) {
 
 	if (false)
 	{
@@ -323,35 +887,41 @@ int main(int argc, char *argv[])
     };
 
     std::cerr << "Begin recall\n";
+    auto recall_phase = stats.phase("recall");
 
-    tbb::parallel_for(builder.all_fasta_data().range(), [&report_dir, &builder, &kmer_caller, &hit_cb, &call_cb](auto r) {
+    tbb::parallel_for(builder.all_fasta_data().range(), [&report_dir, &builder, &kmer_caller, &hit_cb, &call_cb, keep_reports](auto r) {
 	for (auto file: r)
 	{
 
-	    fs::path outfile(report_dir / file.filename());
+	    fs::path outfile(report_dir / strip_compression_extension(file).filename());
+	    if (keep_reports && fs::exists(outfile))
+		continue;
+	    fs::path tmpfile = outfile;
+	    tmpfile += ".tmp";
 
 	    saver s { builder.function_map() } ;
 
-	    fs::ifstream ifstr(file);
+	    kmer_caller.process_fasta_file(file, hit_cb, s);
 
-	    kmer_caller.process_fasta_stream(ifstr, hit_cb, s);
-
-	    ifstr.close();
-
-	    fs::ofstream ofstr(outfile);
+	    fs::ofstream ofstr(tmpfile);
 	    for (auto ent: s.data)
 	    {
 		call_data &c = ent.second;
 		ofstr << ent.first << "\t" << c.old_func << "\t" << c.old_func_stripped << "\t" << c.new_func << "\t" << c.func_index << "\t" << c.score << "\n";
 	    }
 	    ofstr.close();
+	    fs::rename(tmpfile, outfile);
 	}
     });
     
-    if (!nudb_file.empty())
+    recall_phase.count("files", builder.all_fasta_data().size());
+    recall_phase.end();
+
+    if (!params.nudb_file.empty())
     {
-	std::cerr << "write nudb data " << nudb_file << "\n";
-	write_nudb_data(nudb_file, builder.kept_kmers());
+	std::cerr << "write nudb data " << params.nudb_file << "\n";
+	auto nudb_phase = stats.phase("nudb");
+	write_nudb_data<K, Alphabet>(params.nudb_file, builder.kept_kmers());
     }
 
     if (perfect_hash_thread.joinable())
@@ -360,14 +930,35 @@ int main(int argc, char *argv[])
 	perfect_hash_thread.join();
     }
 
+    if (direct_table_thread.joinable())
+    {
+	std::cerr << "Awaiting completion of direct table creation\n";
+	direct_table_thread.join();
+    }
+
     if (final_kmers_thread.joinable())
     {
 	std::cerr << "Awaiting completion of final kmers dump\n";
 	final_kmers_thread.join();
     }
 
+    write_stats();
     std::cerr << "all done\n";
 
     return 0;
 
 }
+
+int main(int argc, char *argv[])
+{
+    build_parameters params;
+
+    if (!process_command_line_options(argc, argv, params))
+    {
+	return 1;
+    }
+
+    return dispatch_kmer_encoding(params.kmer_size, params.alphabet, [&params](auto kc, auto alphabet) {
+	return run_build<decltype(kc)::value, decltype(alphabet)>(params);
+    });
+}
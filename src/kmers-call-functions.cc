@@ -1,7 +1,11 @@
 #include "nudb_kmer_db.h"
 #include "cmph_kmer.h"
+#include "direct_kmer_db.h"
 #include "call_functions.h"
 #include "fasta_parser.h"
+#include "kmer_dispatch.h"
+#include "kmer_db_metadata.h"
+#include "kseq_cache.h"
 
 #include <tbb/global_control.h>
 #include <tbb/concurrent_queue.h>
@@ -39,6 +43,8 @@ struct program_parameters
     fs::path output_file;
     std::vector<std::string> fasta_dirs;
     bool debug_hits = false;
+    fs::path seq_cache;
+    bool dna = false;
     bool ignore_hypo = false;
     int n_threads = 1;
 };
@@ -55,6 +61,8 @@ void process_options(int argc, char **argv, program_parameters &params)
 	("output-files,o", po::value<fs::path>(&params.output_file), "Output file")
 //	("fasta-dir,F", po::value<std::vector<std::string>>(&params.fasta_dirs)->multitoken(), "Directory of fasta files of protein data")
 	("n-threads,j", po::value<int>(&params.n_threads), "Number of threads")
+	("seq-cache", po::value<fs::path>(&params.seq_cache), "Read the input through this sequence cache (.kseq); it is created or updated if it is not current")
+	("dna", po::bool_switch(&params.dna), "Input is nucleotide contigs; translate them in six frames and call the proteins between stop codons")
 	("ignore-hypo", po::bool_switch(&params.ignore_hypo), "Ignore hypothetical protein kmers when making calls")
 	("debug-hits", po::bool_switch(&params.debug_hits), "Debug kmer hits")
 	("help,h", "show this help message");
@@ -81,20 +89,12 @@ void process_options(int argc, char **argv, program_parameters &params)
     }
 }
 
-int main(int argc, char **argv)
+template <int K, typename Alphabet, typename DbType>
+void run(program_parameters &params)
 {
-    program_parameters params;
-    process_options(argc, argv, params);
-
-    std::cerr << "Data size " << sizeof(StoredKmerData) << "\n";
-
-    tbb::global_control global_limit(tbb::global_control::max_allowed_parallelism, params.n_threads);
-
     auto db_base = params.data_dir / "kmer_data";
 
-    using DbType = CmphKmerDb<StoredKmerData, 8>;
-
-//    NuDBKmerDb<StoredKmerData, 8> nudb(db_base);
+//    NuDBKmerDb<StoredKmerData, K, Alphabet> nudb(db_base);
     DbType nudb(db_base);
 
     if (!nudb.exists())
@@ -106,24 +106,24 @@ int main(int argc, char **argv)
     FunctionCaller<DbType> caller(nudb, params.data_dir / "function.index");
     caller.ignore_hypothetical(params.ignore_hypo);
 
-    using cbf = std::function<void(const std::string &id, const Kmer<8> &kmer, size_t offset, double seqlen, const StoredKmerData &kd)>;
+    using cbf = std::function<void(std::string_view id, const Kmer<K, Alphabet> &kmer, size_t offset, double seqlen, const StoredKmerData &kd)>;
 
     cbf hit_cb;
     if (params.debug_hits)
     {
-	hit_cb = [&caller](const std::string &id, const Kmer<8> &kmer, size_t offset, double seqlen, const StoredKmerData &kd) {
+	hit_cb = [&caller](std::string_view id, const Kmer<K, Alphabet> &kmer, size_t offset, double seqlen, const StoredKmerData &kd) {
 	    std::cout << kmer << "\t" << offset << "\t" << caller.function_at_index(kd.function_index) << "\t" << kd.median << "\t" << kd.mean << "\t" << kd.var << "\t" << sqrt(kd.var) << "\t" << "\n";
 	};
     }
     else
     {
-	hit_cb = [](const std::string &id, const Kmer<8> &kmer, size_t offset, double seqlen, const StoredKmerData &kd) {};
+	hit_cb = [](std::string_view id, const Kmer<K, Alphabet> &kmer, size_t offset, double seqlen, const StoredKmerData &kd) {};
     }
     
 /*
-    auto hit_cb = [](const std::string &id, const Kmer<8> &kmer, size_t offset, double seqlen, const StoredKmerData &kd) {
+    auto hit_cb = [](const std::string &id, const Kmer<K, Alphabet> &kmer, size_t offset, double seqlen, const StoredKmerData &kd) {
     };
-    auto hit_cb = [&caller, &params](const Kmer<8> &kmer, size_t offset, double seqlen, const StoredKmerData &kd) {
+    auto hit_cb = [&caller, &params](const Kmer<K, Alphabet> &kmer, size_t offset, double seqlen, const StoredKmerData &kd) {
 	if (params.debug_hits)
 	{
 	    std::cout << kmer << "\t" << caller.function_at_index(kd.function_index) << "\t" << kd.median << "\t" << kd.mean << "\t" << kd.var << "\t" << sqrt(kd.var) << "\t" << "\n";
@@ -144,17 +144,26 @@ int main(int argc, char **argv)
     }
     std::ostream anno_out(sbuf);
 
-    using shared_buf_t = std::shared_ptr<boost::asio::streambuf>;
+    /*
+     * Calls for each piece of the input are formatted into their own buffer;
+     * an empty buffer marks the end of the output.
+     */
+    struct output_buf
+    {
+	boost::asio::streambuf buf;
+	std::ostream str{&buf};
+    };
+    using shared_buf_t = std::shared_ptr<output_buf>;
     tbb::concurrent_bounded_queue<shared_buf_t> output_queue;
     output_queue.set_capacity(100);
     std::thread writer_thread([&output_queue, &anno_out]{
-	shared_buf_t buf;
+	shared_buf_t out;
 	while (true)
 	{
-	    output_queue.pop(buf);
-	    if (buf->size() == 0)
+	    output_queue.pop(out);
+	    if (out->buf.size() == 0)
 		break;
-	    anno_out << buf;
+	    anno_out << &out->buf;
 	}
     });
 
@@ -164,34 +173,76 @@ int main(int argc, char **argv)
 //    };
 
     tbb::concurrent_vector<fs::path> ivec(params.input_files.begin(), params.input_files.end());
-    tbb::parallel_for(ivec.range(), [&caller, &output_queue, &db_base, &params, &hit_cb](auto inp)
+
+    std::unique_ptr<KseqCache> seq_cache;
+    if (!params.seq_cache.empty())
     {
-	for (auto input_path: inp)
-	{
-	    fs::ifstream ifstr(input_path);
-	    shared_buf_t buf = std::make_shared<boost::asio::streambuf>();
-	    
-	    std::ostream bufstr(buf.get());
-	    
-	    auto call2_cb = [&bufstr](const std::string &id, const std::string &func, FunctionIndex func_index, float score, size_t seq_size)
-		{
-		    bufstr << id << "\t" << func << "\t" << func_index << "\t" << score << "\n";
-		};
-	    
-	    caller.process_fasta_stream(ifstr, hit_cb, call2_cb);
-	    
-	    ifstr.close();
-	    if (buf->size() > 0)
-	    {
-		output_queue.push(buf);
-	    }
-	}
-    });
+	seq_cache = std::make_unique<KseqCache>(params.seq_cache, params.input_files);
+	caller.set_sequence_cache(seq_cache.get());
+    }
 
+    auto output_cb = [&output_queue](shared_buf_t out)
+    {
+	if (out->buf.size() > 0)
+	    output_queue.push(out);
+    };
 
-    shared_buf_t buf = std::make_shared<boost::asio::streambuf>();
-    output_queue.push(buf);
+    if (params.dna)
+    {
+	/*
+	 * Contig calls are written as id, left, right, strand, function, index, score.
+	 */
+	auto seq_cb = [&caller, &hit_cb](output_buf &out, std::string_view id, std::string_view seq)
+	{
+	    auto region_cb = [&out](std::string_view id, size_t left, size_t right, char strand,
+				    const std::string &func, FunctionIndex func_index, float score) {
+		out.str << id << "\t" << left << "\t" << right << "\t" << strand << "\t" << func << "\t" << func_index << "\t" << score << "\n";
+	    };
+	    caller.process_contig(id, seq, hit_cb, region_cb);
+	};
+	caller.template process_fasta_files_chunked<output_buf>(ivec, seq_cb, output_cb);
+    }
+    else
+    {
+	auto seq_cb = [&caller, &hit_cb](output_buf &out, std::string_view id, std::string_view seq)
+	{
+	    auto call_cb = [&out](std::string_view id, const std::string &func, FunctionIndex func_index, float score, size_t seq_size) {
+		out.str << id << "\t" << func << "\t" << func_index << "\t" << score << "\n";
+	    };
+	    caller.process_sequence(id, seq, hit_cb, call_cb);
+	};
+	caller.template process_fasta_files_chunked<output_buf>(ivec, seq_cb, output_cb);
+    }
+
+    output_queue.push(std::make_shared<output_buf>());
 
     writer_thread.join();
 }
 
+int main(int argc, char **argv)
+{
+    program_parameters params;
+    process_options(argc, argv, params);
+
+    std::cerr << "Data size " << sizeof(StoredKmerData) << "\n";
+
+    tbb::global_control global_limit(tbb::global_control::max_allowed_parallelism, params.n_threads);
+
+    KmerDbMetadata meta;
+    try {
+	meta.read(params.data_dir);
+    }
+    catch (std::exception &x)
+    {
+	std::cerr << x.what() << "\n";
+	return 1;
+    }
+
+    dispatch_kmer_encoding(meta.kmer_size, meta.alphabet, [&params](auto kc, auto alphabet) {
+	constexpr int K = decltype(kc)::value;
+	using Alphabet = decltype(alphabet);
+	dispatch_kmer_db<StoredKmerData, K, Alphabet>(params.data_dir / "kmer_data", [&params](auto db) {
+	    run<K, Alphabet, typename decltype(db)::type>(params);
+	});
+    });
+}
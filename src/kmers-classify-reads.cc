@@ -0,0 +1,246 @@
+#include "cmph_kmer.h"
+#include "direct_kmer_db.h"
+#include "call_functions.h"
+#include "fastq_reader.h"
+#include "kmer_dispatch.h"
+#include "kmer_db_metadata.h"
+#include "tbb_pipeline.h"
+
+#include <tbb/global_control.h>
+#include <tbb/task_arena.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/program_options.hpp>
+
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+/*!
+
+  @mainpage kmers-classify-reads
+
+  # Classify sequencing reads by function using signature kmers
+
+  Reads are streamed from a FASTQ file (or a pair of mate files),
+  translated in six frames and looked up in the signature kmer
+  database. A read, or read pair, is assigned to the function with the
+  most kmer hits. The output is the number of reads assigned to each
+  function; optionally the assignment of each classified read is
+  written as well.
+
+  Reads are processed in batches through a pipeline with a bounded
+  number of batches in flight, so memory use does not depend on the
+  size of the input.
+
+*/
+
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+
+struct program_parameters
+{
+    fs::path data_dir;
+    fs::path reads_file;
+    fs::path mate_file;
+    fs::path output_file;
+    fs::path assignments_file;
+    int min_hits = 2;
+    size_t batch_size = 10000;
+    bool ignore_hypo = false;
+    int n_threads = 1;
+};
+
+void process_options(int argc, char **argv, program_parameters &params)
+{
+    std::ostringstream x;
+    x << "Usage: " << argv[0] << " data-dir reads-file [mate-file]\nAllowed options";
+
+    po::options_description desc(x.str());
+    desc.add_options()
+	("data-dir,d", po::value<fs::path>(&params.data_dir), "Data directory")
+	("reads-file,1", po::value<fs::path>(&params.reads_file), "FASTQ reads file")
+	("mate-file,2", po::value<fs::path>(&params.mate_file), "FASTQ file of mates for a paired library")
+	("output-file,o", po::value<fs::path>(&params.output_file), "Write per-function read counts to this file (default stdout)")
+	("read-assignments", po::value<fs::path>(&params.assignments_file), "Write the function assigned to each classified read to this file")
+	("min-hits", po::value<int>(&params.min_hits), "Minimum kmer hits for the function assigned to a read")
+	("batch-size", po::value<size_t>(&params.batch_size), "Number of reads per processing batch")
+	("n-threads,j", po::value<int>(&params.n_threads), "Number of threads")
+	("ignore-hypo", po::bool_switch(&params.ignore_hypo), "Ignore hypothetical protein kmers when classifying reads")
+	("help,h", "show this help message");
+
+    po::positional_options_description pos;
+    pos.add("data-dir", 1)
+	.add("reads-file", 1)
+	.add("mate-file", 1);
+
+    po::variables_map vm;
+
+    po::store(po::command_line_parser(argc, argv).
+	      options(desc).positional(pos).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+	std::cout << desc << "\n";
+	exit(0);
+    }
+    if (params.reads_file.empty() || params.batch_size == 0)
+    {
+	std::cout << desc << "\n";
+	exit(1);
+    }
+}
+
+template <int K, typename Alphabet, typename DbType>
+void run(program_parameters &params)
+{
+    auto db_base = params.data_dir / "kmer_data";
+
+    DbType kdb(db_base);
+
+    if (!kdb.exists())
+    {
+	std::cerr << "Database " << db_base << " does not exist\n";
+	exit(1);
+    }
+    kdb.open();
+    FunctionCaller<DbType> caller(kdb, params.data_dir / "function.index");
+    caller.ignore_hypothetical(params.ignore_hypo);
+
+    auto hit_cb = [](std::string_view id, const Kmer<K, Alphabet> &kmer, size_t offset, double seqlen, const StoredKmerData &kd) {
+    };
+
+    FastqReader reads(params.reads_file);
+    std::unique_ptr<FastqReader> mates;
+    if (!params.mate_file.empty())
+	mates = std::make_unique<FastqReader>(params.mate_file);
+
+    fs::ofstream assignments;
+    if (!params.assignments_file.empty())
+	assignments.open(params.assignments_file);
+
+    struct Batch
+    {
+	FastqBatch reads;
+	FastqBatch mates;
+	std::vector<std::pair<FunctionIndex, int>> calls;
+	std::map<FunctionIndex, uint64_t> counts;
+    };
+    using BatchPtr = std::shared_ptr<Batch>;
+
+    std::vector<uint64_t> function_counts(caller.function_index().size());
+    uint64_t n_reads = 0, n_classified = 0;
+
+    size_t n_tokens = 2 * tbb::this_task_arena::max_concurrency();
+    tbb::parallel_pipeline(n_tokens,
+			   tbb::make_filter<void, BatchPtr>(TBB_FILTER_MODE::serial_in_order, [&](tbb::flow_control &fc) -> BatchPtr {
+			       auto batch = std::make_shared<Batch>();
+			       if (!reads.read_batch(batch->reads, params.batch_size))
+			       {
+				   if (mates && mates->read_batch(batch->mates, 1))
+				       throw std::runtime_error(params.mate_file.string() + " has more reads than " + params.reads_file.string());
+				   fc.stop();
+				   return BatchPtr();
+			       }
+			       if (mates)
+			       {
+				   mates->read_batch(batch->mates, batch->reads.size());
+				   if (batch->mates.size() != batch->reads.size())
+				       throw std::runtime_error(params.reads_file.string() + " has more reads than " + params.mate_file.string());
+			       }
+			       return batch;
+			   }) &
+			   tbb::make_filter<BatchPtr, BatchPtr>(TBB_FILTER_MODE::parallel, [&caller, &hit_cb, &params](BatchPtr batch) -> BatchPtr {
+			       ReadHits hits;
+			       bool paired = !batch->mates.empty();
+			       batch->calls.resize(batch->reads.size());
+			       for (size_t i = 0; i < batch->reads.size(); i++)
+			       {
+				   hits.clear();
+				   caller.tally_read_hits(batch->reads.id(i), batch->reads.seq(i), hits, hit_cb);
+				   if (paired)
+				       caller.tally_read_hits(batch->mates.id(i), batch->mates.seq(i), hits, hit_cb);
+				   int count;
+				   FunctionIndex fi = hits.best(params.min_hits, count);
+				   batch->calls[i] = std::make_pair(fi, count);
+				   if (fi != UndefinedFunction)
+				       batch->counts[fi]++;
+			       }
+			       return batch;
+			   }) &
+			   tbb::make_filter<BatchPtr, void>(TBB_FILTER_MODE::serial_in_order, [&](BatchPtr batch) {
+			       n_reads += batch->reads.size();
+			       for (auto &ent: batch->counts)
+			       {
+				   if (ent.first < function_counts.size())
+				       function_counts[ent.first] += ent.second;
+				   n_classified += ent.second;
+			       }
+			       if (assignments.is_open())
+			       {
+				   for (size_t i = 0; i < batch->reads.size(); i++)
+				   {
+				       FunctionIndex fi = batch->calls[i].first;
+				       if (fi != UndefinedFunction)
+					   assignments << batch->reads.id(i) << "\t" << fi << "\t" << caller.function_at_index(fi) << "\t" << batch->calls[i].second << "\n";
+				   }
+			       }
+			   }));
+
+    std::streambuf *sbuf;
+    fs::ofstream ofstr;
+    if (params.output_file.empty())
+    {
+	sbuf = std::cout.rdbuf();
+    }
+    else
+    {
+	ofstr.open(params.output_file);
+	sbuf = ofstr.rdbuf();
+    }
+    std::ostream counts_out(sbuf);
+
+    for (size_t fi = 0; fi < function_counts.size(); fi++)
+    {
+	if (function_counts[fi] > 0)
+	    counts_out << fi << "\t" << caller.function_at_index(fi) << "\t" << function_counts[fi] << "\n";
+    }
+
+    std::cerr << "classified " << n_classified << " of " << n_reads << (params.mate_file.empty() ? " reads\n" : " read pairs\n");
+}
+
+int main(int argc, char **argv)
+{
+    program_parameters params;
+    process_options(argc, argv, params);
+
+    tbb::global_control global_limit(tbb::global_control::max_allowed_parallelism, params.n_threads);
+
+    KmerDbMetadata meta;
+    try {
+	meta.read(params.data_dir);
+    }
+    catch (std::exception &x)
+    {
+	std::cerr << x.what() << "\n";
+	return 1;
+    }
+
+    try {
+	dispatch_kmer_encoding(meta.kmer_size, meta.alphabet, [&params](auto kc, auto alphabet) {
+	    constexpr int K = decltype(kc)::value;
+	    using Alphabet = decltype(alphabet);
+	    dispatch_kmer_db<StoredKmerData, K, Alphabet>(params.data_dir / "kmer_data", [&params](auto db) {
+		run<K, Alphabet, typename decltype(db)::type>(params);
+	    });
+	});
+    }
+    catch (std::exception &x)
+    {
+	std::cerr << x.what() << "\n";
+	return 1;
+    }
+    return 0;
+}
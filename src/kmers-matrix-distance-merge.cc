@@ -1,7 +1,10 @@
 #include "nudb_kmer_db.h"
 #include "cmph_kmer.h"
+#include "direct_kmer_db.h"
 #include "call_functions.h"
 #include "fasta_parser.h"
+#include "kmer_dispatch.h"
+#include "kmer_db_metadata.h"
 #include "matrix_distance.h"
 
 #include <tbb/global_control.h>
@@ -87,13 +90,9 @@ void process_options(int argc, char **argv, program_parameters &params)
     }
 }
 
-int main(int argc, char **argv)
+template <int K, typename Alphabet, typename DbType>
+void run(program_parameters &params)
 {
-    program_parameters params;
-    process_options(argc, argv, params);
-
-    tbb::global_control global_limit(tbb::global_control::max_allowed_parallelism, params.n_threads);
-
     auto db_base = params.data_dir / "kmer_data";
 
     if (!fs::is_directory(params.base_dir))
@@ -102,8 +101,6 @@ int main(int argc, char **argv)
 	exit(1);
     }
 
-    using DbType = CmphKmerDb<StoredKmerData, 8>;
-
     DbType nudb(db_base);
 
     if (!nudb.exists())
@@ -166,3 +163,28 @@ int main(int argc, char **argv)
     });
 }
 
+int main(int argc, char **argv)
+{
+    program_parameters params;
+    process_options(argc, argv, params);
+
+    tbb::global_control global_limit(tbb::global_control::max_allowed_parallelism, params.n_threads);
+
+    KmerDbMetadata meta;
+    try {
+	meta.read(params.data_dir);
+    }
+    catch (std::exception &x)
+    {
+	std::cerr << x.what() << "\n";
+	return 1;
+    }
+
+    dispatch_kmer_encoding(meta.kmer_size, meta.alphabet, [&params](auto kc, auto alphabet) {
+	constexpr int K = decltype(kc)::value;
+	using Alphabet = decltype(alphabet);
+	dispatch_kmer_db<StoredKmerData, K, Alphabet>(params.data_dir / "kmer_data", [&params](auto db) {
+	    run<K, Alphabet, typename decltype(db)::type>(params);
+	});
+    });
+}
@@ -1,7 +1,11 @@
 #include "nudb_kmer_db.h"
 #include "cmph_kmer.h"
+#include "direct_kmer_db.h"
 #include "call_functions.h"
 #include "fasta_parser.h"
+#include "kmer_dispatch.h"
+#include "kmer_db_metadata.h"
+#include "kseq_cache.h"
 #include "seq_id_map.h"
 #include "calc_natural_breaks.h"
 
@@ -45,6 +49,7 @@ struct program_parameters
     fs::path data_dir;
     fs::path fasta_file;
     fs::path output_file;
+    fs::path seq_cache;
     int min_hits = 3;
     bool debug_hits = false;
     bool verbose = false;
@@ -61,6 +66,7 @@ void process_options(int argc, char **argv, program_parameters &params)
 	("data-dir,d", po::value<fs::path>(&params.data_dir), "Data directory")
 	("input-file,i", po::value<fs::path>(&params.fasta_file), "Input fasta file")
 	("output-file,o", po::value<fs::path>(&params.output_file), "Output file")
+	("seq-cache", po::value<fs::path>(&params.seq_cache), "Read the input through this sequence cache (.kseq); it is created or updated if it is not current")
 	("min-hits", po::value<int>(&params.min_hits), "Minimum shared kmer hits to emit a match")
 	("n-threads,j", po::value<int>(&params.n_threads), "Number of threads")
 	("debug-hits", po::bool_switch(&params.debug_hits), "Debug kmer hits")
@@ -91,18 +97,12 @@ struct Counter
     size_t count = 0;
 };
 
-int main(int argc, char **argv)
+template <int K, typename Alphabet, typename DbType>
+void run(program_parameters &params)
 {
-    program_parameters params;
-    process_options(argc, argv, params);
-
-    tbb::global_control global_limit(tbb::global_control::max_allowed_parallelism, params.n_threads);
-
     auto db_base = params.data_dir / "kmer_data";
 
-    using DbType = CmphKmerDb<StoredKmerData, 8>;
-
-//    NuDBKmerDb<StoredKmerData, 8> nudb(db_base);
+//    NuDBKmerDb<StoredKmerData, K, Alphabet> nudb(db_base);
     DbType nudb(db_base);
 
     if (!nudb.exists())
@@ -118,9 +118,9 @@ int main(int argc, char **argv)
     /*
      * kmer_hit_map maps from a kmer to the set of IDs containing that kmer
      */
-    tbb::concurrent_unordered_map<Kmer<8>, tbb::concurrent_unordered_set<int>, tbb_hash<8>> kmer_hit_map;
+    tbb::concurrent_unordered_map<Kmer<K, Alphabet>, tbb::concurrent_unordered_set<int>, tbb_hash<K, Alphabet>> kmer_hit_map;
 
-    auto hit_cb = [&kmer_hit_map, &idmap](const std::string &id, const Kmer<8> &kmer, size_t offset, double seqlen, const StoredKmerData &kd) {
+    auto hit_cb = [&kmer_hit_map, &idmap](std::string_view id, const Kmer<K, Alphabet> &kmer, size_t offset, double seqlen, const StoredKmerData &kd) {
 	// std::cerr << id << " " << seqlen << " " << kd << "\n";
 
 
@@ -155,16 +155,19 @@ int main(int argc, char **argv)
 	std::cerr << "Start fasta load\n";
 
     tbb::concurrent_unordered_map<std::string, size_t> prot_sizes;
-    auto call_cb = [&prot_sizes](const std::string &id, const std::string &func, FunctionIndex func_index, float score, size_t prot_len) {
-	prot_sizes.insert(std::make_pair(id, prot_len));
+    auto call_cb = [&prot_sizes](std::string_view id, const std::string &func, FunctionIndex func_index, float score, size_t prot_len) {
+	prot_sizes.insert(std::make_pair(std::string(id), prot_len));
     };
 
-    fs::ifstream ifstr(params.fasta_file);
+    std::unique_ptr<KseqCache> seq_cache;
+    if (!params.seq_cache.empty())
+    {
+	seq_cache = std::make_unique<KseqCache>(params.seq_cache, std::vector<fs::path> { params.fasta_file });
+	caller.set_sequence_cache(seq_cache.get());
+    }
 
     caller.ignore_hypothetical(true);
-    caller.process_fasta_stream_parallel(ifstr, hit_cb, call_cb, idmap);
-	    
-    ifstr.close();
+    caller.process_fasta_file_parallel(params.fasta_file, hit_cb, call_cb, idmap);
 
     std::cerr << "kmer_hit_map size " << kmer_hit_map.size() << "\n";
 
@@ -211,3 +214,28 @@ int main(int argc, char **argv)
     }
 }
 
+int main(int argc, char **argv)
+{
+    program_parameters params;
+    process_options(argc, argv, params);
+
+    tbb::global_control global_limit(tbb::global_control::max_allowed_parallelism, params.n_threads);
+
+    KmerDbMetadata meta;
+    try {
+	meta.read(params.data_dir);
+    }
+    catch (std::exception &x)
+    {
+	std::cerr << x.what() << "\n";
+	return 1;
+    }
+
+    dispatch_kmer_encoding(meta.kmer_size, meta.alphabet, [&params](auto kc, auto alphabet) {
+	constexpr int K = decltype(kc)::value;
+	using Alphabet = decltype(alphabet);
+	dispatch_kmer_db<StoredKmerData, K, Alphabet>(params.data_dir / "kmer_data", [&params](auto db) {
+	    run<K, Alphabet, typename decltype(db)::type>(params);
+	});
+    });
+}
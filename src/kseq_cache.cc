@@ -0,0 +1,267 @@
+#include "kseq_cache.h"
+#include "fasta_parser.h"
+
+#include <zlib.h>
+
+#include "tbb_pipeline.h"
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
+
+#include <boost/filesystem/fstream.hpp>
+
+#include <cstring>
+#include <iostream>
+#include <set>
+#include <stdexcept>
+
+namespace ip = boost::interprocess;
+namespace fs = boost::filesystem;
+
+static const char KseqMagic[4] = { 'K', 'S', 'E', 'Q' };
+
+KseqCache::KseqCache(const fs::path &cache_file, const std::vector<fs::path> &sources, bool scratch)
+    : cache_file_(cache_file)
+    , scratch_(scratch)
+{
+    std::vector<Source> src;
+    std::set<std::string> seen;
+    for (auto &s: sources)
+    {
+	if (!fs::is_regular_file(s))
+	    continue;
+	std::string name = fs::canonical(s).string();
+	if (seen.insert(name).second)
+	    src.push_back(Source { name, fs::file_size(s), 0 });
+    }
+
+    if (!scratch)
+    {
+	tbb::parallel_for(size_t(0), src.size(), [&src](size_t i) {
+	    src[i].checksum = checksum(src[i].name);
+	});
+
+	if (fs::exists(cache_file) && load(src))
+	    return;
+    }
+
+    std::cerr << "writing sequence cache " << cache_file << "\n";
+    write(src);
+    if (!load(src))
+	throw std::runtime_error("sequence cache " + cache_file.string() + " is invalid after it was written");
+}
+
+KseqCache::~KseqCache()
+{
+    if (scratch_)
+    {
+	files_.clear();
+	region_ = ip::mapped_region();
+	boost::system::error_code ec;
+	fs::remove(cache_file_, ec);
+    }
+}
+
+const KseqFile *KseqCache::find(const fs::path &source) const
+{
+    if (files_.empty())
+	return nullptr;
+    boost::system::error_code ec;
+    fs::path p = fs::canonical(source, ec);
+    if (ec)
+	return nullptr;
+    auto it = files_.find(p.string());
+    return it == files_.end() ? nullptr : &it->second;
+}
+
+uint64_t KseqCache::checksum(const fs::path &file)
+{
+    uLong crc = crc32(0L, Z_NULL, 0);
+    size_t len = fs::file_size(file);
+    if (len == 0)
+	return crc;
+
+    ip::file_mapping mapping(file.native().c_str(), ip::read_only);
+    ip::mapped_region region(mapping, ip::read_only);
+    region.advise(ip::mapped_region::advice_sequential);
+    const Bytef *p = static_cast<const Bytef *>(region.get_address());
+
+    const size_t step = 1 << 30;
+    for (size_t pos = 0; pos < len; pos += step)
+	crc = crc32(crc, p + pos, static_cast<uInt>(std::min(step, len - pos)));
+    return crc;
+}
+
+/*!
+  Map the cache file and make available the entries that match the
+  given sources.
+
+  @return true if every source has a current entry.
+ */
+bool KseqCache::load(const std::vector<Source> &sources)
+{
+    files_.clear();
+    region_ = ip::mapped_region();
+
+    size_t len = fs::file_size(cache_file_);
+    if (len < sizeof(KseqHeader))
+	return false;
+
+    mapping_ = ip::file_mapping(cache_file_.native().c_str(), ip::read_only);
+    region_ = ip::mapped_region(mapping_, ip::read_only);
+    const char *data = static_cast<const char *>(region_.get_address());
+
+    const KseqHeader *hdr = reinterpret_cast<const KseqHeader *>(data);
+    if (memcmp(hdr->magic, KseqMagic, sizeof(KseqMagic)) != 0 || hdr->version != Version ||
+	hdr->files_offset > len || hdr->n_files > (len - hdr->files_offset) / sizeof(KseqFileEntry))
+    {
+	std::cerr << "ignoring invalid sequence cache " << cache_file_ << "\n";
+	return false;
+    }
+
+    std::map<std::string_view, const Source *> wanted;
+    for (auto &s: sources)
+	wanted.emplace(s.name, &s);
+
+    const KseqFileEntry *entries = reinterpret_cast<const KseqFileEntry *>(data + hdr->files_offset);
+    for (uint64_t i = 0; i < hdr->n_files; i++)
+    {
+	const KseqFileEntry &e = entries[i];
+	if (e.name_offset > len || e.name_len > len - e.name_offset ||
+	    e.records_offset > len || e.n_records > (len - e.records_offset) / sizeof(KseqRecord) ||
+	    e.strings_offset > len || e.residues_offset > len)
+	{
+	    std::cerr << "ignoring invalid sequence cache " << cache_file_ << "\n";
+	    files_.clear();
+	    return false;
+	}
+
+	std::string_view name(data + e.name_offset, e.name_len);
+	auto w = wanted.find(name);
+	if (w == wanted.end() || w->second->size != e.source_size || w->second->checksum != e.checksum)
+	    continue;
+
+	files_.emplace(std::string(name), KseqFile {
+		reinterpret_cast<const KseqRecord *>(data + e.records_offset), e.n_records,
+		data + e.strings_offset, data + e.residues_offset });
+    }
+
+    return files_.size() == sources.size();
+}
+
+/*!
+  Write a new cache file for the given sources. Entries that are current
+  in the existing cache are copied; the other sources are parsed. The
+  file is written under a temporary name and renamed into place.
+ */
+void KseqCache::write(const std::vector<Source> &sources)
+{
+    struct Block
+    {
+	std::vector<KseqRecord> records;
+	std::string strings;
+	std::string residues;
+    };
+    using BlockPtr = std::shared_ptr<Block>;
+
+    /*
+     * Several processes, such as the shards of a build, may write the
+     * same cache at once; each writes its own file and the last rename wins.
+     */
+    fs::path tmp = cache_file_.native() + fs::unique_path(".%%%%-%%%%-%%%%.tmp").native();
+    fs::ofstream out(tmp, std::ios::binary);
+    if (!out)
+	throw std::runtime_error("cannot write sequence cache " + tmp.string());
+
+    KseqHeader hdr;
+    memcpy(hdr.magic, KseqMagic, sizeof(KseqMagic));
+    hdr.version = Version;
+    hdr.n_files = sources.size();
+    hdr.files_offset = 0;
+    out.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+
+    std::vector<KseqFileEntry> entries;
+    uint64_t pos = sizeof(hdr);
+
+    auto pad = [&out, &pos]() {
+	static const char zeros[8] = { 0 };
+	size_t n = (8 - pos % 8) % 8;
+	out.write(zeros, n);
+	pos += n;
+    };
+
+    size_t next = 0;
+    size_t n_tokens = 2 * tbb::this_task_arena::max_concurrency();
+    tbb::parallel_pipeline(n_tokens,
+			   tbb::make_filter<void, size_t>(TBB_FILTER_MODE::serial_in_order, [&](tbb::flow_control &fc) -> size_t {
+			       if (next == sources.size())
+				   fc.stop();
+			       return next++;
+			   }) &
+			   tbb::make_filter<size_t, BlockPtr>(TBB_FILTER_MODE::parallel, [this, &sources](size_t i) -> BlockPtr {
+			       auto block = std::make_shared<Block>();
+			       auto cached = files_.find(sources[i].name);
+			       if (cached != files_.end())
+			       {
+				   const KseqFile &f = cached->second;
+				   block->records.assign(f.records, f.records + f.n_records);
+				   if (f.n_records > 0)
+				   {
+				       const KseqRecord &last = f.records[f.n_records - 1];
+				       block->strings.assign(f.strings, last.string_offset + last.id_len + last.def_len);
+				       block->residues.assign(f.residues, last.seq_offset + last.seq_len);
+				   }
+				   return block;
+			       }
+
+			       FastaParser parser;
+			       parser.parse(fs::path(sources[i].name), [&block](std::string_view id, std::string_view def, std::string_view seq) {
+				   if (id.empty())
+				       return;
+				   block->records.push_back(KseqRecord {
+					   block->strings.size(), block->residues.size(),
+					   static_cast<uint32_t>(id.size()), static_cast<uint32_t>(def.size()),
+					   static_cast<uint32_t>(seq.size()), 0 });
+				   block->strings.append(id);
+				   block->strings.append(def);
+				   block->residues.append(seq);
+			       });
+			       return block;
+			   }) &
+			   tbb::make_filter<BlockPtr, void>(TBB_FILTER_MODE::serial_in_order, [&](BlockPtr block) {
+			       const Source &s = sources[entries.size()];
+			       KseqFileEntry e { 0, s.name.size(), s.size, s.checksum, pos, block->records.size(), 0, 0 };
+
+			       size_t n = block->records.size() * sizeof(KseqRecord);
+			       out.write(reinterpret_cast<const char *>(block->records.data()), n);
+			       pos += n;
+			       e.strings_offset = pos;
+			       out.write(block->strings.data(), block->strings.size());
+			       pos += block->strings.size();
+			       e.residues_offset = pos;
+			       out.write(block->residues.data(), block->residues.size());
+			       pos += block->residues.size();
+			       pad();
+			       entries.push_back(e);
+			   }));
+
+    hdr.files_offset = pos;
+    uint64_t name_pos = pos + entries.size() * sizeof(KseqFileEntry);
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+	entries[i].name_offset = name_pos;
+	name_pos += entries[i].name_len;
+    }
+    out.write(reinterpret_cast<const char *>(entries.data()), entries.size() * sizeof(KseqFileEntry));
+    for (auto &s: sources)
+	out.write(s.name.data(), s.name.size());
+
+    out.seekp(0);
+    out.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+    out.close();
+    if (!out)
+	throw std::runtime_error("error writing sequence cache " + tmp.string());
+
+    files_.clear();
+    region_ = ip::mapped_region();
+    fs::rename(tmp, cache_file_);
+}
@@ -0,0 +1,146 @@
+#ifndef _kseq_cache_h
+#define _kseq_cache_h
+
+/*!
+  @file kseq_cache.h
+  @brief Persistent cache of parsed fasta data (.kseq files).
+
+  Parsing the text of a large set of fasta files dominates the cost of
+  a signature build, and the builder reads each file several times. A
+  .kseq cache holds the records of a set of fasta files in the form the
+  parser delivers them, and is mapped into memory and replayed instead
+  of parsing the text.
+
+  The file holds, after a fixed header, one block per source file:
+
+      KseqRecord records[n_records]
+      char strings[]     id and definition of each record, back to back
+      char residues[]    sequence of each record, back to back
+
+  and at the end a table of KseqFileEntry describing each block followed
+  by the source file names. Sequences are stored without line breaks and
+  with the characters the parser rejects removed, so they are handed to
+  the callbacks directly from the mapped data.
+
+  Each source is identified by its canonical path and recorded with its
+  size and the CRC-32 of its (possibly compressed) contents. Opening a
+  cache for a list of sources reads each source once to compute its
+  checksum; a source that is missing from the cache or whose checksum
+  does not match is parsed again and the cache rewritten, so a stale
+  entry is never used.
+
+  A scratch cache is written for a single run: the sources are parsed
+  into it without computing checksums, so each is read exactly once,
+  and the file is removed when the cache is destroyed.
+*/
+
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct KseqHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t n_files;
+    uint64_t files_offset;
+};
+
+struct KseqFileEntry
+{
+    uint64_t name_offset;
+    uint64_t name_len;
+    uint64_t source_size;
+    uint64_t checksum;
+    uint64_t records_offset;
+    uint64_t n_records;
+    uint64_t strings_offset;
+    uint64_t residues_offset;
+};
+
+/*! Offsets are relative to the strings and residues of the record's file. */
+struct KseqRecord
+{
+    uint64_t string_offset;
+    uint64_t seq_offset;
+    uint32_t id_len;
+    uint32_t def_len;
+    uint32_t seq_len;
+    uint32_t pad;
+};
+
+/*! @brief The cached records of one source file. */
+struct KseqFile
+{
+    const KseqRecord *records;
+    size_t n_records;
+    const char *strings;
+    const char *residues;
+
+    /*! Invoke cb(id, def, seq) for records [begin, end). */
+    template <typename CB>
+    void for_each(size_t begin, size_t end, CB &&cb) const {
+	for (size_t i = begin; i < end; i++)
+	{
+	    const KseqRecord &r = records[i];
+	    const char *s = strings + r.string_offset;
+	    cb(std::string_view(s, r.id_len),
+	       std::string_view(s + r.id_len, r.def_len),
+	       std::string_view(residues + r.seq_offset, r.seq_len));
+	}
+    }
+};
+
+class KseqCache
+{
+public:
+    /*! Open cache_file for the given sources, (re)writing it first if it
+      does not hold a current copy of each of them. Sources that are not
+      regular files are not cached.
+
+      If scratch is true, cache_file is always written from the sources,
+      reading each of them once, and removed by the destructor. */
+    KseqCache(const boost::filesystem::path &cache_file, const std::vector<boost::filesystem::path> &sources,
+	      bool scratch = false);
+    ~KseqCache();
+
+    KseqCache(const KseqCache &) = delete;
+    KseqCache &operator=(const KseqCache &) = delete;
+
+    /*! The cached records of source, or nullptr if it is not cached. */
+    const KseqFile *find(const boost::filesystem::path &source) const;
+
+    size_t size() const { return files_.size(); }
+
+    static const uint32_t Version = 1;
+
+    /*! CRC-32 of the contents of file. */
+    static uint64_t checksum(const boost::filesystem::path &file);
+
+private:
+    boost::filesystem::path cache_file_;
+    bool scratch_;
+    boost::interprocess::file_mapping mapping_;
+    boost::interprocess::mapped_region region_;
+
+    /* Keyed by canonical source path; only sources verified on open. */
+    std::map<std::string, KseqFile> files_;
+
+    struct Source
+    {
+	std::string name;
+	uint64_t size;
+	uint64_t checksum;
+    };
+
+    bool load(const std::vector<Source> &sources);
+    void write(const std::vector<Source> &sources);
+};
+
+#endif // _kseq_cache_h
@@ -47,9 +47,10 @@ public:
 	/*
 	 * kmer_hit_map maps from a kmer to the set of IDs containing that kmer
 	 */
-	tbb::concurrent_unordered_map<Kmer<8>, tbb::concurrent_unordered_set<int>, tbb_hash<8>> kmer_hit_map;
+	using KmerType = Kmer<Caller::KmerSize, typename Caller::KmerAlphabet>;
+	tbb::concurrent_unordered_map<KmerType, tbb::concurrent_unordered_set<int>, tbb_hash<Caller::KmerSize, typename Caller::KmerAlphabet>> kmer_hit_map;
 
-	auto hit_cb = [&kmer_hit_map, this](const std::string &id, const Kmer<8> &kmer, size_t offset, double seqlen, const StoredKmerData &kd) {
+	auto hit_cb = [&kmer_hit_map, this](std::string_view id, const KmerType &kmer, size_t offset, double seqlen, const StoredKmerData &kd) {
 	    // std::cerr << id << " " << seqlen << " " << kd << "\n";
 
 
@@ -81,8 +82,8 @@ public:
 	};
 
 	tbb::concurrent_unordered_map<std::string, size_t> prot_sizes;
-	auto call_cb = [&prot_sizes](const std::string &id, const std::string &func, FunctionIndex func_index, float score, size_t prot_len) {
-	    prot_sizes.insert(std::make_pair(id, prot_len));
+	auto call_cb = [&prot_sizes](std::string_view id, const std::string &func, FunctionIndex func_index, float score, size_t prot_len) {
+	    prot_sizes.insert(std::make_pair(std::string(id), prot_len));
 	};
 
 	caller_.ignore_hypothetical(true);
@@ -92,9 +93,7 @@ public:
 	    if (!fs::is_regular_file(in_file) || fs::is_empty(in_file))
 		continue;
 	    
-	    fs::ifstream ifstr(in_file);
-	    caller_.process_fasta_stream_parallel(ifstr, hit_cb, call_cb, idmap_);
-	    ifstr.close();
+	    caller_.process_fasta_file_parallel(in_file, hit_cb, call_cb, idmap_);
 	    if (label == "")
 		label = in_file.string();
 	    else
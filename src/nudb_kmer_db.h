@@ -18,14 +18,15 @@
 
 namespace fs = boost::filesystem;
 
-template <typename StoredData, int K>
+template <typename StoredData, int K, typename Alphabet = ProteinAlphabet>
 class NuDBKmerDb
 {
 public:
     static constexpr int kmer_size = K;
     static constexpr int KmerSize = K;
+    using KmerAlphabet = Alphabet;
     using KData = StoredData;
-    using key_type = Kmer<K>;
+    using key_type = Kmer<K, Alphabet>;
 
     NuDBKmerDb(const fs::path &file_base)
 	: file_base_(file_base)
@@ -56,7 +57,7 @@ public:
 	nudb::create<nudb::xxhasher>(dat_path_, key_path_, log_path_,
 				     1,
 				     nudb::make_salt(),
-				     sizeof(key_type),
+				     key_type::size(),
 				     nudb::block_size("."),
 				     0.5f,
 				     ec);
@@ -88,7 +89,8 @@ public:
 	key_type ka;
 	if (key.length() != kmer_size)
 	    throw std::runtime_error("Invalid kmer size");
-	std::copy(key.begin(), key.end(), ka.data());
+	if (!encode_kmer(key.data(), ka))
+	    throw std::runtime_error("Invalid kmer " + key);
 	insert(ka, kdata, ec);
     }
     void insert(const key_type &key, const KData &kdata, nudb::error_code &ec) {
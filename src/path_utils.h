@@ -63,13 +63,13 @@ void load_strings(const std::vector<std::string> &files, std::vector<std::string
     }
 }
 
-std::set<std::string> load_set_from_file(const fs::path &file)
+std::set<std::string, std::less<>> load_set_from_file(const fs::path &file)
 {
     /*
      * Read data if file is present.
      */
 
-    std::set<std::string> set;
+    std::set<std::string, std::less<>> set;
     if (!file.empty())
     {
 	fs::ifstream ifstr(file);
@@ -4,11 +4,12 @@
 /*!
   Build perfect hash from signature data in builder.
 
-  We transform the keys of the kept kmers data into a vector, then pass that to the cmph code.
+  We transform the packed keys of the kept kmers data into a vector, then pass that to the cmph code
+  as fixed-size binary keys.
 */
 
-template <int K>
-void build_perfect_hash(SignatureBuilder<K> &builder,
+template <int K, typename Alphabet>
+void build_perfect_hash(SignatureBuilder<K, Alphabet> &builder,
 			const fs::path &perfect_hash_file,
 			const fs::path &data_file)
 {
@@ -16,17 +17,16 @@ void build_perfect_hash(SignatureBuilder<K> &builder,
 
     auto &map = builder.kept_kmers();
 
-    std::vector<char *> strvec;
-    strvec.reserve(map.size());
+    std::vector<uint64_t> keys;
+    keys.reserve(map.size());
 
-    std::transform(map.begin(), map.end(), strvec.begin(), [](auto pair){
-	    return strndup(pair.first.data(), K);
+    std::transform(map.begin(), map.end(), std::back_inserter(keys), [](const auto &pair){
+	    return pair.first.bits;
 	});
 
-    char **d = strvec.data();
-
     FILE *mphf_fd = fopen(perfect_hash_file.native().c_str(), "wb");
-    cmph_io_adapter_t *source = cmph_io_vector_adapter(d, map.size());
+    cmph_io_adapter_t *source = cmph_io_struct_vector_adapter(keys.data(), sizeof(uint64_t), 0,
+							      sizeof(uint64_t), keys.size());
     cmph_config_t *config = cmph_config_new(source);
     cmph_config_set_algo(config, CMPH_BDZ);
     cmph_config_set_mphf_fd(config, mphf_fd);
@@ -45,9 +45,9 @@ void build_perfect_hash(SignatureBuilder<K> &builder,
     tbb::parallel_for(builder.kept_kmers().range(), [kd, hash, &n ](auto r) {
 	    for (auto ent = r.begin(); ent != r.end(); ent++)
 	    {
-		const Kmer<K> &kmer = ent->first;
-		const KeptKmer<K> &kept = ent->second;
-		unsigned int idx = cmph_search(hash, kmer.data(), K);
+		const Kmer<K, Alphabet> &kmer = ent->first;
+		const KeptKmer<K, Alphabet> &kept = ent->second;
+		unsigned int idx = cmph_search(hash, kmer.data(), kmer.size());
 		kd[idx] = kept.stored_data;
 		n++;
 	    }
@@ -63,6 +63,7 @@ void build_perfect_hash(SignatureBuilder<K> &builder,
     std::fclose(fp);
 
     cmph_config_destroy(config);
+    cmph_io_struct_vector_adapter_destroy(source);
     cmph_dump(hash, mphf_fd);
     cmph_destroy(hash);
     fclose(mphf_fd);
@@ -4,19 +4,22 @@
 #include <tbb/concurrent_vector.h>
 #include <tbb/concurrent_map.h>
 
+#include <string>
+#include <string_view>
+
 class SeqIdMap
 {
 public:
     SeqIdMap() { }
 
-    int lookup_id(const std::string &id) {
+    int lookup_id(std::string_view id) {
 	auto iter = id_to_index_.find(id);
 	int idx;
 	if (iter == id_to_index_.end())
 	{
-	    auto ent_iter = index_to_id_.push_back(id);
+	    auto ent_iter = index_to_id_.push_back(std::string(id));
 	    idx = std::distance(index_to_id_.begin(), ent_iter);
-	    id_to_index_.emplace(id, idx);
+	    id_to_index_.emplace(std::string(id), idx);
 	}
 	else
 	{
@@ -31,7 +34,7 @@ public:
 
 private:
     tbb::concurrent_vector<std::string> index_to_id_;
-    tbb::concurrent_map<std::string, int> id_to_index_;
+    tbb::concurrent_map<std::string, int, std::less<>> id_to_index_;
 };
 
 #endif // _seq_id_map_h
@@ -0,0 +1,86 @@
+#ifndef _sequence_digest_h
+#define _sequence_digest_h
+
+/*!
+  @file sequence_digest.h
+  @brief 128-bit digest of a protein sequence.
+
+  Used to recognize identical sequences without keeping their text.
+  This is MurmurHash3 x64_128, whose finalizer is kmer_hash_mix(). Two
+  distinct sequences share a digest with probability about 2^-128, so
+  among n sequences a collision is expected only for n near 2^64.
+*/
+
+#include "kmer_data.h"
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+struct SequenceDigest
+{
+    uint64_t h1;
+    uint64_t h2;
+
+    bool operator==(const SequenceDigest &o) const { return h1 == o.h1 && h2 == o.h2; }
+};
+
+inline SequenceDigest sequence_digest(std::string_view seq)
+{
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+
+    const char *data = seq.data();
+    size_t len = seq.size();
+    size_t n_blocks = len / 16;
+    uint64_t h1 = 0, h2 = 0;
+
+    for (size_t i = 0; i < n_blocks; i++)
+    {
+	uint64_t k1, k2;
+	std::memcpy(&k1, data + i * 16, 8);
+	std::memcpy(&k2, data + i * 16 + 8, 8);
+
+	k1 *= c1; k1 = rotl(k1, 31); k1 *= c2; h1 ^= k1;
+	h1 = rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+	k2 *= c2; k2 = rotl(k2, 33); k2 *= c1; h2 ^= k2;
+	h2 = rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    const unsigned char *tail = reinterpret_cast<const unsigned char *>(data + n_blocks * 16);
+    uint64_t k1 = 0, k2 = 0;
+    switch (len & 15)
+    {
+    case 15: k2 ^= uint64_t(tail[14]) << 48; [[fallthrough]];
+    case 14: k2 ^= uint64_t(tail[13]) << 40; [[fallthrough]];
+    case 13: k2 ^= uint64_t(tail[12]) << 32; [[fallthrough]];
+    case 12: k2 ^= uint64_t(tail[11]) << 24; [[fallthrough]];
+    case 11: k2 ^= uint64_t(tail[10]) << 16; [[fallthrough]];
+    case 10: k2 ^= uint64_t(tail[9]) << 8; [[fallthrough]];
+    case 9:  k2 ^= uint64_t(tail[8]);
+	k2 *= c2; k2 = rotl(k2, 33); k2 *= c1; h2 ^= k2;
+	[[fallthrough]];
+    case 8:  k1 ^= uint64_t(tail[7]) << 56; [[fallthrough]];
+    case 7:  k1 ^= uint64_t(tail[6]) << 48; [[fallthrough]];
+    case 6:  k1 ^= uint64_t(tail[5]) << 40; [[fallthrough]];
+    case 5:  k1 ^= uint64_t(tail[4]) << 32; [[fallthrough]];
+    case 4:  k1 ^= uint64_t(tail[3]) << 24; [[fallthrough]];
+    case 3:  k1 ^= uint64_t(tail[2]) << 16; [[fallthrough]];
+    case 2:  k1 ^= uint64_t(tail[1]) << 8; [[fallthrough]];
+    case 1:  k1 ^= uint64_t(tail[0]);
+	k1 *= c1; k1 = rotl(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= len;
+    h2 ^= len;
+    h1 += h2;
+    h2 += h1;
+    h1 = kmer_hash_mix(h1);
+    h2 = kmer_hash_mix(h2);
+    h1 += h2;
+    h2 += h1;
+    return SequenceDigest { h1, h2 };
+}
+
+#endif // _sequence_digest_h
@@ -6,11 +6,26 @@
 
 #include "kmer_data.h"
 #include "function_map.h"
-
+#include "bucket_report.h"
+#include "kmer_record_sort.h"
+#include "kmer_spill.h"
+#include "kmer_summary.h"
+#include "kmer_contribution.h"
+#include "kmer_statistics.h"
+#include "sequence_digest.h"
+
+#include <tbb/concurrent_hash_map.h>
 #include <tbb/concurrent_unordered_map.h>
 #include <tbb/concurrent_unordered_set.h>
 #include <tbb/concurrent_vector.h>
+#include <tbb/info.h>
 #include <tbb/parallel_for.h>
+#include <tbb/parallel_for_each.h>
+#include <tbb/task_arena.h>
+#include <tbb/task_group.h>
+
+#include <atomic>
+#include <unordered_map>
 
 #include <boost/accumulators/accumulators.hpp>
 #include <boost/accumulators/statistics/stats.hpp>
@@ -31,53 +46,169 @@ namespace acc = boost::accumulators;
   We hang onto
   some statistics in order to compute weights later on.
 */
-template <int K>
+template <int K, typename Alphabet = ProteinAlphabet>
 struct KeptKmer
 {
-    Kmer<K> kmer;
+    Kmer<K, Alphabet> kmer;
     StoredKmerData stored_data;
 
 //    unsigned int seqs_containing_sig;	// Count of sequences containing this kmer
 //    unsigned int seqs_containing_function; // Count of sequences with the kmer that have the function
 };
 
-struct KmerStatistics
+/*! @brief Counts of the input extracted by SignatureBuilder::extract_kmers().
+
+  Updated as each file completes, so they may be read while it runs.
+*/
+struct ExtractProgress
+{
+    std::atomic<uint64_t> files { 0 };
+    std::atomic<uint64_t> sequences { 0 };
+    std::atomic<uint64_t> kmers { 0 };
+};
+
+/*! @brief How kmer occurrences are collected and grouped by kmer.
+
+  Multimap inserts each occurrence into a concurrent multimap. Sort
+  appends packed records to per-thread buffers and sorts them by kmer
+  (see kmer_record_sort.h), using a fraction of the memory. Spill
+  collects records the same way but writes them to disk partitions
+  whenever a memory budget is reached (see kmer_spill.h). Online keeps
+  only a fixed-size running summary per distinct kmer (see
+  kmer_summary.h for how its results may differ from the others).
+  Incremental keeps each file's records in a contribution store and
+  re-extracts only the files that changed since the last build (see
+  kmer_contribution.h).
+*/
+enum class KmerAggregation
 {
-    tbb::atomic<int> distinct_signatures = 0;
-    tbb::concurrent_unordered_map<int, int> distinct_functions;
-    tbb::concurrent_unordered_map<FunctionIndex, int> seqs_with_func;
-    tbb::concurrent_unordered_set<unsigned int> seqs_with_a_signature;
+    Multimap,
+    Sort,
+    Spill,
+    Online,
+    Incremental
 };
 
-template <int K>
-using KeptKmers = tbb::concurrent_unordered_map<Kmer<K>, KeptKmer<K>, tbb_hash<K>>;
+template <int K, typename Alphabet = ProteinAlphabet>
+using KeptKmers = tbb::concurrent_unordered_map<Kmer<K, Alphabet>, KeptKmer<K, Alphabet>, tbb_hash<K, Alphabet>>;
 
-template <int K>
+template <int K, typename Alphabet = ProteinAlphabet>
 class SignatureBuilder
 {
 public:
     SignatureBuilder(int n_threads, int max_seqs_per_file);
     
-    using KmerAttributeMap =  tbb::concurrent_unordered_multimap<Kmer<K>, KmerAttributes, tbb_hash<K>>;
+    using KmerAttributeMap =  tbb::concurrent_unordered_multimap<Kmer<K, Alphabet>, KmerAttributes, tbb_hash<K, Alphabet>>;
+    using KmerSummaryMap = tbb::concurrent_hash_map<Kmer<K, Alphabet>, KmerSummary, tbb_hash_compare<K, Alphabet>>;
 
     void load_function_data(const std::vector<std::string> &good_functions,
 			    const std::vector<std::string> &good_roles,
 			    const std::vector<fs::path> &function_definitions);
 		   
     void load_fasta(const std::vector<fs::path> &fasta_files, bool keep_functions,
-		    const std::set<std::string> &deleted_fids);
+		    const std::set<std::string, std::less<>> &deleted_fids);
 
-    void process_kept_functions(int min_reps_required, const fs::path &function_index_file, std::set<std::string> &ignored_functions);
+    void process_kept_functions(int min_reps_required, const fs::path &function_index_file, std::set<std::string, std::less<>> &ignored_functions);
 
-    void extract_kmers(const std::set<std::string> &deleted_fids);
+    void extract_kmers(const std::set<std::string, std::less<>> &deleted_fids);
     void process_kmers();
 
+    void report_bucket_occupancy(std::ostream &os);
+
+    /*! Number of entries in each of the kmer containers. Must not be called
+      while kmers are being inserted.
+    */
+    std::vector<std::pair<std::string, size_t>> container_sizes();
+
+    const ExtractProgress &extract_progress() const { return extract_progress_; }
+
+    void set_aggregation(KmerAggregation a) { aggregation_ = a; }
+
+    /*! Use KmerAggregation::Spill, writing partition files under spill_dir
+      and keeping the buffered records, and the partitions read back,
+      within memory_budget bytes.
+    */
+    void set_spill(const fs::path &spill_dir, size_t memory_budget);
+
+    /*! Use KmerAggregation::Sort, with the kmer space split by hash
+      across the NUMA nodes. Each node extracts the kmers of a share of
+      the files, and sorts, groups and keeps the kmers routed to it, in a
+      task arena constrained to the node. Records routed to the node that
+      extracted them and the node's kept kmer table stay in node-local
+      memory; the records extracted on other nodes are counted and
+      reported. The kept kmers are merged into the single kept kmer table
+      at the end, which is not node-local.
+    */
+    void set_numa();
+
+    /*! Extract the kmers of only the first of identical sequences with the
+      same function, and weight its kmers by the number of copies when
+      they are processed. Applies to the multimap and sort based
+      aggregations; online and incremental builds extract every copy.
+    */
+    void set_dedup(bool dedup) { dedup_ = dedup; }
+
+    /*! Use KmerAggregation::Incremental with the contribution store in dir. */
+    void set_contribution_store(const fs::path &dir);
+
+    /*! Restrict this builder to shard index of count (see load_contributions()). */
+    void set_shard(int index, int count) {
+	shard_index_ = index;
+	shard_count_ = count;
+    }
+
+    /*! Open the contributions of all files, as written by the extract_kmers()
+      of every shard, for processing this shard's kmer partitions.
+    */
+    void load_contributions();
+
+    /*! Remove the contributions of files no longer in the build, and
+      partial contributions, from a contribution store shared by shards.
+      Call only once no shard is using the store.
+    */
+    void remove_stale_contributions();
+
+    /*! Write the fasta file list and function assignments, as set up by
+      load_fasta() and process_kept_functions(), to file.
+    */
+    void save_function_checkpoint(const fs::path &file);
+
+    /*! Restore the state written by save_function_checkpoint() in place of
+      load_fasta() and process_kept_functions().
+    */
+    void load_function_checkpoint(const fs::path &file);
+
+    /*! Write the kept kmers, sorted by kmer, and the sequence statistics to file. */
+    void write_kept_kmers(const fs::path &file);
+
+    /*! Add the kept kmers and merge the sequence statistics written by
+      write_kept_kmers() into this builder's.
+    */
+    void read_kept_kmers(const fs::path &file);
+
+    /*! Number of leading kmer bits that partition the sorted records. */
+    static const int SortPartitionBits = 12;
+
+    /*! Number of leading bits of the kmer's hash that select a spill file
+      or a contribution partition. */
+    static const int SpillPartitionBits = 8;
+
+    /*! Read fasta files from this cache when it holds them. */
+    void set_sequence_cache(const KseqCache *cache) { seq_cache_ = cache; }
+
 private:
     void load_kmers_from_fasta(unsigned file_number, const fs::path &file,
-			       const std::set<std::string> &deleted_fids);
+			       const std::set<std::string, std::less<>> &deleted_fids);
+
+    size_t load_kmers_from_sequence(unsigned int &next_sequence_id,
+				  std::string_view id, std::string_view def, std::string_view seq);
 
-    void load_kmers_from_sequence(unsigned int &next_sequence_id,
-				  const std::string &id, const std::string &def, const std::string &seq);
+    void extract_contributions(const std::set<std::string, std::less<>> &deleted_fids);
+    void extract_numa_kmers(const std::set<std::string, std::less<>> &deleted_fids);
+    void extract_contribution(const fs::path &file, const std::set<std::string, std::less<>> &deleted_fids,
+			      KmerContributionData &data);
+    bool contribution_current(const KmerContribution &contrib, const std::set<std::string, std::less<>> &deleted_fids);
+    void add_contribution(size_t file_number, std::unique_ptr<KmerContribution> contrib);
 
     struct KmerSet
     {
@@ -88,22 +219,37 @@ private:
 	    set.clear();
 	}
 	// ~KmerSet() { std::cerr << "destroy " << this << "\n"; }
-	Kmer<K> kmer;
+	Kmer<K, Alphabet> kmer;
 	std::map<FunctionIndex, int> func_count;
 	int count;
 	std::vector<KmerAttributes> set;
     };
 
 
-    KeptKmers<K> kept_kmers_;
+    KeptKmers<K, Alphabet> kept_kmers_;
     
     void process_kmer_set(KmerSet &set);
-
-    const std::set<unsigned char> ok_prot_ = { 'A', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'K', 'L', 'M', 'N', 'P', 'Q', 'R', 'S', 'T', 'V', 'W', 'Y',
-			   'a', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'k', 'l', 'm', 'n', 'p', 'q', 'r', 's', 't', 'v', 'w', 'y'};
+    void process_sorted_kmers();
+    void process_numa_kmers();
+    std::vector<std::unique_ptr<tbb::task_arena>> make_numa_arenas();
+    void process_spilled_kmers();
+    void process_kmer_records(const KmerRecord *begin, const KmerRecord *end);
+    void process_kmer_summaries();
+    void process_contributions();
+    void keep_kmer(const Kmer<K, Alphabet> &kmer, const StoredKmerData &data);
+
+    bool first_sequence_copy(std::string_view seq, FunctionIndex function_index, unsigned int seq_id);
+    void collect_sequence_copies();
+
+    /*! Number of identical sequences a sequence's kmers stand for. */
+    uint32_t multiplicity(unsigned int seq_id) const {
+	if (seq_multiplicity_.empty())
+	    return 1;
+	return seq_multiplicity_[seq_index_base_[seq_id / max_seqs_per_file_] + seq_id % max_seqs_per_file_];
+    }
 
 public:
-    const KeptKmers<K> &kept_kmers() { return kept_kmers_; }
+    const KeptKmers<K, Alphabet> &kept_kmers() { return kept_kmers_; }
     const KmerStatistics &kmer_stats() { return kmer_stats_; }
     const std::string lookup_function(FunctionIndex idx) { return fm_.lookup_function(idx); }
     const tbb::concurrent_vector<fs::path> all_fasta_data() { return all_fasta_data_; }
@@ -112,15 +258,104 @@ public:
 private:
 
     KmerStatistics kmer_stats_;
+    ExtractProgress extract_progress_;
 
     /*! Max allowed sequences per file. Used to assign unique sequence IDs efficiently in parallel.
      */
     int max_seqs_per_file_;
+
+    /*! Number of sequence IDs assigned in each fasta file, for sizing the
+     * KmerStatistics sequence bitmap.
+     */
+    std::vector<uint32_t> file_sequences_;
     
     /*! Multimap from a kmer to a set of attributes.
      */
     KmerAttributeMap kmer_attributes_;
 
+    /*! Per-thread kmer occurrence records, for KmerAggregation::Sort.
+     */
+    KmerRecordBuffers kmer_records_;
+
+    /*! Running summary of each distinct kmer, for KmerAggregation::Online.
+     */
+    KmerSummaryMap kmer_summaries_;
+
+    KmerAggregation aggregation_;
+
+    /*! With set_numa(), the NUMA nodes and, for each, the records of the
+     * kmers it aggregates and the kmers it keeps until they are merged
+     * into kept_kmers_.
+     */
+    std::vector<tbb::numa_node_id> numa_nodes_;
+    std::vector<std::unique_ptr<KmerRecordBuffers>> numa_records_;
+    std::vector<std::unique_ptr<KeptKmers<K, Alphabet>>> numa_kept_kmers_;
+
+    /*! The node whose arena a thread is extracting for, and per thread the
+     * number of records routed from each node to each, at
+     * [origin * n_nodes + destination].
+     */
+    tbb::enumerable_thread_specific<size_t> numa_extract_node_;
+    tbb::enumerable_thread_specific<std::vector<uint64_t>> numa_routed_;
+
+    /*! The node that aggregates a kmer. Nodes own equal ranges of the
+     * mixed kmer hash; raw kmer prefixes are far from uniform, since the
+     * residue codes do not fill their bits.
+     */
+    size_t numa_node(uint64_t kmer_bits) const {
+	return static_cast<size_t>(((kmer_hash_mix(kmer_bits) >> 32) * numa_nodes_.size()) >> 32);
+    }
+
+    /*! Spill files and the per-thread record count that triggers a spill,
+     * which is also the most records of a partition read back, for
+     * KmerAggregation::Spill.
+     */
+    std::unique_ptr<KmerSpillFiles> spill_;
+    size_t spill_threshold_;
+
+    /*! Contribution store, the contribution of each fasta file and the map
+     * from each contribution's function numbers to function indexes, for
+     * KmerAggregation::Incremental.
+     */
+    std::unique_ptr<KmerContributionStore> contribution_store_;
+    std::vector<std::unique_ptr<KmerContribution>> contributions_;
+    std::vector<std::vector<FunctionIndex>> contribution_functions_;
+
+    /*! With set_dedup(), each distinct (sequence, function) pair seen while
+     * extracting, with the id of the copy whose kmers were extracted and
+     * the ids of the other copies. After extraction, this is reduced to
+     * the multiplicity of each sequence, indexed as in KmerStatistics
+     * from seq_index_base_, and the copies of each sequence that has any.
+     */
+    struct SequenceKey
+    {
+	SequenceDigest digest;
+	FunctionIndex func;
+    };
+    struct SequenceKeyHashCompare
+    {
+	static size_t hash(const SequenceKey &k) { return static_cast<size_t>(k.digest.h1 ^ (uint64_t(k.func) * 0x9e3779b97f4a7c15ULL)); }
+	static bool equal(const SequenceKey &a, const SequenceKey &b) { return a.digest == b.digest && a.func == b.func; }
+    };
+    struct SequenceCopies
+    {
+	unsigned int first_seq_id;
+	std::vector<unsigned int> copies;
+    };
+
+    bool dedup_;
+    tbb::concurrent_hash_map<SequenceKey, SequenceCopies, SequenceKeyHashCompare> sequence_copies_;
+    std::vector<uint64_t> seq_index_base_;
+    std::vector<uint32_t> seq_multiplicity_;
+    std::unordered_map<unsigned int, std::vector<unsigned int>> seq_copies_;
+
+    /*! With an incremental build split across shard_count_ processes, the
+     * files with file number shard_index_ mod shard_count_ are extracted,
+     * and the kmer partitions with that partition number are processed.
+     */
+    int shard_index_;
+    int shard_count_;
+
     /*! Number of threads to use for processing.
      */
     int n_threads_;
@@ -142,6 +377,10 @@ private:
     /*! Pathnames to all fasta files being processed.
      */
     tbb::concurrent_vector<fs::path> fasta_data_files_;
+
+    /*! Sequence cache holding parsed fasta files, if any.
+     */
+    const KseqCache *seq_cache_;
     
     
 };
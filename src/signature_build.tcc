@@ -1,14 +1,60 @@
 
-template <int K>
-SignatureBuilder<K>::SignatureBuilder(int n_threads, int max_seqs_per_file) :
+template <int K, typename Alphabet>
+SignatureBuilder<K, Alphabet>::SignatureBuilder(int n_threads, int max_seqs_per_file) :
     n_threads_(n_threads),
-    max_seqs_per_file_(max_seqs_per_file)
+    max_seqs_per_file_(max_seqs_per_file),
+    aggregation_(KmerAggregation::Multimap),
+    numa_extract_node_(size_t(0)),
+    spill_threshold_(0),
+    dedup_(false),
+    shard_index_(0),
+    shard_count_(1),
+    seq_cache_(nullptr)
 {
 }
 
 
-template <int K>
-void SignatureBuilder<K>::load_function_data(const std::vector<std::string> &good_functions,
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::set_spill(const fs::path &spill_dir, size_t memory_budget)
+{
+    aggregation_ = KmerAggregation::Spill;
+    spill_ = std::make_unique<KmerSpillFiles>(spill_dir, SpillPartitionBits);
+
+    /*
+     * A thread's buffer may momentarily hold a whole sequence past the
+     * threshold, so leave a little headroom.
+     */
+    size_t per_thread = memory_budget / std::max(n_threads_, 1) / sizeof(KmerRecord);
+    spill_threshold_ = std::max<size_t>(per_thread - per_thread / 16, 1);
+    if (spill_threshold_ < (1 << 16))
+	std::cerr << "memory budget of " << (memory_budget >> 20) << " MB allows only " << spill_threshold_
+		  << " kmer records per thread; the build will spill very often\n";
+    std::cerr << "spilling kmer records to " << spill_->directory() << " every " << spill_threshold_ << " records per thread\n";
+}
+
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::set_numa()
+{
+    aggregation_ = KmerAggregation::Sort;
+    numa_nodes_ = tbb::info::numa_nodes();
+    for (size_t i = 0; i < numa_nodes_.size(); i++)
+    {
+	numa_records_.emplace_back(std::make_unique<KmerRecordBuffers>());
+	numa_kept_kmers_.emplace_back(std::make_unique<KeptKmers<K, Alphabet>>());
+    }
+    std::cerr << "aggregating kmers on " << numa_nodes_.size() << " NUMA node" << (numa_nodes_.size() == 1 ? "" : "s") << "\n";
+}
+
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::set_contribution_store(const fs::path &dir)
+{
+    aggregation_ = KmerAggregation::Incremental;
+    contribution_store_ = std::make_unique<KmerContributionStore>(dir, std::to_string(K) + " " + Alphabet::name,
+								  SpillPartitionBits);
+}
+
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::load_function_data(const std::vector<std::string> &good_functions,
 					     const std::vector<std::string> &good_roles,
 					     const std::vector<fs::path> &function_definitions)
 {
@@ -22,20 +68,20 @@ void SignatureBuilder<K>::load_function_data(const std::vector<std::string> &goo
 
 }
 
-template <int K>
-void SignatureBuilder<K>::load_fasta(const std::vector<fs::path> &fasta_files,
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::load_fasta(const std::vector<fs::path> &fasta_files,
 				     bool keep_functions,
-				     const std::set<std::string> &deleted_fids)
+				     const std::set<std::string, std::less<>> &deleted_fids)
 {
+    fm_.load_fasta_files(fasta_files, false, deleted_fids, seq_cache_);
     for (auto fasta: fasta_files)
     {
-	fm_.load_fasta_file(fasta, false, deleted_fids);
 	all_fasta_data_.emplace_back(fasta);
     }
 }
 
-template <int K>
-void SignatureBuilder<K>::process_kept_functions(int min_reps_required, const fs::path &output_dir, std::set<std::string> &ignored_functions)
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::process_kept_functions(int min_reps_required, const fs::path &output_dir, std::set<std::string, std::less<>> &ignored_functions)
 {
     fm_.process_kept_functions(min_reps_required, ignored_functions);
     if (!output_dir.empty())
@@ -44,10 +90,19 @@ void SignatureBuilder<K>::process_kept_functions(int min_reps_required, const fs
     }
 }
 
-template <int K>
-void SignatureBuilder<K>::extract_kmers(const std::set<std::string> &deleted_fids)
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::extract_kmers(const std::set<std::string, std::less<>> &deleted_fids)
 {
-    if (n_threads_ < 2)
+    file_sequences_.assign(all_fasta_data_.size(), 0);
+    if (aggregation_ == KmerAggregation::Incremental)
+    {
+	extract_contributions(deleted_fids);
+    }
+    else if (!numa_nodes_.empty())
+    {
+	extract_numa_kmers(deleted_fids);
+    }
+    else if (n_threads_ < 2)
     {
 	for (unsigned i = 0; i < (unsigned) all_fasta_data_.size(); i++)
 	{
@@ -67,6 +122,171 @@ void SignatureBuilder<K>::extract_kmers(const std::set<std::string> &deleted_fid
 			      }
 			  });
     }
+
+    if (!sequence_copies_.empty())
+	collect_sequence_copies();
+}
+
+/*!
+  @brief Bring the contribution store up to date with the fasta files.
+
+  Contributions of files no longer in the build are removed. Each file's
+  contribution is reused if it is current and otherwise extracted and
+  written again. The sequence tables are then reduced to the per-function
+  sequence counts and the map to function indexes.
+ */
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::extract_contributions(const std::set<std::string, std::less<>> &deleted_fids)
+{
+    std::vector<fs::path> files(all_fasta_data_.begin(), all_fasta_data_.end());
+
+    /*
+     * With several shards the store is shared; stale contributions are
+     * removed by the merge (remove_stale_contributions()).
+     */
+    if (shard_count_ == 1)
+	contribution_store_->remove_stale(files);
+
+    size_t n = files.size();
+    contributions_.resize(n);
+    contribution_functions_.resize(n);
+    std::atomic<size_t> n_extracted(0), n_shard(0);
+
+    tbb::parallel_for(size_t(0), n, [this, &files, &deleted_fids, &n_extracted, &n_shard](size_t i) {
+	if (int(i % shard_count_) != shard_index_)
+	    return;
+	n_shard++;
+	auto contrib = contribution_store_->open(files[i]);
+	if (contrib && !contribution_current(*contrib, deleted_fids))
+	    contrib.reset();
+	if (!contrib)
+	{
+	    KmerContributionData data;
+	    extract_contribution(files[i], deleted_fids, data);
+	    extract_progress_.files++;
+	    extract_progress_.sequences += std::count_if(data.sequences.begin(), data.sequences.end(), [](const KmerContributionSequence &s) {
+		return s.function != NoContributionFunction;
+	    });
+	    extract_progress_.kmers += data.records.size();
+	    contrib = contribution_store_->write(files[i], data);
+	    n_extracted++;
+	}
+	if (shard_count_ == 1)
+	    add_contribution(i, std::move(contrib));
+    });
+    std::cerr << "extracted " << n_extracted << " of " << n_shard << " kmer contributions\n";
+}
+
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::remove_stale_contributions()
+{
+    std::vector<fs::path> files(all_fasta_data_.begin(), all_fasta_data_.end());
+    contribution_store_->remove_stale(files);
+}
+
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::load_contributions()
+{
+    std::vector<fs::path> files(all_fasta_data_.begin(), all_fasta_data_.end());
+    size_t n = files.size();
+    contributions_.resize(n);
+    contribution_functions_.resize(n);
+    file_sequences_.assign(n, 0);
+
+    tbb::parallel_for(size_t(0), n, [this, &files](size_t i) {
+	auto contrib = contribution_store_->open(files[i], false);
+	if (!contrib)
+	    throw std::runtime_error("no kmer contribution for " + files[i].string());
+	add_contribution(i, std::move(contrib));
+    });
+}
+
+/*! @brief Map a contribution's function numbers to function indexes and count
+  its sequences, in total and per function, then keep it for process_contributions().
+ */
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::add_contribution(size_t file_number, std::unique_ptr<KmerContribution> contrib)
+{
+    std::vector<FunctionIndex> &map = contribution_functions_[file_number];
+    for (auto &func: contrib->functions())
+	map.push_back(fm_.lookup_index(func));
+    uint32_t n_sequences = 0;
+    for (auto &seq: contrib->sequences())
+    {
+	if (seq.function == NoContributionFunction)
+	    continue;
+	n_sequences++;
+	if (map[seq.function] != UndefinedFunction)
+	    kmer_stats_.add_sequence(map[seq.function]);
+    }
+    file_sequences_[file_number] = n_sequences;
+    contrib->release_sequences();
+    contributions_[file_number] = std::move(contrib);
+}
+
+/*! @brief Extract the kmer records and sequence table of a fasta file.
+
+  Follows load_kmers_from_fasta() and load_kmers_from_sequence(), except
+  that records are kept for every sequence with a function whether or
+  not the function is kept.
+ */
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::extract_contribution(const fs::path &file, const std::set<std::string, std::less<>> &deleted_fids,
+							  KmerContributionData &data)
+{
+    std::map<std::string, uint16_t> function_numbers;
+    uint32_t next_sequence_id = 0;
+
+    FastaParser parser;
+    parser.parse(file, seq_cache_, [this, &data, &function_numbers, &next_sequence_id, &deleted_fids](std::string_view id, std::string_view def, std::string_view seq) {
+	if (deleted_fids.find(id) != deleted_fids.end())
+	{
+	    data.sequences.push_back(KmerContributionSequence { std::string(id), NoContributionFunction, true });
+	    return;
+	}
+	if (id.empty())
+	    return;
+
+	const std::string &func = fm_.lookup_function(id);
+	if (func.empty())
+	{
+	    data.sequences.push_back(KmerContributionSequence { std::string(id), NoContributionFunction, false });
+	    return;
+	}
+
+	auto ins = function_numbers.emplace(func, static_cast<uint16_t>(data.functions.size()));
+	if (ins.second)
+	    data.functions.push_back(func);
+	uint16_t function = ins.first->second;
+	data.sequences.push_back(KmerContributionSequence { std::string(id), function, false });
+
+	uint32_t seq_id = next_sequence_id++;
+	uint32_t seq_len = static_cast<uint32_t>(seq.length());
+	for_each_kmer<K, Alphabet>(seq, [&data, function, seq_id, seq_len](const Kmer<K, Alphabet> &kmer, size_t offset) {
+	    unsigned short n = static_cast<unsigned short>(seq_len - offset);
+	    data.records.push_back(KmerRecord { kmer.bits, seq_id, seq_len, function, n });
+	});
+    });
+}
+
+/*! @brief Whether every sequence of a contribution still has its recorded function and deleted state. */
+template <int K, typename Alphabet>
+bool SignatureBuilder<K, Alphabet>::contribution_current(const KmerContribution &contrib,
+							  const std::set<std::string, std::less<>> &deleted_fids)
+{
+    static const std::string no_function;
+    for (auto &seq: contrib.sequences())
+    {
+	bool deleted = deleted_fids.find(seq.id) != deleted_fids.end();
+	if (deleted != seq.deleted)
+	    return false;
+	if (deleted)
+	    continue;
+	const std::string &recorded = seq.function == NoContributionFunction ? no_function : contrib.functions()[seq.function];
+	if (fm_.lookup_function(seq.id) != recorded)
+	    return false;
+    }
+    return true;
 }
 
 /*!
@@ -80,25 +300,32 @@ void SignatureBuilder<K>::extract_kmers(const std::set<std::string> &deleted_fid
   to process so skip this sequence.
   
  */
-template <int K>
-void SignatureBuilder<K>::load_kmers_from_fasta(unsigned file_number, const fs::path &file,
-						const std::set<std::string> &deleted_fids)
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::load_kmers_from_fasta(unsigned file_number, const fs::path &file,
+						const std::set<std::string, std::less<>> &deleted_fids)
 {
-    fs::ifstream ifstr(file);
-
     FastaParser parser;
     
-    unsigned next_sequence_id = file_number * max_seqs_per_file_;
+    unsigned first_sequence_id = file_number * max_seqs_per_file_;
+    unsigned next_sequence_id = first_sequence_id;
+    uint64_t n_sequences = 0, n_kmers = 0;
 
-    parser.set_def_callback([this, &next_sequence_id, &deleted_fids](const std::string &id, const std::string &def, const std::string &seq) {
+    parser.parse(file, seq_cache_, [this, &next_sequence_id, &deleted_fids, &n_sequences, &n_kmers](std::string_view id, std::string_view def, std::string_view seq) {
 	if (deleted_fids.find(id) == deleted_fids.end())
 	{
-	    load_kmers_from_sequence(next_sequence_id, id, def, seq);
+	    size_t n = load_kmers_from_sequence(next_sequence_id, id, def, seq);
+	    if (n > 0)
+	    {
+		n_sequences++;
+		n_kmers += n;
+	    }
 	}
-	return 0;
     });
-    parser.parse(ifstr);
-    parser.parse_complete();
+    file_sequences_[file_number] = next_sequence_id - first_sequence_id;
+
+    extract_progress_.files++;
+    extract_progress_.sequences += n_sequences;
+    extract_progress_.kmers += n_kmers;
 }
 
 /*!
@@ -107,24 +334,24 @@ void SignatureBuilder<K>::load_kmers_from_fasta(unsigned file_number, const fs::
   Use the provided FunctionMap to look up the function for the given sequence. If it is not present,
   skip this sequence.
 
-  Update KmerStatistics::seqs_with_func to reflect the additional sequence having this function.
+  Update the KmerStatistics sequence count of this function to reflect the additional sequence having this function.
 
   For each kmer in the sequence,
 
-  - If kmer has no invalid characters, insert it into the @ref KmerAttributeMap. This logs the existence
+  - If kmer has no invalid residues (see for_each_kmer()), insert it into the @ref KmerAttributeMap. This logs the existence
   of the kmer with the given function, offset from the end of its protein, and length of the source protein.
 
-  
+  Returns the number of kmers loaded.
 */
 
-template <int K>
-void SignatureBuilder<K>::load_kmers_from_sequence(unsigned int &next_sequence_id,
-						   const std::string &id, const std::string &def, const std::string &seq)
+template <int K, typename Alphabet>
+size_t SignatureBuilder<K, Alphabet>::load_kmers_from_sequence(unsigned int &next_sequence_id,
+						     std::string_view id, std::string_view def, std::string_view seq)
 {
     if (id.empty())
-	return;
+	return 0;
 
-    std::string func = fm_.lookup_function(id);
+    const std::string &func = fm_.lookup_function(id);
     
     /*
      * Empty means empty (and perhaps deleted feature).
@@ -132,7 +359,7 @@ void SignatureBuilder<K>::load_kmers_from_sequence(unsigned int &next_sequence_i
     
     if (func.empty())
     {
-	return;
+	return 0;
     }
     
     unsigned int seq_id = next_sequence_id++;
@@ -154,41 +381,106 @@ void SignatureBuilder<K>::load_kmers_from_sequence(unsigned int &next_sequence_i
 
     if (function_index == UndefinedFunction)
     {
-    	return;
+    	return 0;
     }
 
-    kmer_stats_.seqs_with_func[function_index]++;
+    kmer_stats_.add_sequence(function_index);
 
-    for (auto it = seq.begin(); it < seq.end() - K + 1; it++)
+    unsigned int seq_len = static_cast<unsigned int>(seq.length());
+    size_t n_kmers = 0;
+    if (aggregation_ == KmerAggregation::Online)
     {
-        unsigned short n = (unsigned short) std::distance(it, seq.end());
-	Kmer<K> kmer;
-	bool ok = true;
-	std::copy_n(it, K, kmer.begin());
-	for (auto x: kmer)
-	{
-	    if (ok_prot_.find(x) == ok_prot_.end())
-	    {
-		ok = false;
-		break;
-	    }
-	}
-	if (ok)
-	{
-	    kmer_attributes_.insert({kmer, { function_index, UndefinedOTU, n, seq_id, static_cast<unsigned int>(seq.length())}});
-	}
+	for_each_kmer<K, Alphabet>(seq, [this, function_index, seq_len, &n_kmers](const Kmer<K, Alphabet> &kmer, size_t offset) {
+	    unsigned short n = static_cast<unsigned short>(seq_len - offset);
+	    typename KmerSummaryMap::accessor acc;
+	    kmer_summaries_.insert(acc, kmer);
+	    acc->second.add(function_index, n, static_cast<unsigned short>(seq_len));
+	    n_kmers++;
+	});
+	return n_kmers;
     }
+
+    if (dedup_ && !first_sequence_copy(seq, function_index, seq_id))
+	return 0;
+
+    if (!numa_nodes_.empty())
+    {
+	/*
+	 * Route each record to this thread's buffer for the node that
+	 * aggregates its kmer, counting the records by the node they go to.
+	 */
+	size_t n_nodes = numa_records_.size();
+	std::vector<std::vector<KmerRecord> *> records(n_nodes);
+	for (size_t i = 0; i < n_nodes; i++)
+	    records[i] = &numa_records_[i]->local();
+	std::vector<uint64_t> &routed = numa_routed_.local();
+	if (routed.empty())
+	    routed.resize(n_nodes * n_nodes);
+	uint64_t *from_node = routed.data() + numa_extract_node_.local() * n_nodes;
+	for_each_kmer<K, Alphabet>(seq, [this, &records, from_node, function_index, seq_id, seq_len, &n_kmers](const Kmer<K, Alphabet> &kmer, size_t offset) {
+	    unsigned short n = static_cast<unsigned short>(seq_len - offset);
+	    size_t node = numa_node(kmer.bits);
+	    records[node]->push_back(KmerRecord { kmer.bits, seq_id, seq_len, function_index, n });
+	    from_node[node]++;
+	    n_kmers++;
+	});
+	return n_kmers;
+    }
+    if (aggregation_ != KmerAggregation::Multimap)
+    {
+	std::vector<KmerRecord> &records = kmer_records_.local();
+	size_t start = records.size();
+	for_each_kmer<K, Alphabet>(seq, [&records, function_index, seq_id, seq_len](const Kmer<K, Alphabet> &kmer, size_t offset) {
+	    unsigned short n = static_cast<unsigned short>(seq_len - offset);
+	    records.push_back(KmerRecord { kmer.bits, seq_id, seq_len, function_index, n });
+	});
+	n_kmers = records.size() - start;
+	if (aggregation_ == KmerAggregation::Spill && records.size() >= spill_threshold_)
+	    spill_->spill(records);
+	return n_kmers;
+    }
+
+    for_each_kmer<K, Alphabet>(seq, [this, function_index, seq_id, seq_len, &n_kmers](const Kmer<K, Alphabet> &kmer, size_t offset) {
+	unsigned short n = static_cast<unsigned short>(seq_len - offset);
+	kmer_attributes_.insert({kmer, { function_index, UndefinedOTU, n, seq_id, seq_len}});
+	n_kmers++;
+    });
+    return n_kmers;
 }
 
-template <int K>
-void SignatureBuilder<K>::process_kmers()
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::process_kmers()
 {
-    tbb::parallel_for(kmer_attributes_.range(), [this](auto r) {
+    /*
+     * The online summaries do not record sequence ids.
+     */
+    if (aggregation_ != KmerAggregation::Online)
+	kmer_stats_.init_sequences(file_sequences_, max_seqs_per_file_);
+
+    if (aggregation_ == KmerAggregation::Sort)
+    {
+	process_sorted_kmers();
+    }
+    else if (aggregation_ == KmerAggregation::Spill)
+    {
+	process_spilled_kmers();
+    }
+    else if (aggregation_ == KmerAggregation::Online)
+    {
+	process_kmer_summaries();
+    }
+    else if (aggregation_ == KmerAggregation::Incremental)
+    {
+	process_contributions();
+    }
+    else
+    {
+	tbb::parallel_for(kmer_attributes_.range(), [this](auto r) {
 	    KmerSet cur_set;
-	    Kmer<K> cur { 0 };
+	    Kmer<K, Alphabet> cur;
 	    for (auto ent = r.begin(); ent != r.end(); ent++)
 	    {
-		const Kmer<K> &kmer = ent->first;
+		const Kmer<K, Alphabet> &kmer = ent->first;
 		KmerAttributes &attr = ent->second;
 
 		if (kmer != cur)
@@ -200,23 +492,539 @@ void SignatureBuilder<K>::process_kmers()
 		    cur_set.kmer = kmer;
 		    cur = kmer;
 		}
-		cur_set.func_count[attr.func_index]++;
-		cur_set.count++;
+		uint32_t m = multiplicity(attr.seq_id);
+		cur_set.func_count[attr.func_index] += m;
+		cur_set.count += m;
 		cur_set.set.emplace_back(attr);
 	    }
 	    process_kmer_set(cur_set);
 	});
+    }
 
     std::cout << "Kept " << kept_kmers_.size() << " kmers\n";
-    std::cout << "distinct_signatures=" << kmer_stats_.distinct_signatures << "\n";
-    std::cout << "num_seqs_with_a_signature=" << kmer_stats_.seqs_with_a_signature.size() << "\n";
+    std::cout << "distinct_signatures=" << kmer_stats_.distinct_signatures() << "\n";
+    if (aggregation_ != KmerAggregation::Online)
+	std::cout << "num_seqs_with_a_signature=" << kmer_stats_.seqs_with_a_signature() << "\n";
+}
+
+/*! @brief Group the sorted kmer records and process each kmer's set.
+
+  Each partition of the sorted records holds complete groups, so the
+  partitions are processed in parallel.
+ */
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::process_sorted_kmers()
+{
+    if (!numa_nodes_.empty())
+    {
+	process_numa_kmers();
+	return;
+    }
+
+    std::vector<size_t> partition_start;
+    std::vector<KmerRecord> sorted = sort_kmer_records(kmer_records_, Kmer<K, Alphabet>::bits_used,
+						       SortPartitionBits, partition_start);
+    std::cerr << "sorted " << sorted.size() << " kmer records\n";
+
+    tbb::parallel_for(size_t(0), partition_start.size() - 1, [this, &sorted, &partition_start](size_t p) {
+	process_kmer_records(sorted.data() + partition_start[p], sorted.data() + partition_start[p + 1]);
+    });
+}
+
+/*! @brief One task arena on each NUMA node, sharing the build's threads among them. */
+template <int K, typename Alphabet>
+std::vector<std::unique_ptr<tbb::task_arena>> SignatureBuilder<K, Alphabet>::make_numa_arenas()
+{
+    size_t n_nodes = numa_nodes_.size();
+    int threads_per_node = std::max(1, (n_threads_ + int(n_nodes) - 1) / int(n_nodes));
+
+    std::vector<std::unique_ptr<tbb::task_arena>> arenas;
+    for (size_t i = 0; i < n_nodes; i++)
+    {
+	int concurrency = std::min(threads_per_node, tbb::info::default_concurrency(numa_nodes_[i]));
+	arenas.emplace_back(std::make_unique<tbb::task_arena>(tbb::task_arena::constraints(numa_nodes_[i], concurrency)));
+    }
+    return arenas;
+}
+
+/*! @brief Extract the kmers of the fasta files in an arena on each NUMA node.
+
+  The files are dealt out to the nodes in turn. A thread records the node
+  it is extracting for, so the records it routes to each node are counted
+  by origin.
+ */
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::extract_numa_kmers(const std::set<std::string, std::less<>> &deleted_fids)
+{
+    size_t n_nodes = numa_nodes_.size();
+    size_t n_files = all_fasta_data_.size();
+    auto arenas = make_numa_arenas();
+    std::vector<tbb::task_group> groups(n_nodes);
+    for (size_t i = 0; i < n_nodes; i++)
+    {
+	arenas[i]->execute([this, i, n_nodes, n_files, &groups, &deleted_fids] {
+	    groups[i].run([this, i, n_nodes, n_files, &deleted_fids] {
+		size_t n_mine = (n_files + n_nodes - 1 - i) / n_nodes;
+		tbb::parallel_for(size_t(0), n_mine, [this, i, n_nodes, &deleted_fids](size_t j) {
+		    size_t file = i + j * n_nodes;
+		    numa_extract_node_.local() = i;
+		    load_kmers_from_fasta((unsigned) file, all_fasta_data_[file], deleted_fids);
+		});
+	    });
+	});
+    }
+    for (size_t i = 0; i < n_nodes; i++)
+	arenas[i]->execute([i, &groups] { groups[i].wait(); });
+}
+
+/*! @brief Sort and group each NUMA node's records in an arena on that node.
+
+  The arenas run concurrently, each split among its node's share of the
+  threads. A node reads the records routed to it once; those extracted on
+  another node are read across nodes, and their number is reported. Its
+  sorted copy, the grouping and its kept kmer table are allocated and
+  used only by its own threads. Each node then inserts its kept kmers
+  into kept_kmers_ from its own arena.
+ */
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::process_numa_kmers()
+{
+    size_t n_nodes = numa_nodes_.size();
+    auto arenas = make_numa_arenas();
+    std::vector<tbb::task_group> groups(n_nodes);
+    std::vector<size_t> n_records(n_nodes, 0);
+    for (size_t i = 0; i < n_nodes; i++)
+    {
+	arenas[i]->execute([this, i, &groups, &n_records] {
+	    groups[i].run([this, i, &n_records] {
+		std::vector<size_t> partition_start;
+		std::vector<KmerRecord> sorted = sort_kmer_records(*numa_records_[i], Kmer<K, Alphabet>::bits_used,
+								   SortPartitionBits, partition_start);
+		n_records[i] = sorted.size();
+		tbb::parallel_for(size_t(0), partition_start.size() - 1, [this, &sorted, &partition_start](size_t p) {
+		    process_kmer_records(sorted.data() + partition_start[p], sorted.data() + partition_start[p + 1]);
+		});
+	    });
+	});
+    }
+    for (size_t i = 0; i < n_nodes; i++)
+	arenas[i]->execute([i, &groups] { groups[i].wait(); });
+
+    /*
+     * routed[from * n_nodes + to] records were extracted on node from and
+     * aggregated on node to.
+     */
+    std::vector<uint64_t> routed(n_nodes * n_nodes, 0);
+    numa_routed_.combine_each([&routed](const std::vector<uint64_t> &r) {
+	for (size_t k = 0; k < r.size(); k++)
+	    routed[k] += r[k];
+    });
+    uint64_t n_total = 0, n_remote = 0;
+    for (size_t i = 0; i < n_nodes; i++)
+    {
+	uint64_t remote = 0;
+	for (size_t from = 0; from < n_nodes; from++)
+	    if (from != i)
+		remote += routed[from * n_nodes + i];
+	std::cerr << "NUMA node " << numa_nodes_[i] << ": " << n_records[i] << " kmer records, "
+		  << remote << " of them extracted on other nodes, " << numa_kept_kmers_[i]->size() << " kept kmers\n";
+	n_total += n_records[i];
+	n_remote += remote;
+    }
+    std::cerr << "kmer records read across NUMA nodes: " << n_remote << " of " << n_total
+	      << " (" << n_remote * sizeof(KmerRecord) << " bytes)\n";
+
+    size_t n_kept = 0;
+    for (auto &kept: numa_kept_kmers_)
+	n_kept += kept->size();
+    kept_kmers_.rehash(kept_kmers_.size() + n_kept);
+    for (size_t i = 0; i < n_nodes; i++)
+    {
+	arenas[i]->execute([this, i, &groups] {
+	    groups[i].run([this, i] {
+		tbb::parallel_for(numa_kept_kmers_[i]->range(), [this](auto r) {
+		    for (auto ent = r.begin(); ent != r.end(); ent++)
+			kept_kmers_.emplace(ent->first, ent->second);
+		});
+	    });
+	});
+    }
+    for (size_t i = 0; i < n_nodes; i++)
+	arenas[i]->execute([i, &groups] { groups[i].wait(); });
+    numa_kept_kmers_.clear();
+}
+
+/*! @brief Spill the remaining records, then read back and process each spill partition.
+
+  Partitions are processed in parallel; each is freed as soon as its
+  kmers have been processed.
+ */
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::process_spilled_kmers()
+{
+    tbb::parallel_for_each(kmer_records_.begin(), kmer_records_.end(), [this](std::vector<KmerRecord> &records) {
+	spill_->spill(records);
+	std::vector<KmerRecord>().swap(records);
+    });
+    spill_->finish();
+    std::cerr << "spilled " << spill_->records_spilled() << " kmer records in " << spill_->n_partitions()
+	      << " partitions; largest partition " << spill_->largest_partition() << " records\n";
+
+    /*
+     * Each thread reads one whole partition at a time, so split the
+     * partitions larger than a thread's share of the budget.
+     */
+    std::vector<size_t> partitions;
+    std::vector<size_t> work;
+    for (size_t p = 0; p < spill_->n_partitions(); p++)
+	work.push_back(p);
+    size_t n_split = 0;
+    while (!work.empty())
+    {
+	size_t p = work.back();
+	work.pop_back();
+	if (spill_->partition_records(p) <= spill_threshold_)
+	{
+	    partitions.push_back(p);
+	    continue;
+	}
+	std::vector<size_t> parts = spill_->split_partition(p, spill_threshold_);
+	if (parts.size() == 1 && parts[0] == p)
+	    partitions.push_back(p);
+	else
+	{
+	    n_split++;
+	    work.insert(work.end(), parts.begin(), parts.end());
+	}
+    }
+    if (n_split > 0)
+	std::cerr << "split " << n_split << " spill partitions to fit the memory budget; largest partition now "
+		  << spill_->largest_partition() << " records\n";
+
+    tbb::parallel_for(size_t(0), partitions.size(), [this, &partitions](size_t i) {
+	std::vector<KmerRecord> records = spill_->read_partition(partitions[i]);
+	process_kmer_records(records.data(), records.data() + records.size());
+    });
+    spill_.reset();
+}
+
+/*! @brief Merge the contributions one partition at a time.
+
+  The partitions are taken in batches of one per thread. Each
+  contribution file is opened once per batch and the batch's slices read
+  from it, so no file is held open or mapped between batches and about a
+  thread's share of the records is in memory at once.
+
+  The records of a slice are given the build's sequence ids and function
+  indexes; records of functions that are not kept are dropped. A slice
+  is sorted by kmer, and the build's sequence ids keep that order, so the
+  slices of a partition are merged with a heap of their next records
+  rather than sorted again.
+ */
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::process_contributions()
+{
+    struct Slice
+    {
+	KmerRecord next;
+	const KmerRecord *rest;
+	const KmerRecord *end;
+	size_t contribution;
+    };
+    auto later = [](const Slice &a, const Slice &b) { return kmer_record_less(b.next, a.next); };
+
+    /*
+     * Load a slice's next record with a kept function, if any.
+     */
+    auto advance = [this](Slice &s) {
+	const std::vector<FunctionIndex> &map = contribution_functions_[s.contribution];
+	while (s.rest != s.end)
+	{
+	    KmerRecord r = *s.rest++;
+	    r.func_index = map[r.func_index];
+	    if (r.func_index == UndefinedFunction)
+		continue;
+	    r.seq_id += static_cast<uint32_t>(s.contribution * max_seqs_per_file_);
+	    s.next = r;
+	    return true;
+	}
+	return false;
+    };
+
+    std::vector<size_t> parts;
+    for (size_t p = 0; p < contribution_store_->n_partitions(); p++)
+	if (int(p % shard_count_) == shard_index_)
+	    parts.push_back(p);
+
+    size_t n_contributions = contributions_.size();
+    size_t batch_size = std::max(n_threads_, 1);
+    for (size_t b = 0; b < parts.size(); b += batch_size)
+    {
+	std::vector<size_t> batch(parts.begin() + b, parts.begin() + std::min(b + batch_size, parts.size()));
+
+	std::vector<std::vector<KmerRecord>> slices(n_contributions);
+	std::vector<std::vector<size_t>> slice_start(n_contributions);
+	tbb::parallel_for(size_t(0), n_contributions, [this, &batch, &slices, &slice_start](size_t i) {
+	    contributions_[i]->read_partitions(batch, slices[i], slice_start[i]);
+	});
+
+	tbb::parallel_for(size_t(0), batch.size(), [this, n_contributions, &slices, &slice_start, &later, &advance](size_t j) {
+	    std::vector<Slice> heap;
+	    size_t n_records = 0;
+	    for (size_t i = 0; i < n_contributions; i++)
+	    {
+		const KmerRecord *first = slices[i].data() + slice_start[i][j];
+		const KmerRecord *last = slices[i].data() + slice_start[i][j + 1];
+		n_records += last - first;
+		Slice s { KmerRecord(), first, last, i };
+		if (advance(s))
+		    heap.push_back(s);
+	    }
+	    std::make_heap(heap.begin(), heap.end(), later);
+
+	    std::vector<KmerRecord> records;
+	    records.reserve(n_records);
+	    while (!heap.empty())
+	    {
+		std::pop_heap(heap.begin(), heap.end(), later);
+		Slice &s = heap.back();
+		records.push_back(s.next);
+		if (advance(s))
+		    std::push_heap(heap.begin(), heap.end(), later);
+		else
+		    heap.pop_back();
+	    }
+	    process_kmer_records(records.data(), records.data() + records.size());
+	});
+    }
+    contributions_.clear();
+    contribution_functions_.clear();
+}
+
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::save_function_checkpoint(const fs::path &file)
+{
+    fs::path tmp = file;
+    tmp += ".tmp";
+    fs::ofstream out(tmp, std::ios::binary);
+    uint64_t n = all_fasta_data_.size();
+    out.write(reinterpret_cast<const char *>(&n), sizeof(n));
+    for (auto &f: all_fasta_data_)
+    {
+	std::string name = f.string();
+	uint64_t len = name.size();
+	out.write(reinterpret_cast<const char *>(&len), sizeof(len));
+	out.write(name.data(), len);
+    }
+    fm_.save_assignments(out);
+    out.close();
+    if (!out)
+	throw std::runtime_error("error writing function checkpoint " + tmp.string());
+    fs::rename(tmp, file);
+}
+
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::load_function_checkpoint(const fs::path &file)
+{
+    fs::ifstream in(file, std::ios::binary);
+    uint64_t n;
+    if (!in.read(reinterpret_cast<char *>(&n), sizeof(n)))
+	throw std::runtime_error("cannot read function checkpoint " + file.string());
+    for (uint64_t i = 0; i < n; i++)
+    {
+	uint64_t len;
+	std::string name;
+	if (!in.read(reinterpret_cast<char *>(&len), sizeof(len)))
+	    break;
+	name.resize(len);
+	if (!in.read(&name[0], len))
+	    break;
+	all_fasta_data_.emplace_back(name);
+    }
+    if (all_fasta_data_.size() != n || !fm_.load_assignments(in))
+	throw std::runtime_error("truncated function checkpoint " + file.string());
+}
+
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::write_kept_kmers(const fs::path &file)
+{
+    std::vector<std::pair<uint64_t, StoredKmerData>> kmers;
+    kmers.reserve(kept_kmers_.size());
+    for (auto &ent: kept_kmers_)
+	kmers.emplace_back(ent.first.bits, ent.second.stored_data);
+    std::sort(kmers.begin(), kmers.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+
+    fs::path tmp = file;
+    tmp += ".tmp";
+    fs::ofstream out(tmp, std::ios::binary);
+    uint64_t n = kmers.size();
+    out.write(reinterpret_cast<const char *>(&n), sizeof(n));
+    for (auto &k: kmers)
+    {
+	out.write(reinterpret_cast<const char *>(&k.first), sizeof(k.first));
+	out.write(reinterpret_cast<const char *>(&k.second), sizeof(k.second));
+    }
+    kmer_stats_.save(out);
+    out.close();
+    if (!out)
+	throw std::runtime_error("error writing kept kmers to " + tmp.string());
+    fs::rename(tmp, file);
+}
+
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::read_kept_kmers(const fs::path &file)
+{
+    fs::ifstream in(file, std::ios::binary);
+    uint64_t n;
+    if (!in.read(reinterpret_cast<char *>(&n), sizeof(n)))
+	throw std::runtime_error("cannot read kept kmers from " + file.string());
+    for (uint64_t i = 0; i < n; i++)
+    {
+	Kmer<K, Alphabet> kmer;
+	StoredKmerData data;
+	in.read(reinterpret_cast<char *>(&kmer.bits), sizeof(kmer.bits));
+	in.read(reinterpret_cast<char *>(&data), sizeof(data));
+	if (!in)
+	    throw std::runtime_error("truncated kept kmers file " + file.string());
+	keep_kmer(kmer, data);
+    }
+    if (!kmer_stats_.load(in))
+	std::cerr << "Warning: " << file << " has no sequence statistics; function coverage will not be written\n";
+}
+
+/*! @brief Group a range of records sorted by kmer and process each kmer's set.
+ */
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::process_kmer_records(const KmerRecord *begin, const KmerRecord *end)
+{
+    KmerSet cur_set;
+    for (const KmerRecord *rec = begin; rec != end; rec++)
+    {
+	if (cur_set.count == 0 || rec->kmer != cur_set.kmer.bits)
+	{
+	    if (cur_set.count > 0)
+		process_kmer_set(cur_set);
+	    cur_set.reset();
+	    cur_set.kmer.bits = rec->kmer;
+	}
+	uint32_t m = multiplicity(rec->seq_id);
+	cur_set.func_count[rec->func_index] += m;
+	cur_set.count += m;
+	cur_set.set.emplace_back(rec->attributes());
+    }
+    if (cur_set.count > 0)
+	process_kmer_set(cur_set);
+}
+
+/*! @brief Apply the process_kmer_set() selection to each kmer summary.
+
+  The summaries are released as they are processed.
+ */
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::process_kmer_summaries()
+{
+    std::cerr << "summarized " << kmer_summaries_.size() << " distinct kmers\n";
+
+    tbb::parallel_for(kmer_summaries_.range(), [this](auto r) {
+	for (auto ent = r.begin(); ent != r.end(); ent++)
+	{
+	    const KmerSummary &summary = ent->second;
+	    const FunctionSlot *best = summary.best();
+	    if (!best || (float) best->count < float(summary.count()) * 0.8f)
+		continue;
+
+	    keep_kmer(ent->first, StoredKmerData { summary.median_offset(), best->func_index,
+			static_cast<unsigned short>(best->length_mean),
+			static_cast<unsigned short>(best->length_median.estimate()),
+			static_cast<unsigned short>(best->length_variance()) });
+	}
+    });
+    kmer_summaries_.clear();
+}
+
+/*! @brief Write bucket occupancy statistics for the kmer containers.
+
+  Must not be called while kmers are being inserted.
+ */
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::report_bucket_occupancy(std::ostream &os)
+{
+    ::report_bucket_occupancy(os, "kmer_attributes", kmer_attributes_);
+    ::report_bucket_occupancy(os, "kept_kmers", kept_kmers_);
+}
+
+/*! @brief Record a sequence in the set of distinct (sequence, function) pairs.
+
+  Returns true if it is the first copy of its pair, whose kmers are to
+  be extracted; otherwise it is added to the copies of the first.
+ */
+template <int K, typename Alphabet>
+bool SignatureBuilder<K, Alphabet>::first_sequence_copy(std::string_view seq, FunctionIndex function_index, unsigned int seq_id)
+{
+    typename decltype(sequence_copies_)::accessor acc;
+    if (sequence_copies_.insert(acc, SequenceKey { sequence_digest(seq), function_index }))
+    {
+	acc->second.first_seq_id = seq_id;
+	return true;
+    }
+    acc->second.copies.push_back(seq_id);
+    return false;
+}
+
+/*! @brief Reduce the distinct sequences seen in extraction to each sequence's
+  multiplicity and the copies of each sequence that has any.
+ */
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::collect_sequence_copies()
+{
+    seq_index_base_.resize(file_sequences_.size());
+    uint64_t n = 0;
+    for (size_t i = 0; i < file_sequences_.size(); i++)
+    {
+	seq_index_base_[i] = n;
+	n += file_sequences_[i];
+    }
+    seq_multiplicity_.assign(n, 1);
+
+    size_t n_copies = 0;
+    for (auto &ent: sequence_copies_)
+    {
+	SequenceCopies &c = ent.second;
+	if (c.copies.empty())
+	    continue;
+	unsigned int id = c.first_seq_id;
+	seq_multiplicity_[seq_index_base_[id / max_seqs_per_file_] + id % max_seqs_per_file_] = static_cast<uint32_t>(c.copies.size() + 1);
+	n_copies += c.copies.size();
+	seq_copies_.emplace(id, std::move(c.copies));
+    }
+    std::cerr << "extracted kmers of " << sequence_copies_.size() << " distinct sequences; "
+	      << n_copies << " identical copies collapsed\n";
+    sequence_copies_.clear();
+}
+
+template <int K, typename Alphabet>
+std::vector<std::pair<std::string, size_t>> SignatureBuilder<K, Alphabet>::container_sizes()
+{
+    size_t n_records = 0;
+    for (auto &records: kmer_records_)
+	n_records += records.size();
+    for (auto &node: numa_records_)
+	for (auto &records: *node)
+	    n_records += records.size();
+
+    return {
+	{ "kmer_attributes", kmer_attributes_.size() },
+	{ "kmer_records", n_records },
+	{ "kmer_summaries", kmer_summaries_.size() },
+	{ "kept_kmers", kept_kmers_.size() }
+    };
 }
 
 /*! @brief Process a set of instances of a given kmer.
 
  */
-template <int K>
-void SignatureBuilder<K>::process_kmer_set(KmerSet &set)
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::process_kmer_set(KmerSet &set)
 {
     FunctionIndex best_func_1 = UndefinedFunction, best_func_2 = UndefinedFunction;
     int best_count_1 = -1, best_count_2 = -1;
@@ -265,13 +1073,24 @@ void SignatureBuilder<K>::process_kmer_set(KmerSet &set)
 
     for (auto item: set.set)
     {
-	if (item.func_index == best_func)
+	/*
+	 * An item with multiplicity m stands for m identical sequences.
+	 */
+	uint32_t m = multiplicity(item.seq_id);
+	for (uint32_t i = 0; i < m; i++)
 	{
-//	    seqs_containing_func++;
-	    acc(item.protein_length);
+	    if (item.func_index == best_func)
+	    {
+//		seqs_containing_func++;
+		acc(item.protein_length);
+	    }
+	    offsets.push_back(item.offset);
+	}
+	if (kmer_stats_.add_signature_sequence(item.seq_id, item.func_index) && m > 1)
+	{
+	    for (unsigned int copy: seq_copies_.find(item.seq_id)->second)
+		kmer_stats_.add_signature_sequence(copy, item.func_index);
 	}
-	offsets.push_back(item.offset);
-	kmer_stats_.seqs_with_a_signature.insert(item.seq_id);
     }
 
     unsigned short mean = acc::mean(acc);
@@ -282,13 +1101,21 @@ void SignatureBuilder<K>::process_kmer_set(KmerSet &set)
     unsigned short avg_from_end = offsets[offsets.size() / 2];
     // std::cout << seqs_containing_func << " " << avg_from_end<< "\n";
 
-    kmer_stats_.distinct_signatures++;
-    kmer_stats_.distinct_functions[best_func]++;
+    keep_kmer(set.kmer, { avg_from_end, best_func, mean, median, var });
+}
 
-    kept_kmers_.emplace(set.kmer, KeptKmer<K> { set.kmer, { avg_from_end, best_func, mean, median, var }
-	    // , (unsigned int) set.set.size()
-	    // , seqs_containing_func
-	});
+template <int K, typename Alphabet>
+void SignatureBuilder<K, Alphabet>::keep_kmer(const Kmer<K, Alphabet> &kmer, const StoredKmerData &data)
+{
+    KeptKmers<K, Alphabet> &kept = numa_kept_kmers_.empty() ? kept_kmers_ : *numa_kept_kmers_[numa_node(kmer.bits)];
 
+    /*
+     * A sharded merge may see kmers this builder already kept; count each once.
+     */
+    if (kept.emplace(kmer, KeptKmer<K, Alphabet> { kmer, data
+		// , (unsigned int) set.set.size()
+		// , seqs_containing_func
+	    }).second)
+	kmer_stats_.add_signature(data.function_index);
 }
 
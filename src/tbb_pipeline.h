@@ -0,0 +1,15 @@
+#ifndef _tbb_pipeline_h
+#define _tbb_pipeline_h
+
+/*
+ * oneTBB moved the pipeline to parallel_pipeline.h and renamed the filter modes.
+ */
+#if __has_include(<tbb/parallel_pipeline.h>)
+#include <tbb/parallel_pipeline.h>
+#define TBB_FILTER_MODE tbb::filter_mode
+#else
+#include <tbb/pipeline.h>
+#define TBB_FILTER_MODE tbb::filter
+#endif
+
+#endif // _tbb_pipeline_h
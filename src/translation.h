@@ -0,0 +1,127 @@
+#ifndef _translation_h
+#define _translation_h
+
+/*!
+  @file translation.h
+  @brief Table-driven six-frame translation of nucleotide sequence.
+
+  Bases are coded T=0, C=1, A=2, G=3 so that a codon's code is the
+  index of its amino acid in the NCBI genetic code strings, and the
+  complement of a base is its code xor 2. Any other character codes as
+  4; a codon containing one translates to 'X', which is not a valid kmer
+  residue, so kmers never span it.
+*/
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+const uint8_t InvalidBase = 4;
+
+struct CodonTable
+{
+    uint8_t base[256];
+    char aa[64];
+
+    constexpr CodonTable(const char *code) : base{}, aa{} {
+	for (int i = 0; i < 256; i++)
+	    base[i] = InvalidBase;
+	const char *bases = "TCAG";
+	for (int i = 0; i < 4; i++)
+	{
+	    base[static_cast<unsigned char>(bases[i])] = static_cast<uint8_t>(i);
+	    base[static_cast<unsigned char>(bases[i] - 'A' + 'a')] = static_cast<uint8_t>(i);
+	}
+	base['U'] = base['u'] = 0;
+	for (int i = 0; i < 64; i++)
+	    aa[i] = code[i];
+    }
+
+    char translate(uint8_t b1, uint8_t b2, uint8_t b3) const {
+	if ((b1 | b2 | b3) & InvalidBase)
+	    return 'X';
+	return aa[(b1 << 4) | (b2 << 2) | b3];
+    }
+};
+
+/*! NCBI translation table 11 (bacterial, archaeal and plant plastid). */
+constexpr CodonTable BacterialCodonTable{"FFLLSSSSYY**CC*WLLLLPPPPHHQQRRRRIIIMTTTTNNKKSSRRVVVVAAAADDEEGGGG"};
+
+/*! @brief Translate one reading frame of dna into aa.
+
+  Frames 0..2 start at that offset of the forward strand; frames 3..5
+  start at offset frame - 3 of the reverse complement.
+*/
+inline void translate_frame(std::string_view dna, int frame, std::string &aa,
+			    const CodonTable &table = BacterialCodonTable)
+{
+    size_t len = dna.size();
+    int offset = frame % 3;
+    size_t n_codons = len > size_t(offset) ? (len - offset) / 3 : 0;
+    aa.resize(n_codons);
+
+    const unsigned char *s = reinterpret_cast<const unsigned char *>(dna.data());
+    if (frame < 3)
+    {
+	const unsigned char *p = s + offset;
+	for (size_t i = 0; i < n_codons; i++, p += 3)
+	    aa[i] = table.translate(table.base[p[0]], table.base[p[1]], table.base[p[2]]);
+    }
+    else
+    {
+	const unsigned char *p = s + len - 1 - offset;
+	for (size_t i = 0; i < n_codons; i++, p -= 3)
+	    aa[i] = table.translate(table.base[p[0]] ^ 2, table.base[p[-1]] ^ 2, table.base[p[-2]] ^ 2);
+    }
+}
+
+/*! @brief Translate dna in six frames and split each frame at stop codons.
+
+  For each stretch of at least min_len residues between stops, invoke
+  cb(frame, seg, first_codon), where seg is the translated stretch and
+  first_codon its codon index in the frame. seg is only valid for the
+  duration of the callback.
+*/
+template <typename CB>
+void for_each_frame_segment(std::string_view dna, size_t min_len, CB &&cb,
+			    const CodonTable &table = BacterialCodonTable)
+{
+    std::string aa;
+    for (int frame = 0; frame < 6; frame++)
+    {
+	translate_frame(dna, frame, aa, table);
+	size_t start = 0;
+	while (start < aa.size())
+	{
+	    size_t stop = aa.find('*', start);
+	    if (stop == std::string::npos)
+		stop = aa.size();
+	    if (stop - start >= min_len)
+		cb(frame, std::string_view(aa.data() + start, stop - start), start);
+	    start = stop + 1;
+	}
+    }
+}
+
+/*! @brief Convert a range of codons in a frame to 0-based forward strand coordinates.
+
+  Codons first .. last (inclusive) of frame in a sequence of length
+  dna_len cover bases left .. right (inclusive).
+*/
+inline void frame_codons_to_bases(int frame, size_t dna_len, size_t first, size_t last,
+				  size_t &left, size_t &right)
+{
+    size_t offset = frame % 3;
+    if (frame < 3)
+    {
+	left = offset + 3 * first;
+	right = offset + 3 * last + 2;
+    }
+    else
+    {
+	left = dna_len - 1 - (offset + 3 * last + 2);
+	right = dna_len - 1 - (offset + 3 * first);
+    }
+}
+
+#endif // _translation_h
@@ -1,23 +1,13 @@
 #include "cmph_kmer.h"
+#include "kmer_dispatch.h"
+#include "kmer_db_metadata.h"
 #include <regex>
 #include <fstream>
 
-int main(int argc, char **argv)
+template <int K, typename Alphabet>
+void test_cmph(const fs::path &base, const fs::path &kmer_file, char what)
 {
-    if (argc != 4) {
-	std::cerr << "usage: tst-cmph basename kmer-file [R|W]\n";
-	exit(1);
-    }
-    fs::path base = argv[1];
-    fs::path kmer_file = argv[2];
-    char what = argv[3][0];
-    CmphKmerDb<StoredKmerData, 8> kmer_db(base);
-
-    if (what != 'R' && what != 'W')
-    {
-	std::cerr << "usage: tst-cmph basename kmer-file [R|W]\n";
-	exit(1);
-    }
+    CmphKmerDb<StoredKmerData, K, Alphabet> kmer_db(base);
 
     if (what == 'W')
     {
@@ -27,7 +17,7 @@ int main(int argc, char **argv)
     }
     
     std::cerr << "Create mapping\n";
-    kmer_db.map_backing_data();
+    kmer_db.map_backing_data(what == 'W');
     std::cerr << "done\n";
 
     std::ifstream instr(kmer_file);
@@ -61,8 +51,50 @@ int main(int argc, char **argv)
 //	if (n++ > 10)
 //	    break;
     }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 4) {
+	std::cerr << "usage: tst-cmph basename kmer-file [R|W]\n";
+	exit(1);
+    }
+    fs::path base = argv[1];
+    fs::path kmer_file = argv[2];
+    char what = argv[3][0];
+
+    if (what != 'R' && what != 'W')
+    {
+	std::cerr << "usage: tst-cmph basename kmer-file [R|W]\n";
+	exit(1);
+    }
+
+    /*
+     * The kmer size and alphabet are those recorded in kmer.params in the
+     * directory of basename.
+     */
+    KmerDbMetadata meta;
+    try {
+	meta.read(base.has_parent_path() ? base.parent_path() : fs::path("."));
+    }
+    catch (std::exception &x)
+    {
+	std::cerr << x.what() << "\n";
+	exit(1);
+    }
+
+    std::ifstream instr(kmer_file);
+    std::string line;
+    std::getline(instr, line);
+    if (static_cast<int>(line.find('\t')) != meta.kmer_size)
+    {
+	std::cerr << "kmers in " << kmer_file << " are not of the database kmer size " << meta.kmer_size << "\n";
+	exit(1);
+    }
+
+    dispatch_kmer_encoding(meta.kmer_size, meta.alphabet, [&base, &kmer_file, what](auto kc, auto alphabet) {
+	test_cmph<decltype(kc)::value, decltype(alphabet)>(base, kmer_file, what);
+    });
 
-    
-    
     return 0;
 }
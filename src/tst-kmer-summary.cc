@@ -0,0 +1,158 @@
+/*
+ * Compare the kmer selection of the online summaries with the exact
+ * selection of process_kmer_set(): keep a kmer if its best function has
+ * at least 80% of its occurrences.
+ *
+ * The online selection may reject kmers the exact selection keeps, but
+ * must never keep one it rejects or choose a different function.
+ */
+
+#include "kmer_summary.h"
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <random>
+#include <vector>
+
+struct Occurrence
+{
+    FunctionIndex func;
+    unsigned short offset;
+    unsigned short protein_length;
+};
+
+static bool exact_keep(const std::vector<Occurrence> &occ, FunctionIndex &best_func)
+{
+    std::map<FunctionIndex, int> func_count;
+    for (auto &o: occ)
+	func_count[o.func]++;
+    int best_count = -1;
+    for (auto &x: func_count)
+    {
+	if (x.second > best_count)
+	{
+	    best_func = x.first;
+	    best_count = x.second;
+	}
+    }
+    return (float) best_count >= float(occ.size()) * 0.8f;
+}
+
+static bool online_keep(const std::vector<Occurrence> &occ, FunctionIndex &best_func)
+{
+    KmerSummary summary;
+    for (auto &o: occ)
+	summary.add(o.func, o.offset, o.protein_length);
+    const FunctionSlot *best = summary.best();
+    if (!best || (float) best->count < float(summary.count()) * 0.8f)
+	return false;
+    best_func = best->func_index;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int failures = 0;
+
+    /*
+     * Function 1 has 16 of 20 occurrences, exactly the threshold. Functions
+     * 2 and 3 take the free slots and function 4 finds none, so one
+     * occurrence of function 1 is decremented away; with a count of 15 the
+     * online selection rejects the kmer.
+     */
+    std::vector<Occurrence> pinned;
+    for (int i = 0; i < 8; i++)
+	pinned.push_back(Occurrence { 1, 10, 300 });
+    for (FunctionIndex f = 2; f <= 5; f++)
+	pinned.push_back(Occurrence { f, 10, 300 });
+    for (int i = 0; i < 8; i++)
+	pinned.push_back(Occurrence { 1, 10, 300 });
+
+    FunctionIndex exact_func = UndefinedFunction, online_func = UndefinedFunction;
+    if (!exact_keep(pinned, exact_func) || exact_func != 1)
+    {
+	std::cerr << "pinned kmer: expected the exact selection to keep function 1\n";
+	failures++;
+    }
+    if (online_keep(pinned, online_func))
+    {
+	std::cerr << "pinned kmer: expected the online selection to reject it\n";
+	failures++;
+    }
+
+    /*
+     * Random kmers with a dominant function near the threshold and a
+     * tail of other functions, in random order.
+     */
+    std::mt19937 rng(argc > 1 ? std::stoul(argv[1]) : 1);
+    std::uniform_int_distribution<int> n_dist(1, 60);
+    std::uniform_real_distribution<double> share_dist(0.7, 1.0);
+    std::uniform_int_distribution<int> tail_funcs_dist(1, 8);
+
+    const int n_kmers = 200000;
+    int n_both = 0, n_exact_only = 0, n_online_only = 0, n_func_differs = 0, n_few_funcs_rejected = 0;
+    for (int k = 0; k < n_kmers; k++)
+    {
+	int n = n_dist(rng);
+	int n_best = std::max(1, int(n * share_dist(rng) + 0.5));
+	int n_tail_funcs = tail_funcs_dist(rng);
+	std::uniform_int_distribution<int> tail_dist(2, n_tail_funcs + 1);
+
+	std::vector<Occurrence> occ;
+	std::map<FunctionIndex, int> funcs;
+	for (int i = 0; i < n; i++)
+	{
+	    FunctionIndex f = i < n_best ? 1 : static_cast<FunctionIndex>(tail_dist(rng));
+	    occ.push_back(Occurrence { f, static_cast<unsigned short>(rng() % 200),
+			static_cast<unsigned short>(200 + rng() % 400) });
+	    funcs[f]++;
+	}
+	std::shuffle(occ.begin(), occ.end(), rng);
+
+	bool exact = exact_keep(occ, exact_func);
+	bool online = online_keep(occ, online_func);
+	if (exact && online)
+	{
+	    n_both++;
+	    if (exact_func != online_func)
+		n_func_differs++;
+	}
+	else if (exact)
+	{
+	    n_exact_only++;
+	    if (funcs.size() <= size_t(OnlineFunctionSlots))
+		n_few_funcs_rejected++;
+	}
+	else if (online)
+	    n_online_only++;
+    }
+
+    std::cout << n_kmers << " kmers: " << n_both << " kept by both, "
+	      << n_exact_only << " only by the exact selection, "
+	      << n_online_only << " only by the online selection\n";
+
+    if (n_online_only > 0)
+    {
+	std::cerr << n_online_only << " kmers kept online but rejected by the exact selection\n";
+	failures++;
+    }
+    if (n_func_differs > 0)
+    {
+	std::cerr << n_func_differs << " kept kmers with a different function online\n";
+	failures++;
+    }
+    if (n_few_funcs_rejected > 0)
+    {
+	std::cerr << n_few_funcs_rejected << " kmers with at most " << OnlineFunctionSlots
+		  << " functions rejected online\n";
+	failures++;
+    }
+    if (n_exact_only == 0)
+    {
+	std::cerr << "expected some kmers with a tail of functions to be rejected online\n";
+	failures++;
+    }
+
+    return failures == 0 ? 0 : 1;
+}
@@ -1,20 +1,20 @@
 #include "cmph_kmer.h"
+#include "kmer_dispatch.h"
+#include "kmer_db_metadata.h"
 #include <regex>
 #include <fstream>
 
 /*! Read a final.kmers file and create the mmap data file.
+ *
+ * The kmer size and alphabet are taken from the kmer.params file in the
+ * directory of basename, as written by kmers-build-signatures; the kmers
+ * in final.kmers are encoded with that alphabet.
  */
 
-int main(int argc, char **argv)
+template <int K, typename Alphabet>
+void write_cmph(const fs::path &base, const fs::path &kmer_file)
 {
-    if (argc != 3) {
-	std::cerr << "usage: tst-cmph basename kmer-file\n";
-	exit(1);
-    }
-    fs::path base = argv[1];
-    fs::path kmer_file = argv[2];
-
-    CmphKmerDb<StoredKmerData, 8> kmer_db(base);
+    CmphKmerDb<StoredKmerData, K, Alphabet> kmer_db(base);
 
     std::ifstream instr(kmer_file);
 
@@ -44,6 +44,39 @@ int main(int argc, char **argv)
 //	    break;
     }
     std::cerr << "done initializing\n";
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+	std::cerr << "usage: write-cmph-from-kmers basename kmer-file\n";
+	exit(1);
+    }
+    fs::path base = argv[1];
+    fs::path kmer_file = argv[2];
+
+    KmerDbMetadata meta;
+    try {
+	meta.read(base.has_parent_path() ? base.parent_path() : fs::path("."));
+    }
+    catch (std::exception &x)
+    {
+	std::cerr << x.what() << "\n";
+	exit(1);
+    }
+
+    std::ifstream instr(kmer_file);
+    std::string line;
+    std::getline(instr, line);
+    if (static_cast<int>(line.find('\t')) != meta.kmer_size)
+    {
+	std::cerr << "kmers in " << kmer_file << " are not of the database kmer size " << meta.kmer_size << "\n";
+	exit(1);
+    }
+
+    dispatch_kmer_encoding(meta.kmer_size, meta.alphabet, [&base, &kmer_file](auto kc, auto alphabet) {
+	write_cmph<decltype(kc)::value, decltype(alphabet)>(base, kmer_file);
+    });
 
     return 0;
 }